@@ -4,8 +4,18 @@
 
 import sys
 
+# single precision: the state vector holds std::complex<float> and each register fits twice as many amplitudes
+single = False
+
 
 def avx_type(complex_avx_len):
+  if single:
+    if complex_avx_len == 2:
+      return "__m128"
+    elif complex_avx_len == 4:
+      return "__m256"
+    else:
+      raise Exception("Unknown avx type.")
   if complex_avx_len == 2:
     return "__m256d"
   elif complex_avx_len == 4:
@@ -17,6 +27,13 @@ def avx_type(complex_avx_len):
 
 
 def avx_prefix(complex_avx_len):
+  if single:
+    if complex_avx_len == 2:
+      return "_mm"
+    elif complex_avx_len == 4:
+      return "_mm256"
+    else:
+      raise Exception("Unknown avx type.")
   if complex_avx_len == 2:
     return "_mm256"
   elif complex_avx_len == 4:
@@ -25,6 +42,19 @@ def avx_prefix(complex_avx_len):
     raise Exception("Unknown avx type.")
 
 
+def avx_suffix():
+  return "_ps" if single else "_pd"
+
+
+# name of the cintrin.hpp helper, e.g. loada -> loadaf for single precision
+def intrin_name(name, complex_avx_len):
+  if not single:
+    return name
+  if name == "load1":
+    return "load1x" + str(complex_avx_len) + "f"
+  return name + "f"
+
+
 def generate_kernel_core(N, n, kernelarray, blocks, only_one_matrix, unroll_loops, avx_len):
   indent = 1
   
@@ -47,14 +77,14 @@ def generate_kernel_core(N, n, kernelarray, blocks, only_one_matrix, unroll_loop
 
   add = ["\t" + avx_type(avx_len) + " v[" + str(int(N/blocks)) + "];\n"]
   for b in range(blocks):
-    if avx_len == 4:
+    if avx_len == 4 and not single:
       x4 = "x4"
     else:
       x4 = ""
     for num in range(int(N/blocks)*b, int(N/blocks)*(b+1)):
       add.append("\n\tv[" + str(int(num % (N/blocks))) + "] = ")
       if avx_len > 1:
-        add.append("load1" + x4 + "(&")
+        add.append(intrin_name("load1", avx_len) + x4 + "(&")
       add.append("psi[" + indices[num] + "]")
       if avx_len > 1:
         add.append(")")
@@ -64,7 +94,7 @@ def generate_kernel_core(N, n, kernelarray, blocks, only_one_matrix, unroll_loop
       add.append("\n\t" + avx_type(avx_len) + " tmp[" + str(int(N/avx_len)) + "] = {")
       for i in range(int(N/avx_len)):
         if avx_len > 1:
-          add.append(avx_prefix(avx_len) + "_setzero_pd(), ")
+          add.append(avx_prefix(avx_len) + "_setzero" + avx_suffix() + "(), ")
         else:
           add.append("0., ")
       add[-1] = add[-1][:-2] + "};\n"
@@ -105,10 +135,10 @@ def generate_kernel_core(N, n, kernelarray, blocks, only_one_matrix, unroll_loop
           if b == blocks-1:
             add.append("\n\t")
             if avx_len > 1:
-              add.append("store(")
+              add.append(intrin_name("store", avx_len) + "(")
             for i in range(avx_len):
               if avx_len > 1:
-                add.append("(double*)&")
+                add.append("(float*)&" if single else "(double*)&")
               add.append("psi[" + indices[avx_len*r+avx_len-i-1] + "], ")
             if avx_len == 1:
               add[-1] = add[-1][:-2] + " = "
@@ -128,10 +158,10 @@ def generate_kernel_core(N, n, kernelarray, blocks, only_one_matrix, unroll_loop
         for r in range(int(N/avx_len)):
           add.append("\n\t")
           if avx_len > 1:
-            add.append("store(")
+            add.append(intrin_name("store", avx_len) + "(")
           for i in range(avx_len):
             if avx_len > 1:
-              add.append("(double*)&")
+              add.append("(float*)&" if single else "(double*)&")
             add.append("psi[" + indices[avx_len*r+avx_len-i-1] + "], ")
           if avx_len == 1:
             add[-1] = add[-1][:-2] + " = "
@@ -145,6 +175,37 @@ def generate_kernel_core(N, n, kernelarray, blocks, only_one_matrix, unroll_loop
   kernelarray.append("".join(add))
   kernelarray.append("\n}\n\n")
 
+# Loop over the indices with all controls set and all targets cleared only: k enumerates the other (free) bits, which
+# are spread over their positions by inserting a zero at each fixed (target or control) position, like pdep would, so
+# that with c controls the loop runs 2^c times fewer iterations than a loop over all indices that skips the others.
+# The indices below the lowest fixed position are contiguous, so the bits are only spread once per chunk of those.
+def generate_controlled_loop(n, only_one_matrix, indent):
+  t = "\t"*indent
+  lines = [t + "// only the indices with all controls set, the free bits of k are spread over the other positions\n"]
+  lines.append(t + "std::size_t fixedmask = ctrlmask")
+  for i in range(n):
+    lines.append(" | dsorted[" + str(i) + "]")
+  lines.append(";\n")
+  lines.append(t + "unsigned fixed[64];\n")
+  lines.append(t + "unsigned nfixed = 0;\n")
+  lines.append(t + "for (unsigned p = 0; p < 64; ++p)\n")
+  lines.append(t + "\tif ((fixedmask >> p) & 1) fixed[nfixed++] = p;\n")
+  lines.append(t + "std::size_t nfree = n >> nfixed;\n")
+  lines.append(t + "std::size_t chunk = std::min<std::size_t>(fixedmask & (~fixedmask + 1), std::max<std::size_t>(1, nfree >> 6));\n")
+  lines.append(t + "#pragma omp parallel for schedule(static)\n")
+  lines.append(t + "for (std::intptr_t k = 0; k < static_cast<std::intptr_t>(nfree / chunk); ++k){\n")
+  lines.append(t + "\tstd::size_t i = static_cast<std::size_t>(k) * chunk;\n")
+  lines.append(t + "\tfor (unsigned f = 0; f < nfixed; ++f)\n")
+  lines.append(t + "\t\ti = ((i >> fixed[f]) << (fixed[f] + 1)) | (i & ((1ULL << fixed[f]) - 1));\n")
+  lines.append(t + "\ti |= ctrlmask;\n")
+  lines.append(t + "\tfor (std::size_t j = 0; j < chunk; ++j)\n")
+  lines.append(t + "\t\tkernel_core(psi, i + j")
+  for i in range(n):
+    lines.append(", dsorted[" + str(n-1-i) + "]")
+  lines.append(", mm);\n" if only_one_matrix else ", mm, mmt);\n")
+  lines.append(t + "}\n")
+  return "".join(lines)
+
 def generate_kernel(n, blocks, only_one_matrix, unroll_loops, avx_len):
   kernel = ""
   
@@ -200,6 +261,7 @@ def generate_kernel(n, blocks, only_one_matrix, unroll_loops, avx_len):
       add.append("loada")
       if only_one_matrix:
         add[-1] = add[-1]+"b"
+      add[-1] = intrin_name(add[-1], avx_len)
       add.append("(")
       for i in range(avx_len):
         add.append("&m["+str(avx_len)+"*r+"+str(i)+"][c+b*"+str(int(N/blocks))+"], ")
@@ -226,7 +288,7 @@ def generate_kernel(n, blocks, only_one_matrix, unroll_loops, avx_len):
                "\n\t\tfor (unsigned r = 0; r < " + str(int(N/avx_len)) + "; ++r){"
                "\n\t\t\tfor (unsigned c = 0; c < " + str(int(N/blocks)) + "; ++c){"
                "\n\t\t\t\tmmt[b*"+str(int(N/avx_len)*int(N/blocks))+"+r*"+str(int(N/blocks))+"+c]"
-               " = loadbm(")
+               " = " + intrin_name("loadbm", avx_len) + "(")
     for i in range(avx_len):
       add.append("&m["+str(avx_len)+"*r+"+str(i)+"][c+b*"+str(int(N/blocks))+"], ")
     add[-1] = add[-1][:-2] + ");\n\t\t\t}\n\t\t}\n\t}\n"
@@ -275,44 +337,9 @@ def generate_kernel(n, blocks, only_one_matrix, unroll_loops, avx_len):
   kernelarray.append("".join(add))
 
   # if controlmask != 0
-  indent = 1
-  kernelarray.append("\t"*indent + "else{\n")
-  indent += 1
-  kernelarray.append("\t"*indent + "#pragma omp parallel for collapse(LOOP_COLLAPSE"+str(n)+") schedule(static)\n" + "\t"*indent + "for (std::size_t i0 = 0; i0 < n; i0 += 2 * dsorted[0]){\n")
-  indent = indent + 1
-  for i in range(1,nc+1):
-    kernelarray.append("\t"*indent + "for (std::size_t i"+str(i)+" = 0; i"+str(i)+" < dsorted["+str(i-1) + "]; i"+str(i)+" += 2 * dsorted["+str(i)+"]){\n")
-    indent = indent + 1
-
-  kernelarray.append("\t"*indent + "for (std::size_t i"+str(nc+1)+" = 0; i"+str(nc+1)+" < dsorted["+str(nc)+"]; ++i"+str(nc+1)+"){\n")
-  indent = indent + 1
-
-  # inner-most loop: call kernel core
-
-  kernelarray.append("\t"*indent + "if (((i0")
-  add = []
-  for i in range(n):
-    add.append(" + i"+str(i+1))
-  kernelarray.append("".join(add))
-  kernelarray.append(")&ctrlmask) == ctrlmask)\n")
-  kernelarray.append("\t"*(indent+1) + "kernel_core(psi, i0")
-  add = []
-  for i in range(n):
-    add.append(" + i"+str(i+1))
-  kernelarray.append("".join(add))
-  for i in range(n):
-    kernelarray.append(", dsorted[" + str(n-1-i) + "]")
-
-  if only_one_matrix:
-    kernelarray.append(", mm);\n")
-  else:
-    kernelarray.append(", mm, mmt);\n")
-
-  #end for(s) and if
-  add = [""]*indent
-  for i in range(indent-1,0,-1):
-    add[indent-1-i] = "\t"*i+"}\n"
-  kernelarray.append("".join(add))
+  kernelarray.append("\telse{\n")
+  kernelarray.append(generate_controlled_loop(n, only_one_matrix, 2))
+  kernelarray.append("\t}\n")
 
 
 ################ Start of _MSC_VER code block ##################
@@ -332,13 +359,7 @@ def generate_kernel(n, blocks, only_one_matrix, unroll_loops, avx_len):
   else:                                 kernelarray.append(", mm, mmt);\n")
   # if controlmask != 0
   kernelarray.append("     } else {\n")
-  kernelarray.append("        #pragma omp parallel for schedule(static)\n")
-  kernelarray.append("        for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)\n")
-  kernelarray.append("            if ((i & ctrlmask) == ctrlmask && (i & dmask) == zero)\n")
-  kernelarray.append("                kernel_core(psi, i")
-  for i in range(n):                    kernelarray.append(", dsorted[" + str(n-1-i) + "]")
-  if only_one_matrix:                   kernelarray.append(", mm);\n")
-  else:                                 kernelarray.append(", mm, mmt);\n")
+  kernelarray.append(generate_controlled_loop(n, only_one_matrix, 2).replace("\t", "    "))
   kernelarray.append("     }\n")
   kernelarray.append("#endif\n")
 
@@ -384,7 +405,7 @@ def generate_main(n):
 #####################################################
 
 if len(sys.argv) < 2:
-  print("Generates the code for an n-qubit gate.\nUsage:\n./codegen_fma.py [n_qubits] {n_blocks} {only one matrix?} {unroll loops?} {none|avx2|avx512}\n\n")
+  print("Generates the code for an n-qubit gate.\nUsage:\n./codegen_fma.py [n_qubits] {n_blocks} {only one matrix?} {unroll loops?} {none|avx2|avx512|avx2f}\n\n")
   exit()
 
 n = int(sys.argv[1]) # number of qubits
@@ -410,6 +431,9 @@ try:
     avx = 4
   elif avx == "avx2" or avx == "avx":
     avx = 2
+  elif avx == "avx2f":
+    avx = 4
+    single = True
   elif avx == "none":
     avx = 1
     only_one_matrix = True
@@ -12,7 +12,7 @@ unroll=(1 1 1 1 1 1 0 0) # g++ best
 #unroll=(1 1 1 0 0 1 0 0) # icc best
 #unroll=(0 0 0 0 0 0 0 0)
 
-# register length to use: can be none, avx2, or avx512
+# register length to use: can be none, avx2, or avx512 (avx2f for the single-precision kernels)
 avx=avx2
 
 # blocking: must be a power of two and at most 2^k for a k-qubit gate
@@ -25,4 +25,5 @@ do
 	./codegen_fma.py $i ${b[$i]} ${onematrix[$i]} ${unroll[$i]} avx > ../avx/kernel${i}.hpp
 	./codegen_fma.py $i ${b[$i]} ${onematrix[$i]} ${unroll[$i]} avx2 > ../avx2/kernel${i}.hpp
   ./codegen_fma.py $i ${b[$i]} ${onematrix[$i]} ${unroll[$i]} avx512 > ../avx512/kernel${i}.hpp
+  ./codegen_fma.py $i ${b[$i]} ${onematrix[$i]} ${unroll[$i]} avx2f > ../avx2f/kernel${i}.hpp
 done
@@ -22,7 +22,7 @@ inline void kernel_core(V& psi, std::size_t I, std::size_t d0, M const& m, M con
 template <class V, class M>
 void kernel(V& psi, unsigned id0, M const& matrix, std::size_t ctrlmask)
 {
-    std::size_t n = psi.size();
+     std::size_t n = psi.size();
 	std::size_t d0 = 1ULL << id0;
 	auto m = matrix;
 	std::size_t dsorted[] = {d0};
@@ -57,29 +57,52 @@ void kernel(V& psi, unsigned id0, M const& matrix, std::size_t ctrlmask)
 		}
 	}
 	else{
-		#pragma omp parallel for collapse(LOOP_COLLAPSE1) schedule(static)
-		for (std::size_t i0 = 0; i0 < n; i0 += 2 * dsorted[0]){
-			for (std::size_t i1 = 0; i1 < dsorted[0]; ++i1){
-				if (((i0 + i1)&ctrlmask) == ctrlmask)
-					kernel_core(psi, i0 + i1, dsorted[0], mm, mmt);
-			}
+		// only the indices with all controls set, the free bits of k are spread over the other positions
+		std::size_t fixedmask = ctrlmask | dsorted[0];
+		unsigned fixed[64];
+		unsigned nfixed = 0;
+		for (unsigned p = 0; p < 64; ++p)
+			if ((fixedmask >> p) & 1) fixed[nfixed++] = p;
+		std::size_t nfree = n >> nfixed;
+		std::size_t chunk = std::min<std::size_t>(fixedmask & (~fixedmask + 1), std::max<std::size_t>(1, nfree >> 6));
+		#pragma omp parallel for schedule(static)
+		for (std::intptr_t k = 0; k < static_cast<std::intptr_t>(nfree / chunk); ++k){
+			std::size_t i = static_cast<std::size_t>(k) * chunk;
+			for (unsigned f = 0; f < nfixed; ++f)
+				i = ((i >> fixed[f]) << (fixed[f] + 1)) | (i & ((1ULL << fixed[f]) - 1));
+			i |= ctrlmask;
+			for (std::size_t j = 0; j < chunk; ++j)
+				kernel_core(psi, i + j, dsorted[0], mm, mmt);
 		}
 	}
 #else
-	std::intptr_t zero = 0;
-	std::intptr_t dmask = dsorted[0];
+    std::intptr_t zero = 0;
+    std::intptr_t dmask = dsorted[0];
 
-	if (ctrlmask == 0){
-		#pragma omp parallel for schedule(static)
-		for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)
-			if ((i & dmask) == zero)
-				kernel_core(psi, i, dsorted[0], mm, mmt);
-	} else {
-		#pragma omp parallel for schedule(static)
-		for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)
-			if ((i & ctrlmask) == ctrlmask && (i & dmask) == zero)
-				kernel_core(psi, i, dsorted[0], mm, mmt);
-	}
+    if (ctrlmask == 0){
+        #pragma omp parallel for schedule(static)
+        for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)
+            if ((i & dmask) == zero)
+                kernel_core(psi, i, dsorted[0], mm, mmt);
+     } else {
+        // only the indices with all controls set, the free bits of k are spread over the other positions
+        std::size_t fixedmask = ctrlmask | dsorted[0];
+        unsigned fixed[64];
+        unsigned nfixed = 0;
+        for (unsigned p = 0; p < 64; ++p)
+            if ((fixedmask >> p) & 1) fixed[nfixed++] = p;
+        std::size_t nfree = n >> nfixed;
+        std::size_t chunk = std::min<std::size_t>(fixedmask & (~fixedmask + 1), std::max<std::size_t>(1, nfree >> 6));
+        #pragma omp parallel for schedule(static)
+        for (std::intptr_t k = 0; k < static_cast<std::intptr_t>(nfree / chunk); ++k){
+            std::size_t i = static_cast<std::size_t>(k) * chunk;
+            for (unsigned f = 0; f < nfixed; ++f)
+                i = ((i >> fixed[f]) << (fixed[f] + 1)) | (i & ((1ULL << fixed[f]) - 1));
+            i |= ctrlmask;
+            for (std::size_t j = 0; j < chunk; ++j)
+                kernel_core(psi, i + j, dsorted[0], mm, mmt);
+        }
+     }
 #endif
 }
 
@@ -409,41 +409,52 @@ void kernel(V& psi, unsigned id6, unsigned id5, unsigned id4, unsigned id3, unsi
 		}
 	}
 	else{
-		#pragma omp parallel for collapse(LOOP_COLLAPSE7) schedule(static)
-		for (std::size_t i0 = 0; i0 < n; i0 += 2 * dsorted[0]){
-			for (std::size_t i1 = 0; i1 < dsorted[0]; i1 += 2 * dsorted[1]){
-				for (std::size_t i2 = 0; i2 < dsorted[1]; i2 += 2 * dsorted[2]){
-					for (std::size_t i3 = 0; i3 < dsorted[2]; i3 += 2 * dsorted[3]){
-						for (std::size_t i4 = 0; i4 < dsorted[3]; i4 += 2 * dsorted[4]){
-							for (std::size_t i5 = 0; i5 < dsorted[4]; i5 += 2 * dsorted[5]){
-								for (std::size_t i6 = 0; i6 < dsorted[5]; i6 += 2 * dsorted[6]){
-									for (std::size_t i7 = 0; i7 < dsorted[6]; ++i7){
-										if (((i0 + i1 + i2 + i3 + i4 + i5 + i6 + i7)&ctrlmask) == ctrlmask)
-											kernel_core(psi, i0 + i1 + i2 + i3 + i4 + i5 + i6 + i7, dsorted[6], dsorted[5], dsorted[4], dsorted[3], dsorted[2], dsorted[1], dsorted[0], mm);
-									}
-								}
-							}
-						}
-					}
-				}
-			}
+		// only the indices with all controls set, the free bits of k are spread over the other positions
+		std::size_t fixedmask = ctrlmask | dsorted[0] | dsorted[1] | dsorted[2] | dsorted[3] | dsorted[4] | dsorted[5] | dsorted[6];
+		unsigned fixed[64];
+		unsigned nfixed = 0;
+		for (unsigned p = 0; p < 64; ++p)
+			if ((fixedmask >> p) & 1) fixed[nfixed++] = p;
+		std::size_t nfree = n >> nfixed;
+		std::size_t chunk = std::min<std::size_t>(fixedmask & (~fixedmask + 1), std::max<std::size_t>(1, nfree >> 6));
+		#pragma omp parallel for schedule(static)
+		for (std::intptr_t k = 0; k < static_cast<std::intptr_t>(nfree / chunk); ++k){
+			std::size_t i = static_cast<std::size_t>(k) * chunk;
+			for (unsigned f = 0; f < nfixed; ++f)
+				i = ((i >> fixed[f]) << (fixed[f] + 1)) | (i & ((1ULL << fixed[f]) - 1));
+			i |= ctrlmask;
+			for (std::size_t j = 0; j < chunk; ++j)
+				kernel_core(psi, i + j, dsorted[6], dsorted[5], dsorted[4], dsorted[3], dsorted[2], dsorted[1], dsorted[0], mm);
 		}
 	}
 #else
-	std::intptr_t zero = 0;
-	std::intptr_t dmask = dsorted[0] + dsorted[1] + dsorted[2] + dsorted[3] + dsorted[4] + dsorted[5] + dsorted[6];
-
-	if (ctrlmask == 0){
-		#pragma omp parallel for schedule(static)
-		for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)
-			if ((i & dmask) == zero)
-				kernel_core(psi, i, dsorted[6], dsorted[5], dsorted[4], dsorted[3], dsorted[2], dsorted[1], dsorted[0], mm);
-	} else {
-		#pragma omp parallel for schedule(static)
-		for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)
-			if ((i & ctrlmask) == ctrlmask && (i & dmask) == zero)
-				kernel_core(psi, i, dsorted[6], dsorted[5], dsorted[4], dsorted[3], dsorted[2], dsorted[1], dsorted[0], mm);
-	}
+    std::intptr_t zero = 0;
+    std::intptr_t dmask = dsorted[0] + dsorted[1] + dsorted[2] + dsorted[3] + dsorted[4] + dsorted[5] + dsorted[6];
+
+    if (ctrlmask == 0){
+        #pragma omp parallel for schedule(static)
+        for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)
+            if ((i & dmask) == zero)
+                kernel_core(psi, i, dsorted[6], dsorted[5], dsorted[4], dsorted[3], dsorted[2], dsorted[1], dsorted[0], mm);
+     } else {
+        // only the indices with all controls set, the free bits of k are spread over the other positions
+        std::size_t fixedmask = ctrlmask | dsorted[0] | dsorted[1] | dsorted[2] | dsorted[3] | dsorted[4] | dsorted[5] | dsorted[6];
+        unsigned fixed[64];
+        unsigned nfixed = 0;
+        for (unsigned p = 0; p < 64; ++p)
+            if ((fixedmask >> p) & 1) fixed[nfixed++] = p;
+        std::size_t nfree = n >> nfixed;
+        std::size_t chunk = std::min<std::size_t>(fixedmask & (~fixedmask + 1), std::max<std::size_t>(1, nfree >> 6));
+        #pragma omp parallel for schedule(static)
+        for (std::intptr_t k = 0; k < static_cast<std::intptr_t>(nfree / chunk); ++k){
+            std::size_t i = static_cast<std::size_t>(k) * chunk;
+            for (unsigned f = 0; f < nfixed; ++f)
+                i = ((i >> fixed[f]) << (fixed[f] + 1)) | (i & ((1ULL << fixed[f]) - 1));
+            i |= ctrlmask;
+            for (std::size_t j = 0; j < chunk; ++j)
+                kernel_core(psi, i + j, dsorted[6], dsorted[5], dsorted[4], dsorted[3], dsorted[2], dsorted[1], dsorted[0], mm);
+        }
+     }
 #endif
 }
 
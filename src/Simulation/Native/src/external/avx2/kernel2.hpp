@@ -73,31 +73,52 @@ void kernel(V& psi, unsigned id1, unsigned id0, M const& matrix, std::size_t ctr
 		}
 	}
 	else{
-		#pragma omp parallel for collapse(LOOP_COLLAPSE2) schedule(static)
-		for (std::size_t i0 = 0; i0 < n; i0 += 2 * dsorted[0]){
-			for (std::size_t i1 = 0; i1 < dsorted[0]; i1 += 2 * dsorted[1]){
-				for (std::size_t i2 = 0; i2 < dsorted[1]; ++i2){
-					if (((i0 + i1 + i2)&ctrlmask) == ctrlmask)
-						kernel_core(psi, i0 + i1 + i2, dsorted[1], dsorted[0], mm, mmt);
-				}
-			}
+		// only the indices with all controls set, the free bits of k are spread over the other positions
+		std::size_t fixedmask = ctrlmask | dsorted[0] | dsorted[1];
+		unsigned fixed[64];
+		unsigned nfixed = 0;
+		for (unsigned p = 0; p < 64; ++p)
+			if ((fixedmask >> p) & 1) fixed[nfixed++] = p;
+		std::size_t nfree = n >> nfixed;
+		std::size_t chunk = std::min<std::size_t>(fixedmask & (~fixedmask + 1), std::max<std::size_t>(1, nfree >> 6));
+		#pragma omp parallel for schedule(static)
+		for (std::intptr_t k = 0; k < static_cast<std::intptr_t>(nfree / chunk); ++k){
+			std::size_t i = static_cast<std::size_t>(k) * chunk;
+			for (unsigned f = 0; f < nfixed; ++f)
+				i = ((i >> fixed[f]) << (fixed[f] + 1)) | (i & ((1ULL << fixed[f]) - 1));
+			i |= ctrlmask;
+			for (std::size_t j = 0; j < chunk; ++j)
+				kernel_core(psi, i + j, dsorted[1], dsorted[0], mm, mmt);
 		}
 	}
 #else
-	std::intptr_t zero = 0;
-	std::intptr_t dmask = dsorted[0] + dsorted[1];
-
-	if (ctrlmask == 0){
-		#pragma omp parallel for schedule(static)
-		for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)
-			if ((i & dmask) == zero)
-				kernel_core(psi, i, dsorted[1], dsorted[0], mm, mmt);
-	} else {
-		#pragma omp parallel for schedule(static)
-		for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)
-			if ((i & ctrlmask) == ctrlmask && (i & dmask) == zero)
-				kernel_core(psi, i, dsorted[1], dsorted[0], mm, mmt);
-	}
+    std::intptr_t zero = 0;
+    std::intptr_t dmask = dsorted[0] + dsorted[1];
+
+    if (ctrlmask == 0){
+        #pragma omp parallel for schedule(static)
+        for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)
+            if ((i & dmask) == zero)
+                kernel_core(psi, i, dsorted[1], dsorted[0], mm, mmt);
+     } else {
+        // only the indices with all controls set, the free bits of k are spread over the other positions
+        std::size_t fixedmask = ctrlmask | dsorted[0] | dsorted[1];
+        unsigned fixed[64];
+        unsigned nfixed = 0;
+        for (unsigned p = 0; p < 64; ++p)
+            if ((fixedmask >> p) & 1) fixed[nfixed++] = p;
+        std::size_t nfree = n >> nfixed;
+        std::size_t chunk = std::min<std::size_t>(fixedmask & (~fixedmask + 1), std::max<std::size_t>(1, nfree >> 6));
+        #pragma omp parallel for schedule(static)
+        for (std::intptr_t k = 0; k < static_cast<std::intptr_t>(nfree / chunk); ++k){
+            std::size_t i = static_cast<std::size_t>(k) * chunk;
+            for (unsigned f = 0; f < nfixed; ++f)
+                i = ((i >> fixed[f]) << (fixed[f] + 1)) | (i & ((1ULL << fixed[f]) - 1));
+            i |= ctrlmask;
+            for (std::size_t j = 0; j < chunk; ++j)
+                kernel_core(psi, i + j, dsorted[1], dsorted[0], mm, mmt);
+        }
+     }
 #endif
 }
 
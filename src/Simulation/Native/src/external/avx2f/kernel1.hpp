@@ -0,0 +1,108 @@
+// (C) 2018 ETH Zurich, ITP, Thomas Häner and Damian Steiger
+
+template <class V, class M>
+inline void kernel_core(V& psi, std::size_t I, std::size_t d0, M const& m, M const& mt)
+{
+	__m128 v[1];
+
+	v[0] = load1x2f(&psi[I]);
+
+	__m128 tmp[1] = {_mm_setzero_ps()};
+
+	tmp[0] = fma(v[0], m[0], mt[0], tmp[0]);
+
+	v[0] = load1x2f(&psi[I + d0]);
+
+	tmp[0] = fma(v[0], m[1], mt[1], tmp[0]);
+	storef((float*)&psi[I + d0], (float*)&psi[I], tmp[0]);
+
+}
+
+// bit indices id[.] are given from high to low (e.g. control first for CNOT)
+template <class V, class M>
+void kernel(V& psi, unsigned id0, M const& matrix, std::size_t ctrlmask)
+{
+     std::size_t n = psi.size();
+	std::size_t d0 = 1ULL << id0;
+	auto m = matrix;
+	std::size_t dsorted[] = {d0};
+	permute_qubits_and_matrix(dsorted, 1, m);
+
+	__m128 mm[2];
+	for (unsigned b = 0; b < 2; ++b){
+		for (unsigned r = 0; r < 1; ++r){
+			for (unsigned c = 0; c < 1; ++c){
+				mm[b*1+r*1+c] = loadaf(&m[2*r+0][c+b*1], &m[2*r+1][c+b*1]);
+			}
+		}
+	}
+
+	__m128 mmt[2];
+	for (unsigned b = 0; b < 2; ++b){
+		for (unsigned r = 0; r < 1; ++r){
+			for (unsigned c = 0; c < 1; ++c){
+				mmt[b*1+r*1+c] = loadbmf(&m[2*r+0][c+b*1], &m[2*r+1][c+b*1]);
+			}
+		}
+	}
+
+
+#ifndef _MSC_VER
+	if (ctrlmask == 0){
+		#pragma omp parallel for collapse(LOOP_COLLAPSE1) schedule(static) proc_bind(spread)
+		for (std::size_t i0 = 0; i0 < n; i0 += 2 * dsorted[0]){
+			for (std::size_t i1 = 0; i1 < dsorted[0]; ++i1){
+				kernel_core(psi, i0 + i1, dsorted[0], mm, mmt);
+			}
+		}
+	}
+	else{
+		// only the indices with all controls set, the free bits of k are spread over the other positions
+		std::size_t fixedmask = ctrlmask | dsorted[0];
+		unsigned fixed[64];
+		unsigned nfixed = 0;
+		for (unsigned p = 0; p < 64; ++p)
+			if ((fixedmask >> p) & 1) fixed[nfixed++] = p;
+		std::size_t nfree = n >> nfixed;
+		std::size_t chunk = std::min<std::size_t>(fixedmask & (~fixedmask + 1), std::max<std::size_t>(1, nfree >> 6));
+		#pragma omp parallel for schedule(static)
+		for (std::intptr_t k = 0; k < static_cast<std::intptr_t>(nfree / chunk); ++k){
+			std::size_t i = static_cast<std::size_t>(k) * chunk;
+			for (unsigned f = 0; f < nfixed; ++f)
+				i = ((i >> fixed[f]) << (fixed[f] + 1)) | (i & ((1ULL << fixed[f]) - 1));
+			i |= ctrlmask;
+			for (std::size_t j = 0; j < chunk; ++j)
+				kernel_core(psi, i + j, dsorted[0], mm, mmt);
+		}
+	}
+#else
+    std::intptr_t zero = 0;
+    std::intptr_t dmask = dsorted[0];
+
+    if (ctrlmask == 0){
+        #pragma omp parallel for schedule(static)
+        for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)
+            if ((i & dmask) == zero)
+                kernel_core(psi, i, dsorted[0], mm, mmt);
+     } else {
+        // only the indices with all controls set, the free bits of k are spread over the other positions
+        std::size_t fixedmask = ctrlmask | dsorted[0];
+        unsigned fixed[64];
+        unsigned nfixed = 0;
+        for (unsigned p = 0; p < 64; ++p)
+            if ((fixedmask >> p) & 1) fixed[nfixed++] = p;
+        std::size_t nfree = n >> nfixed;
+        std::size_t chunk = std::min<std::size_t>(fixedmask & (~fixedmask + 1), std::max<std::size_t>(1, nfree >> 6));
+        #pragma omp parallel for schedule(static)
+        for (std::intptr_t k = 0; k < static_cast<std::intptr_t>(nfree / chunk); ++k){
+            std::size_t i = static_cast<std::size_t>(k) * chunk;
+            for (unsigned f = 0; f < nfixed; ++f)
+                i = ((i >> fixed[f]) << (fixed[f] + 1)) | (i & ((1ULL << fixed[f]) - 1));
+            i |= ctrlmask;
+            for (std::size_t j = 0; j < chunk; ++j)
+                kernel_core(psi, i + j, dsorted[0], mm, mmt);
+        }
+     }
+#endif
+}
+
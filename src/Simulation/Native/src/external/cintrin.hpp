@@ -19,6 +19,15 @@ inline void permute_qubits_and_matrix(I *delta_list, unsigned n, M & matrix){
 	}
 	std::sort(qubits.begin(), qubits.end(), [](Pair const& p1, Pair const& p2){ return p1.second < p2.second; });
 	
+	// fused matrices are built for increasing qubit positions, for which the layout is already the right one
+	bool identity = true;
+	for (std::size_t i = 0; i < qubits.size(); ++i)
+		identity = identity && qubits[i].first == i;
+	if (identity){
+		std::sort(delta_list, delta_list+n, std::greater<I>());
+		return;
+	}
+
 	M old = matrix;
 	
 	for (std::size_t i = 0; i < (1ULL << qubits.size()); ++i){
@@ -108,6 +117,86 @@ inline void store(U* high, U* low, __m256d const& a){
 }
 
 
+// single precision (std::complex<float> amplitudes): a __m128 holds 2 and a __m256 holds 4 complex numbers, the
+// double-precision gate matrix entries are rounded when they are loaded
+inline __m128 fma(__m128 const& c1, __m128 const& c2, __m128 const& a){
+	auto const c1t = _mm_permute_ps(c1, 0xB1);
+	#ifndef HAVE_FMA
+	auto tmp = _mm_addsub_ps(_mm_mul_ps(c1t, _mm_permute_ps(c2, 0xF5)), a);
+	return _mm_addsub_ps(_mm_mul_ps(c1, _mm_permute_ps(c2, 0xA0)), tmp);
+	#else
+	return _mm_fmaddsub_ps(c1, _mm_permute_ps(c2, 0xA0), _mm_fmaddsub_ps(c1t, _mm_permute_ps(c2, 0xF5), a));
+	#endif
+}
+inline __m128 fma(__m128 const& c1, __m128 const& c2, __m128 const& c2tm, __m128 const& a){
+	auto const c1t = _mm_permute_ps(c1, 0xB1);
+	#ifndef HAVE_FMA
+	auto const tmp = _mm_add_ps(_mm_mul_ps(c1, c2), a);
+	return _mm_add_ps(_mm_mul_ps(c1t, c2tm), tmp);
+	#else
+	return _mm_fmadd_ps(c1, c2, _mm_fmadd_ps(c1t, c2tm, a));
+	#endif
+}
+inline __m256 fma(__m256 const& c1, __m256 const& c2, __m256 const& a){
+	auto const c1t = _mm256_permute_ps(c1, 0xB1);
+	#ifndef HAVE_FMA
+	auto tmp = _mm256_addsub_ps(_mm256_mul_ps(c1t, _mm256_permute_ps(c2, 0xF5)), a);
+	return _mm256_addsub_ps(_mm256_mul_ps(c1, _mm256_permute_ps(c2, 0xA0)), tmp);
+	#else
+	return _mm256_fmaddsub_ps(c1, _mm256_permute_ps(c2, 0xA0), _mm256_fmaddsub_ps(c1t, _mm256_permute_ps(c2, 0xF5), a));
+	#endif
+}
+inline __m256 fma(__m256 const& c1, __m256 const& c2, __m256 const& c2tm, __m256 const& a){
+	auto const c1t = _mm256_permute_ps(c1, 0xB1);
+	#ifndef HAVE_FMA
+	auto const tmp = _mm256_add_ps(_mm256_mul_ps(c1, c2), a);
+	return _mm256_add_ps(_mm256_mul_ps(c1t, c2tm), tmp);
+	#else
+	return _mm256_fmadd_ps(c1, c2, _mm256_fmadd_ps(c1t, c2tm, a));
+	#endif
+}
+template <class U>
+inline __m128 load1x2f(U *p){
+	return _mm_castpd_ps(_mm_load1_pd((double const*)p));
+}
+template <class U>
+inline __m256 load1x4f(U *p){
+	return _mm256_castpd_ps(_mm256_broadcast_sd((double const*)p));
+}
+template <class U>
+inline __m128 loadabf(U *p1, U *p2){
+	return _mm_set_ps(float(std::imag(*p2)), float(std::real(*p2)), float(std::imag(*p1)), float(std::real(*p1)));
+}
+template <class U>
+inline __m128 loadaf(U *p1, U *p2){
+	return _mm_set_ps(float(std::real(*p2)), float(std::real(*p2)), float(std::real(*p1)), float(std::real(*p1)));
+}
+template <class U>
+inline __m128 loadbmf(U *p1, U *p2){
+	return _mm_set_ps(float(std::imag(*p2)), -float(std::imag(*p2)), float(std::imag(*p1)), -float(std::imag(*p1)));
+}
+template <class U>
+inline __m256 loadabf(U *p1, U *p2, U *p3, U *p4){
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(loadabf(p1, p2)), loadabf(p3, p4), 0x1);
+}
+template <class U>
+inline __m256 loadaf(U *p1, U *p2, U *p3, U *p4){
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(loadaf(p1, p2)), loadaf(p3, p4), 0x1);
+}
+template <class U>
+inline __m256 loadbmf(U *p1, U *p2, U *p3, U *p4){
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(loadbmf(p1, p2)), loadbmf(p3, p4), 0x1);
+}
+inline void storef(float* high, float* low, __m128 const& a){
+	_mm_storel_pi((__m64*)low, a);
+	_mm_storeh_pi((__m64*)high, a);
+}
+inline void storef(float* hhigh, float* hlow, float* lhigh, float* llow, __m256 const& a){
+	storef(lhigh, llow, _mm256_castps256_ps128(a));
+	storef(hhigh, hlow, _mm256_extractf128_ps(a, 0x1));
+}
+
+
 // avx-512
 #ifdef HAVE_AVX512
 inline __m512d mul(__m512d const& c1, __m512d const& c2, __m512d const& c2tm){
@@ -5,12 +5,26 @@
 #include "config.hpp"
 #include "external/fusion.hpp"
 #include "simulator/kernels.hpp"
+#include "util/alignedalloc.hpp"
+#include "util/autotune.hpp"
+#include "util/threadpool.hpp"
+#include <algorithm>
+#include <bitset>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <list>
 #include <string>
 #include <thread>
+#include <unordered_map>
 
 #ifndef HAVE_INTRINSICS
 #include "external/nointrin/kernels.hpp"
 #else
+#if defined(USE_SINGLE_PRECISION) && defined(HAVE_FMA)
+#include "external/avx2f/kernels.hpp"
+#else
 #ifdef HAVE_AVX512
 #include "external/avx512/kernels.hpp"
 #else
@@ -21,6 +35,7 @@
 #endif
 #endif
 #endif
+#endif
 
 namespace Microsoft
 {
@@ -33,10 +48,18 @@ class Fused
   {
 
   public:
+    // How pending gates are grouped into clusters (see Cluster::make_clusters and Cluster::schedule_clusters)
+    enum class Scheduler { greedy, lookahead };
+
       Fused() {
         wfnCapacity     = 0u;   // used to optimize runtime parameters
         maxFusedSpan    = 4;    // determine span to use at runtime
         maxFusedDepth   = 999;  // determine max depth to use at runtime
+        clusterScheduler = Scheduler::lookahead;
+        blockSpan       = 14;   // 2^14 amplitudes (256KB) per block fit into L2
+        cacheSize       = 64;   // fused clusters kept for reuse
+        autotuneMode    = Autotune::Cached; // benchmark only if QDK_SIM_AUTOTUNE or setAutotune asks for it
+        numThreads      = 1;    // set along with the span and depth
     }
 
     inline void reset()
@@ -60,21 +83,400 @@ class Fused
         return maxFusedDepth;
     }
 
+    Scheduler scheduler() const {
+        return clusterScheduler;
+    }
+
+    void setScheduler(Scheduler s) {
+        clusterScheduler = s;
+    }
+
+    // Number of low qubits of the blocks of amplitudes that several clusters are applied to at a time, 0 disables
+    // the blocking
+    int blockQubits() const {
+        return blockSpan;
+    }
+
+    void setBlockQubits(int n) {
+        blockSpan = n;
+    }
+
+    // Huge page policy for large states (see AlignedAlloc), process-wide
+    HugePages hugePages() const {
+        return huge_pages();
+    }
+
+    void setHugePages(HugePages policy) {
+        set_huge_pages(policy);
+    }
+
+    // Maximum number of fused clusters kept for reuse (see take), 0 disables the cache
+    int fusionCacheSize() const {
+        return cacheSize;
+    }
+
+    void setFusionCacheSize(int n) {
+        cacheSize = n;
+        clusterCache.trim(static_cast<std::size_t>(std::max(n, 0)));
+    }
+
+    // Where the span, depth and number of threads come from when the capacity of the state changes (see
+    // shouldFlush), and the file with the configurations tuned on this host (TuningCache::default_path if empty).
+    // The environment variables still take precedence.
+    Autotune autotune() const {
+        return autotuneMode;
+    }
+
+    void setAutotune(Autotune mode, std::string cachePath = "") {
+        autotuneMode = mode;
+        tuneCachePath = std::move(cachePath);
+        wfnCapacity = 0; // pick the parameters again at the next gate
+    }
+
+    // Number of threads the gates are applied with, picked along with the span and depth (see shouldFlush). The
+    // sweeps that aren't run by the thread pool keep to the same number of OpenMP threads.
+    unsigned threads() const {
+        return numThreads;
+    }
+
+    // Forces the number of threads of this simulator, as OMP_NUM_THREADS does for all of them, 0 picks it again
+    void setThreads(unsigned n) {
+        forcedThreads = n;
+        if (n > 0) numThreads = n;
+        wfnCapacity = 0;
+    }
+
+    // The pool the gates are applied with, created with the simulator unless it is given a pool to share (e.g.
+    // ThreadPool::shared()). Simulators sharing a pool still only use their own number of threads of it.
+    // Starts the workers of the simulator's own pool again from the calling thread, so that they run on the cores it may
+    // run on (see ThreadPool). A shared pool is left alone.
+    void rebindThreadPool() {
+        if (pool_ && ownPool) pool_->set_threads(pool_->threads());
+    }
+
+    ThreadPool& threadPool() const {
+        if (!pool_) {
+            pool_ = std::make_shared<ThreadPool>(numThreads);
+            ownPool = true;
+        }
+        else if (ownPool && pool_->threads() < numThreads) {
+            pool_->set_threads(numThreads);
+        }
+        return *pool_;
+    }
+
+    void setThreadPool(std::shared_ptr<ThreadPool> pool) {
+        pool_ = std::move(pool);
+        ownPool = false;
+    }
+
+    // Name of the kernels this engine is built with, part of the key of the tuned configurations
+    static std::string kernelName() {
+#ifndef HAVE_INTRINSICS
+        std::string name = "nointrin";
+#else
+#if defined(USE_SINGLE_PRECISION) && defined(HAVE_FMA)
+        std::string name = "avx2f";
+#else
+#ifdef HAVE_AVX512
+        std::string name = "avx512";
+#else
+#ifdef HAVE_FMA
+        std::string name = "avx2";
+#else
+        std::string name = "avx";
+#endif
+#endif
+#endif
+#endif
+        return name + "-" + std::to_string(8 * sizeof(RealType));
+    }
+
+    // States of fewer qubits are too quick to time, and more than this many behave alike (they are far beyond the
+    // caches), so the tuning of the largest bucket is used for them.
+    static constexpr unsigned MIN_TUNED_QUBITS = 10;
+    static constexpr unsigned MAX_TUNED_QUBITS = 22;
+
+    // Times the dense kernels on a scratch state of 2^qubits amplitudes: first the number of threads with clusters of
+    // the default span, then, with those threads, the span that covers the most qubits per second. Fewer threads and
+    // smaller spans win unless the larger ones are clearly faster. Fusion depth isn't something the kernels can
+    // measure, so it is left unlimited.
+    static TunedConfig tune(unsigned qubits)
+    {
+      using Clock = std::chrono::steady_clock;
+
+      qubits = std::min(std::max(qubits, MIN_TUNED_QUBITS), MAX_TUNED_QUBITS);
+      WavefunctionStorage wfn(std::size_t(1) << qubits, 0.);
+      wfn[0] = 1.;
+      Fused bench;
+
+      // the same work for every size, the best of three runs
+      const std::size_t reps = std::max<std::size_t>(1, (std::size_t(1) << 20) >> qubits);
+      auto seconds = [&](unsigned span) {
+        FusedCluster fc = hadamards(qubits, span);
+        bench.apply_parallel(wfn, fc);
+        double best = std::numeric_limits<double>::max();
+        for (int run = 0; run < 3; ++run)
+        {
+          auto start = Clock::now();
+          for (std::size_t r = 0; r < reps; ++r)
+            bench.apply_parallel(wfn, fc);
+          best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
+        }
+        return best;
+      };
+
+      TunedConfig config;
+      config.depth = 999;
+      config.threads = 1;
+#ifdef _OPENMP
+      const int maxThreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+      bench.setThreadPool(std::make_shared<ThreadPool>(maxThreads));
+      double fastest = std::numeric_limits<double>::max();
+      for (int t = 1;; t = std::min(2 * t, maxThreads))
+      {
+        bench.numThreads = t;
+        double time = seconds(4);
+        if (time < 0.95 * fastest)
+        {
+          fastest = time;
+          config.threads = t;
+        }
+        if (t == maxThreads) break;
+      }
+      bench.numThreads = config.threads;
+#endif
+
+      double bestRate = 0.;
+      for (unsigned span = 1; span <= 7; ++span)
+      {
+        double rate = span / seconds(span);
+        if (rate > 1.05 * bestRate)
+        {
+          bestRate = rate;
+          config.span = span;
+        }
+      }
+      return config;
+    }
+
+    struct CacheStats
+    {
+      std::size_t hits = 0;
+      std::size_t misses = 0;
+    };
+
+    // Hits and misses of the fused cluster cache since the last reset, clusters too small to be cached aren't counted
+    CacheStats const& fusionCacheStats() const {
+        return cacheStats;
+    }
+
+    void resetFusionCacheStats() {
+        cacheStats = CacheStats();
+    }
+
+    // Fused gates that are ready to be applied to the state vector, or to blocks of it (see Wavefunction::flush).
+    struct FusedCluster
+    {
+      enum class Kind { dense, diagonal, permutation };
+
+      Kind kind = Kind::dense;
+      Fusion::Matrix matrix;                 // dense clusters
+      std::vector<Fusion::Complex> diagonal; // diagonal clusters
+      std::vector<std::size_t> permutation;  // permutation clusters
+      std::vector<Fusion::Complex> phases;   // permutation clusters, empty if all phases are 1
+      Fusion::IndexVector qs;
+      std::size_t cmask = 0;
+    };
+
+    // Fuses the pending gates and resets them.
+    //
+    // Iterative algorithms flush the same clusters over and over, so the fused matrices are kept in an LRU cache keyed
+    // by the signature of the gates (see Fusion::signature). The qubits are sorted, so the cached matrices are already
+    // in the layout the kernels use and don't need to be permuted again.
+    FusedCluster take() const
+    {
+      FusedCluster fc;
+      if (fusedgates.size() == 0)
+        return fc;
+
+      const bool cached = cacheSize > 0 && fusedgates.num_qubits() >= MIN_CACHED_QUBITS;
+      std::vector<double> sig;
+      std::size_t key = 0;
+      if (cached)
+      {
+        fusedgates.signature(sig);
+        key = ClusterCache::hash(sig);
+        if (auto hit = clusterCache.find(sig, key))
+        {
+          ++cacheStats.hits;
+          fc = *hit;
+          fusedgates.get_indices(fc.qs);
+          for (auto c : fusedgates.get_ctrl_set())
+            fc.cmask |= (1ull << c);
+          fusedgates = Fusion();
+          return fc;
+        }
+        ++cacheStats.misses;
+      }
+
+      Fusion::IndexVector cs;
+      if (fusedgates.is_diagonal())
+      {
+        // Diagonal clusters (phase gates, Rz, CZ, controlled phases...) don't need the dense kernels: the fused
+        // matrix is applied as an elementwise multiplication of the state with its diagonal.
+        fc.kind = FusedCluster::Kind::diagonal;
+        fusedgates.perform_diagonal_fusion(fc.diagonal, fc.qs, cs);
+      }
+      else if (fusedgates.is_permutation())
+      {
+        // Clusters of X, CNOT, Toffoli, SWAP and the like only move amplitudes around (possibly picking up phases),
+        // so they are applied as an index remap of the state instead of a dense matrix-vector product.
+        fc.kind = FusedCluster::Kind::permutation;
+        fusedgates.perform_permutation_fusion(fc.permutation, fc.phases, fc.qs, cs);
+
+        // skip the multiplications altogether for pure permutations
+        if (std::all_of(fc.phases.begin(), fc.phases.end(), [](Fusion::Complex const& p) { return p == Fusion::Complex(1.); }))
+          fc.phases.clear();
+      }
+      else
+      {
+        fusedgates.perform_fusion(fc.matrix, fc.qs, cs);
+      }
+
+      if (cached)
+        clusterCache.insert(std::move(sig), key, fc, cacheSize);
+
+      for (auto c : cs)
+        fc.cmask |= (1ull << c);
+
+      fusedgates = Fusion();
+      return fc;
+    }
+
     template <class T, class A>
     void flush(std::vector<T, A>& wfn) const
     {
       if (fusedgates.size() == 0)
         return;
-      
-      Fusion::Matrix m;
-      Fusion::IndexVector qs, cs;
 
-      fusedgates.perform_fusion(m, qs, cs);
+      apply_parallel(wfn, take());
+    }
+
+    // Applies the cluster to the whole state with the threads of the pool. The state is cut into 2^k slabs along a run
+    // of k qubits the cluster doesn't target, as high up as possible: into kernels::StateBlocks if those are the
+    // highest qubits, else into kernels::StridedBlocks. Each thread applies the cluster to whole slabs, controls on the
+    // cut qubits pick the slabs it applies to.
+    template <class T, class A>
+    void apply_parallel(std::vector<T, A>& wfn, FusedCluster const& fc) const
+    {
+      const unsigned threads = numThreads;
+      const std::size_t size = wfn.size();
+      unsigned n = 0;
+      while ((std::size_t(2) << n) <= size)
+        ++n;
+
+      std::size_t tmask = 0;
+      for (auto q : fc.qs)
+        tmask |= (1ull << q);
+      unsigned cut = 0;
+      if (threads > 1)
+        while ((1u << cut) < SLABS_PER_THREAD * threads)
+          ++cut;
+      unsigned gap = 0;
+      for (; cut > 0; --cut)
+      {
+        // the highest run of cut qubits that aren't targets
+        const std::size_t run = (std::size_t(1) << cut) - 1;
+        gap = n - std::min(n, cut);
+        while (gap > 0 && ((tmask >> gap) & run) != 0)
+          --gap;
+        if (n >= cut && ((tmask >> gap) & run) == 0)
+          break;
+      }
+      if (cut == 0)
+      {
+        apply(wfn, fc);
+        return;
+      }
+
+      const std::size_t low = (std::size_t(1) << gap) - 1;
+      auto remap = [&](std::size_t mask) { return (mask & low) | ((mask >> (gap + cut)) << gap); };
+      const std::size_t slabCmask = fc.cmask & (((std::size_t(1) << cut) - 1) << gap);
+      const std::size_t cmask = remap(fc.cmask & ~slabCmask);
+      Fusion::IndexVector qs(fc.qs);
+      for (auto& q : qs)
+        if (q >= gap) q -= cut;
+
+      const std::size_t slabSize = size >> cut;
+      threadPool().run(std::size_t(1) << cut, [&](std::size_t first, std::size_t last) {
+        for (std::size_t s = first; s < last; ++s)
+        {
+          const std::size_t offset = s << gap;
+          if ((offset & slabCmask) != slabCmask)
+            continue;
+          if (gap + cut == n)
+          {
+            kernels::StateBlock<T> slab(&wfn[offset], slabSize);
+            apply(slab, fc, qs, cmask);
+          }
+          else
+          {
+            kernels::StridedBlock<T> slab(wfn.data(), slabSize, gap, cut, offset);
+            apply(slab, fc, qs, cmask);
+          }
+        }
+      }, threads);
+    }
+
+    // V is either the state vector or a kernels::StateBlock of it.
+    template <class V>
+    static void apply(V& wfn, FusedCluster const& fc)
+    {
+      apply(wfn, fc, fc.qs, fc.cmask);
+    }
+
+    // Applies the cluster to the qubits qs with the controls cmask instead of its own (see apply_parallel).
+    template <class V>
+    static void apply(V& wfn, FusedCluster const& fc, Fusion::IndexVector const& qs, std::size_t cmask)
+    {
+      auto const& m = fc.matrix;
+
+      if (fc.kind == FusedCluster::Kind::permutation)
+      {
+        kernels::apply_permutation(wfn, qs, fc.permutation, fc.phases, cmask);
+        return;
+      }
+
+      if (fc.kind == FusedCluster::Kind::diagonal)
+      {
+        switch (qs.size())
+        {
+          case 1:
+            apply_diagonal<1>(wfn, fc.diagonal, qs, cmask);
+            break;
+          case 2:
+            apply_diagonal<2>(wfn, fc.diagonal, qs, cmask);
+            break;
+          case 3:
+            apply_diagonal<3>(wfn, fc.diagonal, qs, cmask);
+            break;
+          case 4:
+            apply_diagonal<4>(wfn, fc.diagonal, qs, cmask);
+            break;
+          case 5:
+            apply_diagonal<5>(wfn, fc.diagonal, qs, cmask);
+            break;
+          case 6:
+            apply_diagonal<6>(wfn, fc.diagonal, qs, cmask);
+            break;
+          case 7:
+            apply_diagonal<7>(wfn, fc.diagonal, qs, cmask);
+            break;
+        }
+        return;
+      }
 
-      std::size_t cmask = 0;
-      for (auto c : cs)
-        cmask |= (1ull << c);
-      
       switch (qs.size())
       {
         case 1:
@@ -99,14 +501,25 @@ class Fused
             ::kernel(wfn, qs[6], qs[5], qs[4], qs[3], qs[2], qs[1], qs[0], m, cmask);
             break;
       }
+    }
 
-      fusedgates = Fusion();
+    template <unsigned K, class V>
+    static void apply_diagonal(
+        V& wfn,
+        std::vector<Fusion::Complex> const& diag,
+        Fusion::IndexVector const& qs,
+        std::size_t cmask)
+    {
+      DiagMatrix<typename V::value_type, (1u << K)> d;
+      for (unsigned i = 0; i < (1u << K); ++i)
+        d(i, i) = static_cast<typename V::value_type>(diag[i]);
+      kernels::apply_diagonal(wfn, d, qs, cmask);
     }
     
     template <class M>
     Fusion::Matrix convertMatrix(M const& m) const
     {
-      Fusion::Matrix mat(2, Fusion::Matrix::value_type(2));
+      Fusion::Matrix mat(2);
       for (unsigned i = 0; i < 2; ++i)
         for (unsigned j = 0; j < 2; ++j)
           mat[i][j] = static_cast<ComplexType>(m(i, j));
@@ -116,8 +529,7 @@ class Fused
     template <class T, class A, class M>
     void apply_controlled(std::vector<T, A>& wfn, M const& mat, std::vector<unsigned> const& cs, unsigned q) const
     {
-        Fusion::IndexVector qs = std::vector<unsigned>(1, q);
-        fusedgates.insert(convertMatrix(mat), qs, cs);
+        fusedgates.insert(convertMatrix(mat), Fusion::IndexVector(1, q), cs);
     }
 
     template <class T, class A, class M>
@@ -128,22 +540,55 @@ class Fused
     }
 
     template <class T, class A>
-    bool shouldFlush(std::vector<T, A>& wfn, std::vector<unsigned> const& cs, unsigned q)
+    bool shouldFlush(std::vector<T, A>& wfn)
+    {
+        return shouldFlush(wfn.capacity());
+    }
+
+    // `capacity` is the number of amplitudes of the state the gates will be applied to, which can be more than the
+    // vector holds while qubits are still to be added to it
+    bool shouldFlush(size_t capacity)
     {
         // Major runtime logic change here
 
           // Have to update capacity as the WFN grows
-        if (wfnCapacity != wfn.capacity()) {
-            wfnCapacity = wfn.capacity();
-            char* envNT = NULL;
+        if (wfnCapacity != capacity) {
+            wfnCapacity = capacity;
+
+            // Select where the parameters come from ("off", "cached" or "on", see Autotune)
+            char* envAT = NULL;
             size_t len;
+#ifdef _MSC_VER
+            errno_t err = _dupenv_s(&envAT, &len, "QDK_SIM_AUTOTUNE");
+            if (envAT != NULL && len > 0) {
+#else
+            envAT = getenv("QDK_SIM_AUTOTUNE");
+            if (envAT != NULL && strlen(envAT) > 0) {
+#endif
+                if (strcmp(envAT, "off") == 0) autotuneMode = Autotune::Off;
+                else if (strcmp(envAT, "cached") == 0) autotuneMode = Autotune::Cached;
+                else if (strcmp(envAT, "on") == 0) autotuneMode = Autotune::On;
+            }
+            TunedConfig tuned;
+            const bool haveTuned = tunedConfig(wfnCapacity, tuned);
+
+            char* envNT = NULL;
 #ifdef _OPENMP
 #ifdef _MSC_VER
-            errno_t err = _dupenv_s(&envNT, &len, "OMP_NUM_THREADS");
+            err = _dupenv_s(&envNT, &len, "OMP_NUM_THREADS");
 #else
             envNT = getenv("OMP_NUM_THREADS");
 #endif
-            if (envNT == NULL) { // If the user didn't force the number of threads, make an intelligent guess
+            if (forcedThreads > 0) {
+                numThreads = forcedThreads;
+            }
+            else if (envNT != NULL && atoi(envNT) > 0) {
+                numThreads = atoi(envNT);
+            }
+            else if (haveTuned) {
+                numThreads = tuned.threads;
+            }
+            else { // If the user didn't force the number of threads, make an intelligent guess
                 int nMaxThrds = std::thread::hardware_concurrency();        // Logical HW threads
                 if (nMaxThrds > 4) nMaxThrds/= 2;                           // Assume we have hyperthreading (no consistent/concise way to do this)
                 if (wfnCapacity < 1ul << 14)      nMaxThrds = 1;
@@ -153,13 +598,13 @@ class Fused
                     if (nMaxThrds > 8) nMaxThrds = 8;                       // Small problem, never use too many
                     else if (nMaxThrds > 3) nMaxThrds = 3;                  // Small problem on a small machine
                 }
-                omp_set_num_threads(nMaxThrds);
+                numThreads = std::max(nMaxThrds, 1);
             }
 #endif
 
             // Set the max fused depth
             char* envFD = NULL;
-            maxFusedDepth = 999;
+            maxFusedDepth = haveTuned ? tuned.depth : 999;
 #ifdef _MSC_VER
             err = _dupenv_s(&envFD, &len, "QDK_SIM_FUSEDEPTH");
             if (envFD != NULL && len > 0) {
@@ -175,6 +620,7 @@ class Fused
             char* envFS = NULL;
             maxFusedSpan = 4;                               // General sweet spot
             if (wfnCapacity < 1u << 20) maxFusedSpan = 2;   // Don't pre-fuse small problems
+            if (haveTuned) maxFusedSpan = tuned.span;
 #ifdef _MSC_VER
             err = _dupenv_s(&envFS, &len, "QDK_SIM_FUSESPAN");
             if (envFS != NULL && len > 0) {
@@ -187,18 +633,191 @@ class Fused
                 maxFusedSpan = atoi(envFS);
             }
 #endif
+            // Select the cluster scheduler ("greedy" or "lookahead")
+            char* envSC = NULL;
+#ifdef _MSC_VER
+            err = _dupenv_s(&envSC, &len, "QDK_SIM_SCHEDULER");
+            if (envSC != NULL && len > 0) {
+#else
+            envSC = getenv("QDK_SIM_SCHEDULER");
+            if (envSC != NULL && strlen(envSC) > 0) {
+#endif
+                if (strcmp(envSC, "greedy") == 0) clusterScheduler = Scheduler::greedy;
+                else if (strcmp(envSC, "lookahead") == 0) clusterScheduler = Scheduler::lookahead;
+            }
+
+            // Select the huge page policy for large states ("off", "transparent" or "explicit")
+            char* envHP = NULL;
+#ifdef _MSC_VER
+            err = _dupenv_s(&envHP, &len, "QDK_SIM_HUGEPAGES");
+            if (envHP != NULL && len > 0) {
+#else
+            envHP = getenv("QDK_SIM_HUGEPAGES");
+            if (envHP != NULL && strlen(envHP) > 0) {
+#endif
+                if (strcmp(envHP, "off") == 0) setHugePages(HugePages::Off);
+                else if (strcmp(envHP, "transparent") == 0) setHugePages(HugePages::Transparent);
+                else if (strcmp(envHP, "explicit") == 0) setHugePages(HugePages::Explicit);
+            }
+
+            // Set the block size for the cache-blocked execution of clusters
+            char* envBQ = NULL;
+#ifdef _MSC_VER
+            err = _dupenv_s(&envBQ, &len, "QDK_SIM_BLOCKQUBITS");
+            if (envBQ != NULL && len > 0) {
+#else
+            envBQ = getenv("QDK_SIM_BLOCKQUBITS");
+            if (envBQ != NULL && strlen(envBQ) > 0) {
+#endif
+                blockSpan = atoi(envBQ);
+            }
+
+            // Set the number of fused clusters kept for reuse
+            char* envFC = NULL;
+#ifdef _MSC_VER
+            err = _dupenv_s(&envFC, &len, "QDK_SIM_FUSIONCACHE");
+            if (envFC != NULL && len > 0) {
+#else
+            envFC = getenv("QDK_SIM_FUSIONCACHE");
+            if (envFC != NULL && strlen(envFC) > 0) {
+#endif
+                setFusionCacheSize(atoi(envFC));
+            }
 
         }
         return false;
     }
 
   private:
+    // Fusing clusters of one or two qubits is about as fast as looking them up
+    static constexpr unsigned MIN_CACHED_QUBITS = 3;
+
+    // Slabs per thread in apply_parallel, enough for the threads to even out
+    static constexpr unsigned SLABS_PER_THREAD = 4;
+
+    // The tensor product of `span` Hadamards on qubits spread over the state, a unitary that keeps the benchmark
+    // state normalized however often it is applied
+    static FusedCluster hadamards(unsigned qubits, unsigned span)
+    {
+      FusedCluster fc;
+      const std::size_t dim = std::size_t(1) << span;
+      fc.matrix = Fusion::Matrix(dim);
+      const double norm = 1. / std::sqrt(static_cast<double>(dim));
+      for (std::size_t i = 0; i < dim; ++i)
+        for (std::size_t j = 0; j < dim; ++j)
+          fc.matrix[i][j] = (std::bitset<8>(i & j).count() % 2) ? -norm : norm;
+      for (unsigned k = 0; k < span; ++k)
+        fc.qs.push_back(span == 1 ? qubits / 2 : k * (qubits - 1) / (span - 1));
+      return fc;
+    }
+
+    // The tuned configuration for a state of the given capacity from the cache file, after tuning it if the mode
+    // asks for it
+    bool tunedConfig(std::size_t capacity, TunedConfig& config) const
+    {
+      if (autotuneMode == Autotune::Off)
+        return false;
+      unsigned qubits = 0;
+      while ((std::size_t(2) << qubits) <= capacity)
+        ++qubits;
+      if (qubits < MIN_TUNED_QUBITS)
+        return false;
+      qubits = std::min(qubits, MAX_TUNED_QUBITS);
+
+      TuningCache cache(tuneCachePath.empty() ? TuningCache::default_path() : tuneCachePath);
+      const std::string key = tuning_key(kernelName());
+      if (cache.find(key, qubits, config))
+        return true;
+      if (autotuneMode != Autotune::On)
+        return false;
+      config = tune(qubits);
+      cache.store(key, qubits, config);
+      return true;
+    }
+
+    // LRU cache of fused clusters (without their qubits and controls) keyed by the signature of their gates. Copies
+    // start out empty since the index refers into the list.
+    class ClusterCache
+    {
+    public:
+      ClusterCache() = default;
+      ClusterCache(ClusterCache const&) {}
+      ClusterCache& operator=(ClusterCache const&) { clear(); return *this; }
+
+      FusedCluster const* find(std::vector<double> const& sig, std::size_t key)
+      {
+        auto it = index_.find(key);
+        if (it == index_.end() || it->second->sig != sig)
+          return nullptr;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return &it->second->fc;
+      }
+
+      // replaces an entry with a colliding key
+      void insert(std::vector<double> sig, std::size_t key, FusedCluster const& fc, std::size_t capacity)
+      {
+        auto it = index_.find(key);
+        if (it != index_.end())
+          entries_.erase(it->second);
+        entries_.push_front(Entry{std::move(sig), key, fc});
+        entries_.front().fc.qs.clear();
+        entries_.front().fc.cmask = 0;
+        index_[key] = entries_.begin();
+        trim(capacity);
+      }
+
+      void trim(std::size_t capacity)
+      {
+        while (entries_.size() > capacity)
+        {
+          index_.erase(entries_.back().key);
+          entries_.pop_back();
+        }
+      }
+
+      void clear()
+      {
+        entries_.clear();
+        index_.clear();
+      }
+
+      static std::size_t hash(std::vector<double> const& sig)
+      {
+        std::size_t h = sig.size();
+        for (double x : sig)
+          h ^= std::hash<double>()(x) + 0x9e3779b9 + (h << 6) + (h >> 2);
+        return h;
+      }
+
+    private:
+      struct Entry
+      {
+        std::vector<double> sig;
+        std::size_t key;
+        FusedCluster fc;
+      };
+      std::list<Entry> entries_; // most recently used first
+      std::unordered_map<std::size_t, std::list<Entry>::iterator> index_;
+    };
+
     mutable Fusion fusedgates;
 
+    mutable ClusterCache clusterCache;
+    mutable CacheStats cacheStats;
+
     //: New runtime optimizatin settings
     mutable size_t wfnCapacity;
     mutable int    maxFusedSpan;
     mutable int    maxFusedDepth;
+    mutable Scheduler clusterScheduler;
+    mutable int    blockSpan;
+    mutable int    cacheSize;
+    mutable Autotune autotuneMode;
+    mutable std::string tuneCachePath;
+    mutable unsigned numThreads;
+    mutable unsigned forcedThreads = 0;
+    mutable std::shared_ptr<ThreadPool> pool_;
+    mutable bool   ownPool = false;
   };
   
   
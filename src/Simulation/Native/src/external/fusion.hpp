@@ -11,15 +11,118 @@
 #include <cassert>
 #include "util/alignedalloc.hpp"
 #include <unordered_map>
+#include <cstdint>
+#include <iterator>
+
+// Square matrix stored row-major in one aligned buffer; m[i][j] is the element in row i and column j, so it can be
+// used wherever the kernels expect a vector of rows. The 2x2 matrices of the gates are stored inline so that queueing
+// them for fusion doesn't allocate.
+class FlatMatrix{
+public:
+	using Complex = std::complex<double>;
+
+	FlatMatrix() : dim_(0) {}
+	explicit FlatMatrix(std::size_t dim) : dim_(dim) {
+		if (dim_ > SMALL_DIM)
+			data_.assign(dim * dim, 0.);
+		else
+			std::fill(small_, small_ + SMALL_DIM * SMALL_DIM, Complex(0.));
+	}
+
+	static FlatMatrix identity(std::size_t dim, Complex factor = 1.) {
+		FlatMatrix m(dim);
+		for (std::size_t i = 0; i < dim; ++i)
+			m[i][i] = factor;
+		return m;
+	}
+
+	std::size_t size() const { return dim_; }
+	Complex* operator[](std::size_t i) { return data() + i * dim_; }
+	Complex const* operator[](std::size_t i) const { return data() + i * dim_; }
+
+	// block-diagonal matrix diag(1, ..., 1, m) of dimension 2^ncontrols * dim, i.e. m controlled by ncontrols qubits
+	// that are more significant than the qubits of m
+	FlatMatrix controlled(std::size_t ncontrols) const {
+		FlatMatrix res = identity(dim_ << ncontrols);
+		std::size_t offset = res.size() - dim_;
+		for (std::size_t i = 0; i < dim_; ++i){
+			res[offset + i][offset + i] = 0.;
+			std::copy((*this)[i], (*this)[i] + dim_, res[offset + i] + offset);
+		}
+		return res;
+	}
+
+	// Multiplies this matrix from the left with the small matrix u acting on the qubits at the positions pos (pos[l]
+	// is the position of the l-th qubit of u) and with identity on all other qubits, without ever forming the
+	// embedded matrix: rows that differ only in the bits at pos are combined with the coefficients of u. The rows are
+	// contiguous so the inner loop is an axpy over the real and imaginary parts the compiler can vectorize. buffer is
+	// scratch space for the new rows of one group and is grown as needed.
+	void multiply_embedded(FlatMatrix const& u, std::vector<unsigned> const& pos, std::vector<Complex, Microsoft::Quantum::Simulator::AlignedAlloc<Complex, 64>>& buffer) {
+		const std::size_t k = pos.size();
+		const std::size_t local_dim = std::size_t(1) << k;
+		assert(u.size() == local_dim);
+
+		std::vector<std::size_t> offsets(local_dim, 0);
+		std::vector<unsigned> sorted_pos(pos);
+		std::sort(sorted_pos.begin(), sorted_pos.end());
+		for (std::size_t a = 0; a < local_dim; ++a)
+			for (std::size_t l = 0; l < k; ++l)
+				offsets[a] |= ((a >> l) & 1ULL) << pos[l];
+
+		const std::size_t ngroups = dim_ >> k;
+		const std::size_t group_size = local_dim * dim_;
+		const bool parallel = dim_ >= PARALLEL_DIM;
+		buffer.resize(group_size * (parallel ? ngroups : 1));
+
+		#pragma omp parallel for schedule(static) if(parallel)
+		for (std::intptr_t g = 0; g < static_cast<std::intptr_t>(ngroups); ++g){
+			// insert zeros at pos to get the first row of the group
+			std::size_t r0 = static_cast<std::size_t>(g);
+			for (unsigned p : sorted_pos)
+				r0 = ((r0 >> p) << (p + 1)) | (r0 & ((std::size_t(1) << p) - 1));
+
+			Complex* rows = buffer.data() + (parallel ? g * group_size : 0);
+			for (std::size_t a = 0; a < local_dim; ++a){
+				double* res = reinterpret_cast<double*>(rows + a * dim_);
+				std::fill(res, res + 2 * dim_, 0.);
+				for (std::size_t b = 0; b < local_dim; ++b){
+					const double re = u[a][b].real(), im = u[a][b].imag();
+					if (re == 0. && im == 0.)
+						continue;
+					double const* row = reinterpret_cast<double const*>((*this)[r0 | offsets[b]]);
+					for (std::size_t j = 0; j < 2 * dim_; j += 2){
+						res[j] += re * row[j] - im * row[j + 1];
+						res[j + 1] += re * row[j + 1] + im * row[j];
+					}
+				}
+			}
+			for (std::size_t a = 0; a < local_dim; ++a)
+				std::copy(rows + a * dim_, rows + (a + 1) * dim_, (*this)[r0 | offsets[a]]);
+		}
+	}
+
+private:
+	// fused matrices below 64x64 (i.e. up to 5 qubits) are too small to be worth an OpenMP region
+	static constexpr std::size_t PARALLEL_DIM = 64;
+	static constexpr std::size_t SMALL_DIM = 2;
+
+	Complex* data() { return dim_ > SMALL_DIM ? data_.data() : small_; }
+	Complex const* data() const { return dim_ > SMALL_DIM ? data_.data() : small_; }
+
+	std::size_t dim_;
+	Complex small_[SMALL_DIM * SMALL_DIM];
+	std::vector<Complex, Microsoft::Quantum::Simulator::AlignedAlloc<Complex, 64>> data_;
+};
 
 class Item{
 public:  
 	using Index = unsigned;
 	using IndexVector = std::vector<Index>;
 	using Complex = std::complex<double>;
-	using Matrix = std::vector<std::vector<Complex, Microsoft::Quantum::Simulator::AlignedAlloc<Complex, 64>>>;
-	Item(Matrix mat, IndexVector idx) : mat_(std::move(mat)), idx_(idx) {}
+	using Matrix = FlatMatrix;
+	Item(Matrix mat, IndexVector idx) : mat_(std::move(mat)), idx_(std::move(idx)) {}
 	Matrix& get_matrix() { return mat_; }
+	Matrix const& get_matrix() const { return mat_; }
 	IndexVector& get_indices() const { return idx_; }
 	void remap_idx(std::unordered_map<unsigned, unsigned> elemDict) const {
 		for (size_t i = 0; i < idx_.size(); i++) {
@@ -38,10 +141,10 @@ public:
 	using IndexSet = std::set<Index>;
 	using IndexVector = std::vector<Index>;
 	using Complex = std::complex<double>;
-    using Matrix = std::vector<std::vector<Complex, Microsoft::Quantum::Simulator::AlignedAlloc<Complex, 64>>>;
+	using Matrix = FlatMatrix;
 	using ItemVector = std::vector<Item>;
 	
-	Fusion() : global_factor_(1.) {}
+	Fusion() : global_factor_(1.), diagonal_(true), permutation_(true) {}
 	
 	Index num_qubits() const {
 		return static_cast<Index>(target_set_.size());
@@ -81,6 +184,37 @@ public:
 		return global_factor_;
 	}
 
+	// true if all fused gates are diagonal (then so is the fused matrix, controls included)
+	bool is_diagonal() const {
+		return diagonal_;
+	}
+
+	static bool is_diagonal(Matrix const& matrix) {
+		for (std::size_t i = 0; i < matrix.size(); ++i)
+			for (std::size_t j = 0; j < matrix.size(); ++j)
+				if (i != j && matrix[i][j] != 0.)
+					return false;
+		return true;
+	}
+
+	// true if all fused gates map basis states onto basis states (up to a phase), e.g. X, CNOT, Toffoli
+	bool is_permutation() const {
+		return permutation_;
+	}
+
+	// exactly one non-zero element in each column (for a unitary this implies the same for each row)
+	static bool is_permutation(Matrix const& matrix) {
+		for (std::size_t j = 0; j < matrix.size(); ++j){
+			std::size_t nonzeros = 0;
+			for (std::size_t i = 0; i < matrix.size(); ++i)
+				if (matrix[i][j] != 0.)
+					++nonzeros;
+			if (nonzeros != 1)
+				return false;
+		}
+		return true;
+	}
+
 	static void remap_qubits(std::set<Index>& qubits, const std::unordered_map<unsigned, unsigned>& mapFromOldLocToNewLoc) {
 		std::set<Index> tempSet;
 		for (unsigned elem : qubits) {
@@ -115,6 +249,8 @@ public:
 	}
 
 	void insert(Matrix matrix, IndexVector index_list, IndexVector const& ctrl_list = {}) const {
+		diagonal_ = diagonal_ && is_diagonal(matrix);
+		permutation_ = permutation_ && is_permutation(matrix);
 		for (auto idx : index_list)
 			target_set_.emplace(idx);
 		
@@ -124,8 +260,7 @@ public:
 		}
 		else
 			handle_controls(matrix, index_list, ctrl_list);
-		Item item(matrix, index_list);
-		items_.push_back(item);
+		items_.emplace_back(std::move(matrix), std::move(index_list));
 	}
 	
 	void get_indices(IndexVector &indices) const{
@@ -141,41 +276,122 @@ public:
 			index_list.push_back(idx);
 		
 		unsigned N = num_qubits();
-		fused_matrix = Matrix(1ULL<<N, std::vector<Complex, Microsoft::Quantum::Simulator::AlignedAlloc<Complex, 64>>(1ULL<<N));
-		auto &M = fused_matrix;
-		
-		for (std::size_t i = 0; i < (1ULL<<N); ++i)
-			M[i][i] = 1. * global_factor_;
+		fused_matrix = Matrix::identity(1ULL<<N, global_factor_);
 		
+		std::vector<Complex, Microsoft::Quantum::Simulator::AlignedAlloc<Complex, 64>> buffer;
+		IndexVector idx2mat;
 		for (auto& item : items_){
 			auto const& idx = item.get_indices();
-			IndexVector idx2mat(idx.size());
+			idx2mat.resize(idx.size());
 			for (std::size_t i = 0; i < idx.size(); ++i)
 				idx2mat[i] = static_cast<unsigned>(((std::equal_range(index_list.begin(), index_list.end(), idx[i])).first - index_list.begin()));
 			
-			#pragma omp parallel for schedule(static)
-			for (unsigned long long k = 0; k < (1ULL<<N); ++k){ // loop over big matrix columns
-				// check if column index satisfies control-mask
-				// if not: leave it unchanged
-				std::vector<Complex> oldcol(1ULL<<N);
-				for (std::size_t i = 0; i < (1ULL<<N); ++i)
-					oldcol[i] = M[i][k];
-
-				for (std::size_t i = 0; i < (1ULL<<N); ++i){
-					unsigned local_i = 0;
-					for (std::size_t l = 0; l < idx.size(); ++l)
-						local_i |= ((i >> idx2mat[l])&1)<<l;
-						
-					Complex res = 0.;
-					for (std::size_t j = 0; j < (1ULL<<idx.size()); ++j){
-						std::size_t locidx = i;
-						for (std::size_t l = 0; l < idx.size(); ++l)
-							if (((j >> l)&1) != ((i >> idx2mat[l])&1))
-								locidx ^= (1ULL << idx2mat[l]);
-						res += oldcol[locidx] * item.get_matrix()[local_i][j];
-					}
-					M[i][k] = res;
+			fused_matrix.multiply_embedded(item.get_matrix(), idx2mat, buffer);
+		}
+		ctrl_list.reserve(ctrl_set_.size());
+		for (auto ctrl : ctrl_set_)
+			ctrl_list.push_back(ctrl);
+	}
+
+	// Appends a description of the fused gates that determines the fused matrix: the global factor and, for every
+	// item, its indices relative to the (sorted) target set followed by its matrix. Clusters applying the same gates
+	// to other qubits have the same signature, and so does a cluster with other controls common to all its gates.
+	void signature(std::vector<double>& sig) const {
+		sig.push_back(static_cast<double>(num_qubits()));
+		sig.push_back(global_factor_.real());
+		sig.push_back(global_factor_.imag());
+		for (auto const& item : items_){
+			auto const& idx = item.get_indices();
+			auto const& m = item.get_matrix();
+			sig.push_back(static_cast<double>(idx.size()));
+			for (auto i : idx)
+				sig.push_back(static_cast<double>(std::distance(target_set_.begin(), target_set_.find(i))));
+			for (std::size_t r = 0; r < m.size(); ++r)
+				for (std::size_t c = 0; c < m.size(); ++c){
+					sig.push_back(m[r][c].real());
+					sig.push_back(m[r][c].imag());
 				}
+		}
+	}
+
+	// Same as perform_fusion but only for diagonal fused matrices: instead of the full 2^N x 2^N matrix computes its
+	// diagonal, which is the elementwise product of the (embedded) diagonals of all items.
+	void perform_diagonal_fusion(std::vector<Complex>& fused_diag, IndexVector& index_list, IndexVector& ctrl_list){
+		assert(diagonal_);
+		if (global_factor_ != 1.)
+			assert(ctrl_set_.size() == 0);
+
+		for (auto idx : target_set_)
+			index_list.push_back(idx);
+
+		unsigned N = num_qubits();
+		fused_diag.assign(1ULL<<N, global_factor_);
+
+		for (auto& item : items_){
+			auto const& idx = item.get_indices();
+			IndexVector idx2mat(idx.size());
+			for (std::size_t i = 0; i < idx.size(); ++i)
+				idx2mat[i] = static_cast<unsigned>(((std::equal_range(index_list.begin(), index_list.end(), idx[i])).first - index_list.begin()));
+
+			for (std::size_t i = 0; i < (1ULL<<N); ++i){
+				unsigned local_i = 0;
+				for (std::size_t l = 0; l < idx.size(); ++l)
+					local_i |= ((i >> idx2mat[l])&1)<<l;
+				fused_diag[i] *= item.get_matrix()[local_i][local_i];
+			}
+		}
+		ctrl_list.reserve(ctrl_set_.size());
+		for (auto ctrl : ctrl_set_)
+			ctrl_list.push_back(ctrl);
+	}
+
+	// Same as perform_fusion but for fused matrices that permute the basis states: the fused gate maps |i> onto
+	// phases[i]|permutation[i]>, where i and permutation[i] are indices into the basis of the fused qubits.
+	void perform_permutation_fusion(std::vector<std::size_t>& permutation, std::vector<Complex>& phases, IndexVector& index_list, IndexVector& ctrl_list){
+		assert(permutation_);
+		if (global_factor_ != 1.)
+			assert(ctrl_set_.size() == 0);
+
+		for (auto idx : target_set_)
+			index_list.push_back(idx);
+
+		unsigned N = num_qubits();
+		permutation.resize(1ULL<<N);
+		for (std::size_t i = 0; i < (1ULL<<N); ++i)
+			permutation[i] = i;
+		phases.assign(1ULL<<N, global_factor_);
+
+		std::vector<std::size_t> rows;
+		for (auto& item : items_){
+			auto const& idx = item.get_indices();
+			auto const& mat = item.get_matrix();
+			IndexVector idx2mat(idx.size());
+			std::size_t itemmask = 0;
+			for (std::size_t i = 0; i < idx.size(); ++i){
+				idx2mat[i] = static_cast<unsigned>(((std::equal_range(index_list.begin(), index_list.end(), idx[i])).first - index_list.begin()));
+				itemmask |= 1ULL << idx2mat[i];
+			}
+
+			// the item maps its local basis state |j> onto mat[rows[j]][j]|rows[j]>
+			rows.assign(mat.size(), 0);
+			for (std::size_t j = 0; j < mat.size(); ++j)
+				for (std::size_t i = 0; i < mat.size(); ++i)
+					if (mat[i][j] != 0.)
+						rows[j] = i;
+
+			for (std::size_t i = 0; i < (1ULL<<N); ++i){
+				std::size_t current = permutation[i];
+				std::size_t local_j = 0;
+				for (std::size_t l = 0; l < idx.size(); ++l)
+					local_j |= ((current >> idx2mat[l])&1)<<l;
+
+				std::size_t local_r = rows[local_j];
+				std::size_t next = current & ~itemmask;
+				for (std::size_t l = 0; l < idx.size(); ++l)
+					next |= ((local_r >> l)&1ULL) << idx2mat[l];
+
+				permutation[i] = next;
+				phases[i] *= mat[local_r][local_j];
 			}
 		}
 		ctrl_list.reserve(ctrl_set_.size());
@@ -188,18 +404,7 @@ private:
 		indexList.reserve(indexList.size()+new_ctrls.size());
 		indexList.insert(indexList.end(), new_ctrls.begin(), new_ctrls.end());
 		
-		std::size_t F = (1ULL << new_ctrls.size());
-		Matrix newmatrix(F*matrix.size(), std::vector<Complex, Microsoft::Quantum::Simulator::AlignedAlloc<Complex,64>>(F*matrix.size(), 0.));
-		
-		std::size_t Offset = newmatrix.size()-matrix.size();
-		
-		for (std::size_t i = 0; i < Offset; ++i)
-			newmatrix[i][i] = 1.;
-		for (std::size_t i = 0; i < matrix.size(); ++i){
-			for (std::size_t j = 0; j < matrix.size(); ++j)
-				newmatrix[Offset+i][Offset+j] = matrix[i][j];
-		}
-		matrix = std::move(newmatrix);
+		matrix = matrix.controlled(new_ctrls.size());
 	}
 	
 	void handle_controls(Matrix &matrix, IndexVector &indexList, IndexVector const& ctrlList) const {
@@ -238,6 +443,8 @@ private:
 	mutable ItemVector items_; //queue if gates to be fused
 	mutable IndexSet ctrl_set_; //set of controls
 	mutable Complex global_factor_;
+	mutable bool diagonal_; //all items are diagonal
+	mutable bool permutation_; //all items permute the basis states
 };
 
 #endif
@@ -15,11 +15,48 @@ extern "C"
         return Microsoft::Quantum::Simulator::create();
     }
 
+    MICROSOFT_QUANTUM_DECL unsigned initSinglePrecision()
+    {
+        return Microsoft::Quantum::Simulator::create(0u, Microsoft::Quantum::Simulator::Precision::Single);
+    }
+
     MICROSOFT_QUANTUM_DECL void destroy(unsigned id)
     {
         Microsoft::Quantum::Simulator::destroy(id);
     }
 
+    MICROSOFT_QUANTUM_DECL void setSingleOwner(unsigned id, bool single)
+    {
+        Microsoft::Quantum::Simulator::get(id)->set_single_owner(single);
+    }
+
+    MICROSOFT_QUANTUM_DECL void setThreads(unsigned id, unsigned threads)
+    {
+        Microsoft::Quantum::Simulator::get(id)->set_threads(threads);
+    }
+
+    MICROSOFT_QUANTUM_DECL double RunBatch(
+        unsigned n,
+        unsigned* sids,
+        void (*circuit)(unsigned, unsigned, void*),
+        void* arg,
+        unsigned cores,
+        unsigned threads_per_simulator)
+    {
+        auto run = [circuit, arg](unsigned i, unsigned id) { circuit(i, id, arg); };
+        Microsoft::Quantum::Simulator::BatchStats stats =
+            sids == nullptr
+                ? Microsoft::Quantum::Simulator::run_batch(n, run, cores, threads_per_simulator)
+                : Microsoft::Quantum::Simulator::run_batch(
+                      std::vector<unsigned>(sids, sids + n), run, cores, threads_per_simulator);
+        return stats.gates_per_second();
+    }
+
+    MICROSOFT_QUANTUM_DECL void setBatchSize(unsigned id, unsigned batch)
+    {
+        Microsoft::Quantum::Simulator::get(id)->set_batch_size(batch);
+    }
+
     MICROSOFT_QUANTUM_DECL void seed(unsigned id, unsigned s)
     {
         Microsoft::Quantum::Simulator::get(id)->seed(s);
@@ -45,6 +82,23 @@ extern "C"
         return Microsoft::Quantum::Simulator::get(id)->JointEnsembleProbability(bv, qv);
     }
 
+    MICROSOFT_QUANTUM_DECL double Expectation(
+        unsigned id,
+        unsigned nterms,
+        unsigned n,
+        int* b,
+        double* c,
+        unsigned* q)
+    {
+        std::vector<std::vector<Gates::Basis>> terms(nterms);
+        for (unsigned k = 0; k < nterms; ++k)
+            for (unsigned i = 0; i < n; ++i)
+                terms[k].push_back(static_cast<Gates::Basis>(*(b + k * n + i)));
+        std::vector<double> cv(c, c + nterms);
+        std::vector<unsigned> qv(q, q + n);
+        return Microsoft::Quantum::Simulator::get(id)->Expectation(terms, cv, qv);
+    }
+
     MICROSOFT_QUANTUM_DECL bool InjectState(
         unsigned sid,
         unsigned n,
@@ -53,7 +107,7 @@ extern "C"
         double* im)
     {
         const size_t N = (static_cast<size_t>(1) << n);
-        std::vector<ComplexType> amplitudes;
+        std::vector<std::complex<double>> amplitudes;
         amplitudes.reserve(N);
         for (size_t i = 0; i < N; i++)
         {
@@ -69,6 +123,12 @@ extern "C"
         return Microsoft::Quantum::Simulator::get(id)->allocate();
     }
 
+    MICROSOFT_QUANTUM_DECL void allocateMany(unsigned id, unsigned n, unsigned* q)
+    {
+        std::vector<unsigned> qubits = Microsoft::Quantum::Simulator::get(id)->allocate(n);
+        std::copy(qubits.begin(), qubits.end(), q);
+    }
+
     MICROSOFT_QUANTUM_DECL void allocateQubit(unsigned id, unsigned q)
     {
         Microsoft::Quantum::Simulator::get(id)->allocateQubit(q);
@@ -81,6 +141,11 @@ extern "C"
         return Microsoft::Quantum::Simulator::get(id)->release(q);
     }
 
+    MICROSOFT_QUANTUM_DECL bool releaseMany(unsigned id, unsigned n, unsigned* q)
+    {
+        return Microsoft::Quantum::Simulator::get(id)->release(std::vector<unsigned>(q, q + n));
+    }
+
     MICROSOFT_QUANTUM_DECL unsigned num_qubits(unsigned id)
     {
         return Microsoft::Quantum::Simulator::get(id)->num_qubits();
@@ -135,6 +200,20 @@ extern "C"
         Microsoft::Quantum::Simulator::get(id)->CR(static_cast<Gates::Basis>(b), phi, cv, q);
     }
 
+    MICROSOFT_QUANTUM_DECL void BatchMCR(
+        unsigned id,
+        unsigned b,
+        double* phis,
+        unsigned nc,
+        unsigned* c,
+        unsigned q)
+    {
+        auto sim = Microsoft::Quantum::Simulator::get(id);
+        std::vector<double> phiv(phis, phis + sim->batch_size());
+        std::vector<unsigned> cv(c, c + nc);
+        sim->BatchR(static_cast<Gates::Basis>(b), phiv, cv, q);
+    }
+
     // Exponential of Pauli operators
     MICROSOFT_QUANTUM_DECL void Exp(
         unsigned id,
@@ -184,6 +263,30 @@ extern "C"
         return (unsigned)Microsoft::Quantum::Simulator::get(id)->Measure(bv, qv);
     }
 
+    MICROSOFT_QUANTUM_DECL unsigned MRelease(unsigned id, unsigned q)
+    {
+        return (unsigned)Microsoft::Quantum::Simulator::get(id)->MRelease(q);
+    }
+
+    MICROSOFT_QUANTUM_DECL void MultiM(unsigned id, unsigned n, unsigned* q, unsigned* r)
+    {
+        std::vector<bool> results = Microsoft::Quantum::Simulator::get(id)->MultiM(std::vector<unsigned>(q, q + n));
+        std::copy(results.begin(), results.end(), r);
+    }
+
+    MICROSOFT_QUANTUM_DECL void BatchM(unsigned id, unsigned q, unsigned* r)
+    {
+        std::vector<bool> results = Microsoft::Quantum::Simulator::get(id)->BatchM(q);
+        std::copy(results.begin(), results.end(), r);
+    }
+
+    MICROSOFT_QUANTUM_DECL void SampleShots(unsigned id, unsigned n, unsigned* q, std::size_t nshots, std::uint64_t* out)
+    {
+        std::vector<std::uint64_t> shots =
+            Microsoft::Quantum::Simulator::get(id)->SampleShots(std::vector<unsigned>(q, q + n), nshots);
+        std::copy(shots.begin(), shots.end(), out);
+    }
+
     // apply permutation of basis states to the wave function
     MICROSOFT_QUANTUM_DECL void PermuteBasis(
         unsigned id,
@@ -5,13 +5,32 @@
 
 #include "config.hpp"
 #include <complex>
+#include <cstddef>
+#include <cstdint>
 
 extern "C"
 {
     // non-quantum
 
     MICROSOFT_QUANTUM_DECL unsigned init(); // NOLINT
+    MICROSOFT_QUANTUM_DECL unsigned initSinglePrecision(); // NOLINT
     MICROSOFT_QUANTUM_DECL void destroy(unsigned sid); // NOLINT
+    // binds the simulator to the calling thread so that its calls don't lock, or makes it thread-safe again
+    MICROSOFT_QUANTUM_DECL void setSingleOwner(unsigned sid, bool single); // NOLINT
+    // number of threads the simulator applies its gates with, 0 picks it by the size of the state
+    MICROSOFT_QUANTUM_DECL void setThreads(unsigned sid, unsigned threads); // NOLINT
+    // runs circuit(i, sids[i], arg) for the n simulators at the same time, each on a partition of
+    // `threads_per_simulator` of the first `cores` cores (all if 0), and returns the gates applied per second by all of
+    // them; simulators are created for the batch and destroyed afterwards if sids is null (see run_batch)
+    MICROSOFT_QUANTUM_DECL double RunBatch( // NOLINT
+         unsigned n,
+         unsigned* sids,
+         void (*circuit)(unsigned, unsigned, void*),
+         void* arg,
+         unsigned cores,
+         unsigned threads_per_simulator);
+    // keeps `batch` (a power of 2) independent states that all get the same gates, only while no qubits are allocated
+    MICROSOFT_QUANTUM_DECL void setBatchSize(unsigned sid, unsigned batch); // NOLINT
     MICROSOFT_QUANTUM_DECL void seed(unsigned sid, unsigned s); // NOLINT
     MICROSOFT_QUANTUM_DECL void Dump(unsigned sid, bool (*callback)(const char*, double, double));
     MICROSOFT_QUANTUM_DECL bool DumpQubits(
@@ -52,6 +71,14 @@ extern "C"
          int* b,
          unsigned* q);
 
+    MICROSOFT_QUANTUM_DECL double Expectation(
+         unsigned sid,
+         unsigned nterms, // number of Pauli strings
+         unsigned n,      // number of qubits
+         int* b,          // nterms * n bases, the Pauli strings one after the other
+         double* c,       // nterms coefficients
+         unsigned* q);
+
     MICROSOFT_QUANTUM_DECL bool InjectState(
          unsigned sid,
          unsigned n,
@@ -62,8 +89,12 @@ extern "C"
 
     // allocate and release
     MICROSOFT_QUANTUM_DECL unsigned allocate(unsigned sid); // NOLINT
+    // allocates n qubits at once and writes their ids to `qids`
+    MICROSOFT_QUANTUM_DECL void allocateMany(unsigned sid, unsigned n, unsigned* qids); // NOLINT
     MICROSOFT_QUANTUM_DECL void allocateQubit(unsigned sid, unsigned qid); // NOLINT
     MICROSOFT_QUANTUM_DECL bool release(unsigned sid, unsigned q); // NOLINT
+    // releases n qubits at once, true if all of them were in the ground state
+    MICROSOFT_QUANTUM_DECL bool releaseMany(unsigned sid, unsigned n, unsigned* qids); // NOLINT
     MICROSOFT_QUANTUM_DECL unsigned num_qubits(unsigned sid); // NOLINT
 
     // single-qubit gates
@@ -99,6 +130,15 @@ extern "C"
          unsigned* c,
          unsigned q);
 
+    // multi-controlled rotations of each state of the batch by its own angle, phis has one per state
+    MICROSOFT_QUANTUM_DECL void BatchMCR(
+         unsigned sid,
+         unsigned b,
+         double* phis,
+         unsigned n,
+         unsigned* c,
+         unsigned q);
+
     // Exponential of Pauli operators
     MICROSOFT_QUANTUM_DECL void Exp(
          unsigned sid,
@@ -122,6 +162,20 @@ extern "C"
          unsigned n,
          unsigned* b,
          unsigned* q);
+    // measures a qubit and releases it, cheaper than M followed by release
+    MICROSOFT_QUANTUM_DECL unsigned MRelease(unsigned sid, unsigned q); // NOLINT
+    // measures n qubits, each in the computational basis, and writes the results to `r`
+    MICROSOFT_QUANTUM_DECL void MultiM(unsigned sid, unsigned n, unsigned* q, unsigned* r); // NOLINT
+    // measures q in each state of the batch and writes the results to `r`
+    MICROSOFT_QUANTUM_DECL void BatchM(unsigned sid, unsigned q, unsigned* r); // NOLINT
+    // draws nshots outcomes of measuring the n (at most 64) qubits from the current state, without changing it, and
+    // writes them to `out`, packed with the result of q[0] as the lowest bit
+    MICROSOFT_QUANTUM_DECL void SampleShots( // NOLINT
+         unsigned sid,
+         unsigned n,
+         unsigned* q,
+         std::size_t nshots,
+         std::uint64_t* out);
 
     // permutation oracle emulation
     MICROSOFT_QUANTUM_DECL void PermuteBasis(
@@ -150,6 +150,29 @@ void test_allocate()
     assert(num_qubits(sim_id) == 0);
     destroy(sim_id);
 }
+void test_release_many()
+{
+    auto sim_id = init();
+    unsigned qs[5];
+    allocateMany(sim_id, 5, qs);
+    X(sim_id, qs[1]);
+    H(sim_id, qs[2]);
+    CX(sim_id, qs[2], qs[3]);
+    H(sim_id, qs[4]);
+
+    // a classical |1>, an entangled pair and a superposition among them: the others are measured and removed too
+    assert(!releaseMany(sim_id, 5, qs));
+    assert(num_qubits(sim_id) == 0);
+
+    allocateMany(sim_id, 3, qs);
+    X(sim_id, qs[0]);
+    assert(M(sim_id, qs[0]) && !M(sim_id, qs[1]) && !M(sim_id, qs[2]));
+    X(sim_id, qs[0]);
+    assert(releaseMany(sim_id, 3, qs));
+    assert(num_qubits(sim_id) == 0);
+    destroy(sim_id);
+}
+
 /*
 // We can't use a lambda with captures to pass to a callback with __stdcall signature,
 // so we use a global variable/function for the check_state callback:
@@ -410,10 +433,179 @@ void test_permute_basis_adjoint()
     destroy(sim_id);
 }
 
+void test_multim()
+{
+    auto sim_id = init();
+    for (unsigned i = 0; i < 4; ++i)
+        allocateQubit(sim_id, i);
+    H(sim_id, 0);
+    CX(sim_id, 0, 1);
+    X(sim_id, 3);
+
+    unsigned qs[] = {3, 2, 1, 0};
+    unsigned rs[4];
+    MultiM(sim_id, 4, qs, rs);
+    assert(rs[0] == 1 && rs[1] == 0 && rs[2] == rs[3]);
+    assert(M(sim_id, 0) == rs[3] && M(sim_id, 1) == rs[2]);
+
+    for (unsigned i = 0; i < 4; ++i)
+        release(sim_id, i);
+    destroy(sim_id);
+}
+
+void test_expectation()
+{
+    auto sim_id = init();
+    allocateQubit(sim_id, 0);
+    allocateQubit(sim_id, 1);
+    H(sim_id, 0);
+    X(sim_id, 1);
+
+    // 2 <X0> + 3 <Z0> - <Z1> + 0.5 <X0 Z1>
+    int bases[] = {1, 0, 2, 0, 0, 2, 1, 2};
+    double coefficients[] = {2., 3., -1., 0.5};
+    unsigned qs[] = {0, 1};
+    assert(std::abs(Expectation(sim_id, 4, 2, bases, coefficients, qs) - 2.5) < 1e-12);
+
+    M(sim_id, 0);
+    release(sim_id, 0);
+    M(sim_id, 1);
+    release(sim_id, 1);
+    destroy(sim_id);
+}
+
+void test_single_precision()
+{
+    constexpr unsigned nqubits = 10;
+    auto run = [](unsigned sim_id) {
+        for (unsigned i = 0; i < nqubits; ++i)
+            allocateQubit(sim_id, i);
+        for (unsigned layer = 0; layer < 4; ++layer)
+        {
+            for (unsigned i = 0; i < nqubits; ++i)
+            {
+                H(sim_id, i);
+                R(sim_id, 3, 0.3 * (i + layer + 1), i);
+            }
+            for (unsigned i = 0; i + 1 < nqubits; ++i)
+                CX(sim_id, i, i + 1);
+            unsigned cs[] = {layer, layer + 2};
+            MCX(sim_id, 2, cs, nqubits - 1);
+            Ry(sim_id, 0.7 * (layer + 1), layer + 1);
+        }
+
+        std::vector<std::complex<double>> amplitudes(1ull << nqubits);
+        DumpToLocation(
+            sim_id,
+            [](size_t idx, double re, double im, TDumpLocation location) {
+                (*static_cast<std::vector<std::complex<double>>*>(location))[idx] = {re, im};
+                return true;
+            },
+            &amplitudes);
+        for (unsigned i = 0; i < nqubits; ++i)
+            M(sim_id, i);
+        for (unsigned i = 0; i < nqubits; ++i)
+            release(sim_id, i);
+        destroy(sim_id);
+        return amplitudes;
+    };
+
+    auto expected = run(init());
+    auto actual = run(initSinglePrecision());
+    for (std::size_t i = 0; i < expected.size(); ++i)
+        assert(std::abs(actual[i] - expected[i]) < 1e-5);
+}
+
+// prepares the basis state |i> on 6 qubits the long way round, and measures it
+void basis_state_circuit(unsigned i, unsigned sim_id, void* results)
+{
+    constexpr unsigned nqubits = 6;
+    for (unsigned q = 0; q < nqubits; ++q)
+        allocateQubit(sim_id, q);
+    for (unsigned q = 0; q < nqubits; ++q)
+    {
+        H(sim_id, q);
+        if ((i >> q) & 1) Z(sim_id, q);
+        H(sim_id, q);
+    }
+    for (unsigned q = 0; q + 1 < nqubits; ++q)
+    {
+        CX(sim_id, q, q + 1);
+        CX(sim_id, q, q + 1);
+    }
+
+    unsigned qs[nqubits], rs[nqubits];
+    for (unsigned q = 0; q < nqubits; ++q)
+        qs[q] = q;
+    MultiM(sim_id, nqubits, qs, rs);
+    unsigned value = 0;
+    for (unsigned q = 0; q < nqubits; ++q)
+        value |= rs[q] << q;
+    static_cast<unsigned*>(results)[i] = value;
+
+    for (unsigned q = 0; q < nqubits; ++q)
+        release(sim_id, q);
+}
+
+void test_batch()
+{
+    constexpr unsigned n = 9;
+    std::vector<unsigned> sims;
+    for (unsigned i = 0; i < n; ++i)
+        sims.push_back(init());
+
+    std::vector<unsigned> results(n, 99);
+    double rate = RunBatch(n, sims.data(), basis_state_circuit, results.data(), 0, 1);
+    assert(rate > 0.);
+    for (unsigned i = 0; i < n; ++i)
+        assert(results[i] == i);
+
+    // the simulators can still be used from this thread afterwards
+    allocateQubit(sims[0], 0);
+    X(sims[0], 0);
+    assert(M(sims[0], 0) == 1);
+    X(sims[0], 0);
+    release(sims[0], 0);
+    for (unsigned id : sims)
+        destroy(id);
+
+    // on simulators of its own, with two cores per simulator
+    std::vector<unsigned> own(40, 99);
+    rate = RunBatch(40, nullptr, basis_state_circuit, own.data(), 0, 2);
+    assert(rate > 0.);
+    for (unsigned i = 0; i < 40; ++i)
+        assert(own[i] == i);
+}
+
+void test_batched_states()
+{
+    // rotations by 0 and pi flip the qubit in every other state of the batch
+    unsigned sid = init();
+    setBatchSize(sid, 8);
+    allocateQubit(sid, 0);
+    allocateQubit(sid, 1);
+    double phis[8];
+    for (unsigned k = 0; k < 8; ++k)
+        phis[k] = (k & 1) ? std::acos(-1.) : 0.;
+    BatchMCR(sid, 1, phis, 0, nullptr, 0);
+    CX(sid, 0, 1);
+    unsigned rs[8];
+    BatchM(sid, 1, rs);
+    for (unsigned k = 0; k < 8; ++k)
+        assert(rs[k] == (k & 1));
+
+    // the states disagree, so the qubits are reset in each of them
+    assert(!release(sid, 0));
+    assert(!release(sid, 1));
+    assert(num_qubits(sid) == 0);
+    destroy(sid);
+}
+
 int main()
 {
     std::cerr << "Testing allocate\n";
     test_allocate();
+    test_release_many();
     std::cerr << "Testing gates\n";
     test_gates();
     std::cerr << "Testing teleport\n";
@@ -421,6 +613,15 @@ int main()
     std::cerr << "Testing basis state permutation\n";
     test_permute_basis();
     test_permute_basis_adjoint();
+    std::cerr << "Testing joint measurement\n";
+    test_multim();
+    std::cerr << "Testing expectation values\n";
+    test_expectation();
+    std::cerr << "Testing single precision\n";
+    test_single_precision();
+    std::cerr << "Testing batches\n";
+    test_batch();
+    test_batched_states();
     std::cerr << "Testing dump\n";
     // test_dump();
     // test_dump_qubits();
@@ -4,8 +4,20 @@
 #include "simulator/factory.hpp"
 #include "config.hpp"
 #include "util/cpuid.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
 #include <iostream>
+#include <mutex>
 #include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace Microsoft
 {
@@ -27,6 +39,14 @@ namespace SimulatorAVX512
 {
 Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned);
 }
+namespace SimulatorGenericFloat
+{
+Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned);
+}
+namespace SimulatorAVX2Float
+{
+Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned);
+}
 } // namespace Quantum
 } // namespace Microsoft
 
@@ -38,10 +58,21 @@ namespace Simulator
 {
 std::shared_mutex _mutex;
 std::vector<std::shared_ptr<SimulatorInterface>> _psis;
+// bumped (under the exclusive lock) whenever a simulator is created or destroyed, which invalidates the lookups that
+// threads cache in `get`
+std::atomic<unsigned> _generation(0);
 
-SimulatorInterface* createSimulator(unsigned maxlocal)
+SimulatorInterface* createSimulator(unsigned maxlocal, Precision precision)
 {
-    if (haveAVX512())
+    if (precision == Precision::Single)
+    {
+        // AVX-512 machines use the AVX2 kernels as well, which fit 4 single-precision amplitudes per register
+        if (haveFMA() && haveAVX2())
+            return SimulatorAVX2Float::createSimulator(maxlocal);
+        else
+            return SimulatorGenericFloat::createSimulator(maxlocal);
+    }
+    else if (haveAVX512())
     {
         return SimulatorAVX512::createSimulator(maxlocal);
     }
@@ -60,6 +91,11 @@ SimulatorInterface* createSimulator(unsigned maxlocal)
 }
 
 MICROSOFT_QUANTUM_DECL unsigned create(unsigned maxlocal)
+{
+    return create(maxlocal, Precision::Double);
+}
+
+MICROSOFT_QUANTUM_DECL unsigned create(unsigned maxlocal, Precision precision)
 {
     std::lock_guard<std::shared_mutex> lock(_mutex);
 
@@ -75,13 +111,14 @@ MICROSOFT_QUANTUM_DECL unsigned create(unsigned maxlocal)
 
     if (emptySlot == (size_t)-1)
     {
-        _psis.push_back(std::shared_ptr<SimulatorInterface>(createSimulator(maxlocal)));
+        _psis.push_back(std::shared_ptr<SimulatorInterface>(createSimulator(maxlocal, precision)));
         emptySlot = _psis.size() - 1;
     }
     else
     {
-        _psis[emptySlot] = std::shared_ptr<SimulatorInterface>(createSimulator(maxlocal));
+        _psis[emptySlot] = std::shared_ptr<SimulatorInterface>(createSimulator(maxlocal, precision));
     }
+    _generation.fetch_add(1, std::memory_order_release);
 
     return static_cast<unsigned>(emptySlot);
 }
@@ -91,13 +128,156 @@ MICROSOFT_QUANTUM_DECL void destroy(unsigned id)
     std::lock_guard<std::shared_mutex> lock(_mutex);
 
     _psis[id].reset();
+    _generation.fetch_add(1, std::memory_order_release);
 }
 
 MICROSOFT_QUANTUM_DECL std::shared_ptr<SimulatorInterface>& get(unsigned id)
 {
+    // Threads usually drive a single simulator, so the last lookup is reused without taking the lock until the set of
+    // simulators changes.
+    thread_local std::shared_ptr<SimulatorInterface>* cached = nullptr;
+    thread_local unsigned cached_id = 0;
+    thread_local unsigned cached_generation = 0;
+    if (cached != nullptr && cached_id == id && cached_generation == _generation.load(std::memory_order_acquire))
+        return *cached;
+
     std::shared_lock<std::shared_mutex> shared_lock(_mutex);
+    cached = &_psis[id];
+    cached_id = id;
+    cached_generation = _generation.load(std::memory_order_relaxed);
+    return *cached;
+}
+
+// The cores the process may run on.
+static std::vector<unsigned> available_cores()
+{
+    std::vector<unsigned> cores;
+#ifdef __linux__
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+    {
+        for (unsigned c = 0; c < CPU_SETSIZE; c++)
+            if (CPU_ISSET(c, &cpus)) cores.push_back(c);
+    }
+#endif
+    if (cores.empty())
+    {
+        for (unsigned c = 0; c < std::max(1u, std::thread::hardware_concurrency()); c++)
+            cores.push_back(c);
+    }
+    return cores;
+}
 
-    return _psis[id];
+// Pins the calling thread to the cores (where supported); threads it starts afterwards inherit them. The workers a
+// simulator started before have to be started again from this thread (see SimulatorInterface::rebind_threads).
+static void pin_thread(std::vector<unsigned> const& cores)
+{
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (unsigned c : cores)
+        CPU_SET(c, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+}
+
+static BatchStats run_batch(
+    std::vector<std::shared_ptr<SimulatorInterface>> const& sims,
+    std::vector<unsigned> const& ids,
+    std::function<void(unsigned, unsigned)> const& circuit,
+    unsigned ncores,
+    unsigned threads_per_simulator)
+{
+    std::vector<unsigned> cores = available_cores();
+    if (ncores > 0 && ncores < cores.size()) cores.resize(ncores);
+    threads_per_simulator = std::max(1u, std::min(threads_per_simulator, static_cast<unsigned>(cores.size())));
+    const std::size_t partitions =
+        std::max<std::size_t>(1, std::min(cores.size() / threads_per_simulator, sims.size()));
+
+    std::atomic<std::size_t> next(0);
+    std::atomic<std::uint64_t> gates(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto worker = [&](std::size_t p) {
+        pin_thread(std::vector<unsigned>(
+            cores.begin() + p * threads_per_simulator, cores.begin() + (p + 1) * threads_per_simulator));
+        for (std::size_t i = next++; i < sims.size(); i = next++)
+        {
+            SimulatorInterface& sim = *sims[i];
+            const bool single = sim.single_owner();
+            if (!single) sim.set_single_owner(true);
+            sim.set_threads(threads_per_simulator);
+            sim.rebind_threads();
+            const std::uint64_t before = sim.gate_count();
+            try
+            {
+                circuit(static_cast<unsigned>(i), ids[i]);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) error = std::current_exception();
+            }
+            gates += sim.gate_count() - before;
+            if (!single) sim.set_single_owner(false);
+        }
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (std::size_t p = 0; p < partitions; p++)
+        threads.emplace_back(worker, p);
+    for (auto& t : threads)
+        t.join();
+
+    BatchStats stats;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    stats.gates = gates;
+    if (error) std::rethrow_exception(error);
+    return stats;
+}
+
+MICROSOFT_QUANTUM_DECL BatchStats run_batch(
+    std::vector<unsigned> const& ids,
+    std::function<void(unsigned, unsigned)> const& circuit,
+    unsigned cores,
+    unsigned threads_per_simulator)
+{
+    // two partitions driving the same simulator would both own it, without taking its lock
+    std::vector<unsigned> sorted(ids);
+    std::sort(sorted.begin(), sorted.end());
+    if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end())
+        throw std::invalid_argument("run_batch: a simulator can only be in a batch once");
+
+    // look the simulators up once, the workers don't need the registry then
+    std::vector<std::shared_ptr<SimulatorInterface>> sims;
+    for (unsigned id : ids)
+        sims.push_back(get(id));
+    return run_batch(sims, ids, circuit, cores, threads_per_simulator);
+}
+
+MICROSOFT_QUANTUM_DECL BatchStats run_batch(
+    unsigned n,
+    std::function<void(unsigned, unsigned)> const& circuit,
+    unsigned cores,
+    unsigned threads_per_simulator)
+{
+    std::vector<unsigned> ids;
+    for (unsigned i = 0; i < n; i++)
+        ids.push_back(create());
+    try
+    {
+        BatchStats stats = run_batch(ids, circuit, cores, threads_per_simulator);
+        for (unsigned id : ids)
+            destroy(id);
+        return stats;
+    }
+    catch (...)
+    {
+        for (unsigned id : ids)
+            destroy(id);
+        throw;
+    }
 }
 
 } // namespace Simulator
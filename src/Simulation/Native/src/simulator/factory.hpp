@@ -3,6 +3,9 @@
 
 #include "config.hpp"
 #include "simulatorinterface.hpp"
+#include <cstdint>
+#include <functional>
+#include <vector>
 
 namespace Microsoft
 {
@@ -10,9 +13,51 @@ namespace Quantum
 {
 namespace Simulator
 {
+/// precision of the amplitudes of a simulator instance
+enum class Precision
+{
+    Double,
+    Single // halves the memory footprint and doubles the amplitudes per vector register
+};
+
 MICROSOFT_QUANTUM_DECL unsigned create(unsigned = 0u);
+MICROSOFT_QUANTUM_DECL unsigned create(unsigned maxlocal, Precision precision);
 MICROSOFT_QUANTUM_DECL void destroy(unsigned);
 MICROSOFT_QUANTUM_DECL std::shared_ptr<SimulatorInterface>& get(unsigned);
+
+/// Aggregate throughput of a batch of simulators (see run_batch)
+struct BatchStats
+{
+    std::uint64_t gates = 0; // applied by all the simulators of the batch
+    double seconds = 0.;     // wall-clock time of the whole batch
+
+    double gates_per_second() const
+    {
+        return seconds > 0. ? static_cast<double>(gates) / seconds : 0.;
+    }
+};
+
+/// Runs circuit(i, ids[i]) for each of the simulators at the same time, for throughput on many small simulations.
+///
+/// The cores of the process (or the first `cores` of them) are split into partitions of `threads_per_simulator` cores,
+/// and each partition runs one simulator at a time, on a thread pinned to those cores that takes the next simulator
+/// when it is done. For the duration of its circuit a simulator is owned by that thread (see set_single_owner), so
+/// the circuit must only use it from the thread it is called on, and it applies its gates with
+/// `threads_per_simulator` threads on the cores of the partition, which it keeps afterwards. Rethrows the first
+/// exception thrown by a circuit after all of them are done. Throws std::invalid_argument if a simulator is in `ids`
+/// more than once.
+MICROSOFT_QUANTUM_DECL BatchStats run_batch(
+    std::vector<unsigned> const& ids,
+    std::function<void(unsigned, unsigned)> const& circuit,
+    unsigned cores = 0,
+    unsigned threads_per_simulator = 1);
+
+/// Same as above on n simulators created for the batch, and destroyed after it.
+MICROSOFT_QUANTUM_DECL BatchStats run_batch(
+    unsigned n,
+    std::function<void(unsigned, unsigned)> const& circuit,
+    unsigned cores = 0,
+    unsigned threads_per_simulator = 1);
 } // namespace Simulator
 } // namespace Quantum
 } // namespace Microsoft
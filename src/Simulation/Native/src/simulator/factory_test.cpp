@@ -2,7 +2,11 @@
 // Licensed under the MIT License.
 
 #include "simulator/factory.hpp"
+#include <cassert>
+#include <cmath>
+#include <complex>
 #include <iostream>
+#include <stdexcept>
 
 using namespace Microsoft::Quantum::Simulator;
 
@@ -24,5 +28,35 @@ int main(int argc, char** argv)
 
     sim->release(q);
 
+    // a single-precision simulator hands out its amplitudes in double precision
+    const unsigned single = create(0, Precision::Single);
+    auto& fsim = get(single);
+    fsim->allocateQubit(0);
+    fsim->allocateQubit(1);
+    fsim->H(0);
+    std::vector<std::complex<double>> amplitudes(2);
+    const bool separable = fsim->subsytemwavefunction(std::vector<unsigned>{0}, amplitudes, 1e-5);
+    assert(separable);
+    assert(std::abs(std::abs(amplitudes[0]) - std::sqrt(0.5)) < 1e-6);
+    assert(std::abs(std::abs(amplitudes[1]) - std::sqrt(0.5)) < 1e-6);
+    fsim->H(0);
+    fsim->release(0);
+    fsim->release(1);
+    Microsoft::Quantum::Simulator::destroy(single);
+
+    // a simulator can't be driven by two partitions of a batch at once
+    const unsigned id = create();
+    bool rejected = false;
+    try
+    {
+        run_batch(std::vector<unsigned>{id, id}, [](unsigned, unsigned) { assert(false); });
+    }
+    catch (std::invalid_argument const&)
+    {
+        rejected = true;
+    }
+    assert(rejected);
+    Microsoft::Quantum::Simulator::destroy(id);
+
     return 0;
 }
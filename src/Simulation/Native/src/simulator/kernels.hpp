@@ -10,8 +10,13 @@
 #include "util/diagmatrix.hpp"
 #include "util/tinymatrix.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <complex>
+#include <cstdint>
+#include <numeric>
+#include <random>
+
 namespace Microsoft
 {
 namespace Quantum
@@ -21,6 +26,75 @@ namespace SIMULATOR
 namespace kernels
 {
 
+/// Non-owning view of a contiguous block of amplitudes, providing the part of the std::vector interface the kernels use.
+/// Allows applying kernels to a cache-sized block of the state vector at a time.
+template <class T>
+class StateBlock
+{
+    T* data_;
+    std::size_t size_;
+
+  public:
+    using value_type = T;
+
+    StateBlock(T* data, std::size_t size)
+        : data_(data)
+        , size_(size)
+    {
+    }
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+    T& operator[](std::size_t i)
+    {
+        return data_[i];
+    }
+    T const& operator[](std::size_t i) const
+    {
+        return data_[i];
+    }
+};
+
+/// The amplitudes of a state whose indices have the value `offset` in the `bits` positions starting at `gap`, indexed
+/// as if those positions were taken out of the index. A kernel applied to it acts on one slab of the state along
+/// qubits it doesn't target (see Fused::apply_parallel).
+template <class T>
+class StridedBlock
+{
+    T* data_;
+    std::size_t size_;
+    unsigned bits_;
+    std::size_t low_;
+    std::size_t offset_;
+
+  public:
+    using value_type = T;
+
+    StridedBlock(T* data, std::size_t size, unsigned gap, unsigned bits, std::size_t offset)
+        : data_(data)
+        , size_(size)
+        , bits_(bits)
+        , low_((std::size_t(1) << gap) - 1)
+        , offset_(offset)
+    {
+    }
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+    T& operator[](std::size_t i)
+    {
+        return data_[((i & ~low_) << bits_) | offset_ | (i & low_)];
+    }
+    T const& operator[](std::size_t i) const
+    {
+        return data_[((i & ~low_) << bits_) | offset_ | (i & low_)];
+    }
+};
+
 inline std::size_t make_mask(std::vector<unsigned> const& qs)
 {
     std::size_t mask = 0;
@@ -29,6 +103,24 @@ inline std::size_t make_mask(std::vector<unsigned> const& qs)
     return mask;
 }
 
+/// the positions of the bits set in mask, in increasing order
+inline std::vector<unsigned> mask_positions(std::size_t mask)
+{
+    std::vector<unsigned> ps;
+    for (unsigned p = 0; mask >> p != 0; p++)
+        if ((mask >> p) & 1ull) ps.push_back(p);
+    return ps;
+}
+
+/// spreads the bits of k over the positions that aren't in `sorted` (in increasing order) by inserting a zero at each
+/// of those, like pdep does; with the controls in `sorted` a loop over k visits only the indices where they are set
+inline std::size_t insert_zeros(std::size_t k, std::vector<unsigned> const& sorted)
+{
+    for (unsigned q : sorted)
+        k = ((k >> q) << (q + 1)) | (k & ((1ull << q) - 1));
+    return k;
+}
+
 template <class T, class A>
 void swap(std::vector<T, A>& wfn, unsigned q1, unsigned q2)
 {
@@ -59,6 +151,67 @@ void swap(std::vector<T, A>& wfn, unsigned q1, unsigned q2)
 #endif
 }
 
+/// Swaps the positions of several disjoint pairs of qubits in a single pass over the state vector. With h pairs, the
+/// amplitudes form groups of 2^(2h) elements that differ only in the bits of the pairs, and within a group the element
+/// with the first bits of the pairs set to p and the second bits set to q is exchanged with the element with p and q
+/// flipped. Groups that start at consecutive indices below the lowest bit of the pairs are processed together, as runs
+/// of contiguous amplitudes, and the runs are limited so that each step touches about 2^14 amplitudes. The number of
+/// combinations grows as 4^h while the runs get shorter, so at most MAX_SWAPS_PER_PASS pairs are swapped per pass.
+constexpr std::size_t MAX_SWAPS_PER_PASS = 3;
+template <class T, class A>
+void swap(std::vector<T, A>& wfn, std::vector<std::pair<unsigned, unsigned>> const& pairs)
+{
+    if (pairs.empty()) return;
+    if (pairs.size() > MAX_SWAPS_PER_PASS)
+    {
+        for (std::size_t i = 0; i < pairs.size(); i += MAX_SWAPS_PER_PASS)
+        {
+            const std::size_t last = std::min(pairs.size(), i + MAX_SWAPS_PER_PASS);
+            swap(wfn, std::vector<std::pair<unsigned, unsigned>>(pairs.begin() + i, pairs.begin() + last));
+        }
+        return;
+    }
+
+    const unsigned h = static_cast<unsigned>(pairs.size());
+    std::vector<std::size_t> first_offsets(1ull << h, 0), second_offsets(1ull << h, 0);
+    for (std::size_t p = 0; p < (1ull << h); ++p)
+    {
+        for (unsigned i = 0; i < h; ++i)
+        {
+            first_offsets[p] |= ((p >> i) & 1ull) << pairs[i].first;
+            second_offsets[p] |= ((p >> i) & 1ull) << pairs[i].second;
+        }
+    }
+    std::vector<unsigned> positions;
+    for (auto const& pair : pairs)
+    {
+        positions.push_back(pair.first);
+        positions.push_back(pair.second);
+    }
+    std::sort(positions.begin(), positions.end());
+
+    const std::size_t ngroups = wfn.size() >> (2 * h);
+    const std::size_t run = std::min(1ull << positions[0], std::max(1ull, (1ull << 14) >> (2 * h)));
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t r = 0; r < static_cast<std::intptr_t>(ngroups / run); r++)
+    {
+        // insert zeros at the positions of the pairs to get the first index of the run
+        std::size_t x = static_cast<std::size_t>(r) * run;
+        for (unsigned pos : positions)
+            x = ((x >> pos) << (pos + 1)) | (x & ((1ull << pos) - 1));
+
+        for (std::size_t p = 0; p < (1ull << h); ++p)
+        {
+            for (std::size_t q = p + 1; q < (1ull << h); ++q)
+            {
+                T* first = &wfn[x | first_offsets[p] | second_offsets[q]];
+                T* second = &wfn[x | first_offsets[q] | second_offsets[p]];
+                std::swap_ranges(first, first + run, second);
+            }
+        }
+    }
+}
+
 template <class T, class A>
 void jointcollapse(std::vector<T, A>& wfn, std::vector<unsigned> const& qs, bool val)
 {
@@ -70,21 +223,6 @@ void jointcollapse(std::vector<T, A>& wfn, std::vector<unsigned> const& qs, bool
         if (poppar(i & mask) != val) wfn[i] = 0.;
 }
 
-template <class T, class A>
-unsigned getvalue(
-    std::vector<std::complex<T>, A> const& wfn,
-    unsigned q,
-    double eps = 100. * std::numeric_limits<T>::epsilon())
-    __attribute__((noinline)) // TODO(rokuzmin, #885): Try to remove `__attribute__((noinline))` after migrating
-                              // to clang-13 on Win and Linux.
-{
-    std::size_t mask = 1ull << q;
-    for (std::size_t i = 0; i < wfn.size(); ++i)
-        if (std::abs(wfn[i]) > eps) return (i & mask ? 1 : 0);
-    // dummy return
-    return 2;
-}
-
 template <class T, class A>
 void collapse(std::vector<T, A>& wfn, unsigned q, bool val, bool compact = false)
 {
@@ -112,38 +250,142 @@ void collapse(std::vector<T, A>& wfn, unsigned q, bool val, bool compact = false
     }
 }
 
+/// removes the classical qubits at the (distinct) positions qs, with values vals, in one pass that shrinks the
+/// state by a factor 2^qs.size()
+///
+/// Amplitude j of the result is amplitude src(j) >= j of the state, with the values of the removed qubits inserted
+/// into j. It is copied in place in stages [l, src(l)), whose sources all lie beyond the stage, so each stage runs in
+/// parallel and the number of stages is logarithmic in the size of the state. The amplitudes are multiplied by scale
+/// on the way, which renormalizes the state when the qubits were just measured.
 template <class T, class A>
-bool isclassical(
+void compact(
+    std::vector<std::complex<T>, A>& wfn,
+    std::vector<unsigned> const& qs,
+    std::vector<bool> const& vals,
+    T scale = 1.)
+{
+    std::vector<unsigned> ps(qs);
+    std::sort(ps.begin(), ps.end());
+    std::size_t set = 0;
+    for (std::size_t k = 0; k < qs.size(); ++k)
+        if (vals[k]) set |= 1ull << qs[k];
+    const std::size_t n = wfn.size() >> ps.size();
+    if (ps.empty()) return;
+
+    auto src = [&ps, set](std::size_t j) {
+        for (unsigned p : ps)
+            j = ((j >> p) << (p + 1)) | (j & ((1ull << p) - 1));
+        return j | set;
+    };
+
+    std::size_t l = 0;
+    while (l < n)
+    {
+        const std::size_t s = src(l);
+        // no qubit set and l below all of them: the amplitudes up to the lowest qubit stay where they are
+        const std::size_t r = (s == l ? std::min(n, std::size_t(1) << ps[0]) : std::min(n, s));
+        if (s != l)
+        {
+#pragma omp parallel for schedule(static)
+            for (std::intptr_t j = static_cast<std::intptr_t>(l); j < static_cast<std::intptr_t>(r); ++j)
+                wfn[j] = wfn[src(j)] * scale;
+        }
+        else if (scale != T(1.))
+        {
+#pragma omp parallel for schedule(static)
+            for (std::intptr_t j = static_cast<std::intptr_t>(l); j < static_cast<std::intptr_t>(r); ++j)
+                wfn[j] *= scale;
+        }
+        l = r;
+    }
+    wfn.resize(n);
+}
+
+/// the value of qubit q if it is classical, 2 if it is in a superposition
+///
+/// Each thread scans its chunk of the static schedule in blocks and all of them stop as soon as amplitudes with
+/// both values have been seen, so a superposition is usually detected long before the end of the state.
+template <class T, class A>
+unsigned probeclassical(
     std::vector<std::complex<T>, A> const& wfn,
     std::size_t q,
     T eps = 100. * std::numeric_limits<T>::epsilon())
 {
-    std::size_t offset = 1ull << q;
-    bool have0 = false;
-    bool have1 = false;
+    constexpr std::intptr_t block = 1024;
+    const std::size_t mask = 1ull << q;
+    const std::intptr_t n = static_cast<std::intptr_t>(wfn.size());
+    std::atomic<bool> have0(false);
+    std::atomic<bool> have1(false);
 
-    std::size_t maski = ~(offset - 1);
-#ifndef _MSC_VER
-#pragma omp parallel for schedule(static) reduction(|| : have0, have1)
-    for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(wfn.size()); i += 2 * offset)
-        for (std::intptr_t j = 0; j < static_cast<std::intptr_t>(offset); ++j)
+#pragma omp parallel
+    {
+        const std::intptr_t nthreads = omp_get_num_threads();
+        const std::intptr_t thread_id = omp_get_thread_num();
+        const std::intptr_t last = n * (thread_id + 1) / nthreads;
+        bool mine0 = false;
+        bool mine1 = false;
+        for (std::intptr_t b = n * thread_id / nthreads; b < last; b += block)
         {
-            have0 = have0 || std::norm(wfn[i + j]) >= eps;
-            have1 = have1 || std::norm(wfn[i + j + offset]) >= eps;
+            if (have0.load(std::memory_order_relaxed) && have1.load(std::memory_order_relaxed)) break;
+            for (std::intptr_t i = b; i < std::min(b + block, last); ++i)
+            {
+                if (std::norm(wfn[i]) >= eps)
+                {
+                    if (i & mask)
+                        mine1 = true;
+                    else
+                        mine0 = true;
+                }
+            }
+            if (mine0) have0.store(true, std::memory_order_relaxed);
+            if (mine1) have1.store(true, std::memory_order_relaxed);
         }
-#else
-#pragma omp parallel for schedule(static) reduction(|| : have0, have1)
-    for (std::intptr_t l = 0; l < static_cast<std::intptr_t>(wfn.size()) / 2; l++)
+    }
+
+    if (have0 && have1) return 2;
+    return have1 ? 1 : 0;
+}
+
+template <class T, class A>
+bool isclassical(
+    std::vector<std::complex<T>, A> const& wfn,
+    std::size_t q,
+    T eps = 100. * std::numeric_limits<T>::epsilon())
+{
+    return probeclassical(wfn, q, eps) < 2;
+}
+
+/// the values of the qubits qs, each 2 if it is in a superposition, in one sweep over the state
+///
+/// Ors together the indices of the amplitudes that aren't zero, and their complements: a qubit is classical if its
+/// bit is set in only one of the two.
+template <class T, class A>
+std::vector<unsigned> probeclassical(
+    std::vector<std::complex<T>, A> const& wfn,
+    std::vector<unsigned> const& qs,
+    T eps = 100. * std::numeric_limits<T>::epsilon())
+{
+    std::size_t ones = 0;
+    std::size_t zeros = 0;
+#pragma omp parallel for schedule(static) reduction(| : ones, zeros)
+    for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(wfn.size()); ++i)
     {
-        std::intptr_t j = l % offset;
-        std::intptr_t i = ((l & maski) << 1);
-        have0 = have0 || std::norm(wfn[i + j]) >= eps;
-        have1 = have1 || std::norm(wfn[i + j + offset]) >= eps;
+        if (std::norm(wfn[i]) >= eps)
+        {
+            ones |= static_cast<std::size_t>(i);
+            zeros |= ~static_cast<std::size_t>(i);
+        }
     }
-#endif
 
-    if (have0 && have1) return false;
-    return true;
+    std::vector<unsigned> vals;
+    vals.reserve(qs.size());
+    for (unsigned q : qs)
+    {
+        const bool one = (ones >> q) & 1;
+        const bool zero = (zeros >> q) & 1;
+        vals.push_back(one && zero ? 2 : (one ? 1 : 0));
+    }
+    return vals;
 }
 
 template <class T, class A>
@@ -194,18 +436,17 @@ inline bool isDiagonal(std::vector<Gates::Basis> const& b)
 // power of square root of -1
 inline ComplexType iExp(int power)
 {
-    using namespace std::literals::complex_literals;
     int p = ((power % 4) + 8) % 4;
     switch (p)
     {
     case 0:
         return 1;
     case 1:
-        return 1i;
+        return ComplexType(0., 1.);
     case 2:
         return -1;
     case 3:
-        return -1i;
+        return ComplexType(0., -1.);
     default:
         assert(false);
     }
@@ -264,8 +505,8 @@ void apply_controlled_exp(
         }
 
         T alpha = std::cos(phi);
-        ComplexType beta = std::sin(phi) * iExp(3 * y_count + 1);
-        ComplexType gamma = std::sin(phi) * iExp(y_count + 1);
+        ComplexType beta = static_cast<RealType>(std::sin(phi)) * iExp(3 * y_count + 1);
+        ComplexType gamma = static_cast<RealType>(std::sin(phi)) * iExp(y_count + 1);
 
 #pragma omp parallel for schedule(static)
         for (std::intptr_t x = 0; x < static_cast<std::intptr_t>(wfn.size()); x++)
@@ -283,6 +524,82 @@ void apply_controlled_exp(
     }
 }
 
+/// Multiplies each amplitude, for which all bits in `cmask` are set, with the entry of the diagonal `d` selected by the
+/// bits at positions `qs` (little-endian: `qs[0]` is the least significant bit of the index into the diagonal). Only
+/// the amplitudes with the controls set are visited.
+template <class V, class T, unsigned N>
+void apply_diagonal(V& wfn, DiagMatrix<T, N> const& d, std::vector<unsigned> const& qs, std::size_t cmask)
+{
+    assert((1ull << qs.size()) == N);
+    T const* diag = d.data();
+    const std::vector<unsigned> controls = mask_positions(cmask);
+
+    // the amplitudes below the lowest control are contiguous, the controls are inserted once per chunk of those
+    const std::size_t nfree = wfn.size() >> controls.size();
+    const std::size_t chunk =
+        std::min<std::size_t>(controls.empty() ? nfree : 1ull << controls[0], std::max<std::size_t>(1, nfree >> 6));
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t c = 0; c < static_cast<std::intptr_t>(nfree / chunk); c++)
+    {
+        const std::size_t first = insert_zeros(static_cast<std::size_t>(c) * chunk, controls) | cmask;
+        for (std::size_t x = first; x < first + chunk; ++x)
+        {
+            std::size_t k = 0;
+            for (std::size_t i = 0; i < qs.size(); ++i)
+                k |= ((x >> qs[i]) & 1ull) << i;
+            wfn[x] *= diag[k];
+        }
+    }
+}
+
+/// Applies a gate that maps each basis state |k> of the qubits qs onto phases[k]|permutation[k]> as an in-place
+/// remap of the amplitudes, i.e. without any matrix-vector multiplications. An empty phases vector stands for all
+/// phases being 1. Only the blocks with all bits of `cmask` set are visited, so that each control halves the work.
+template <class V, class P>
+void apply_permutation(
+    V& wfn,
+    std::vector<unsigned> const& qs,
+    std::vector<std::size_t> const& permutation,
+    std::vector<P> const& phases,
+    std::size_t cmask)
+{
+    constexpr unsigned MAX_QUBITS = 7;
+    assert(qs.size() <= MAX_QUBITS && (1ull << qs.size()) == permutation.size());
+    assert(phases.empty() || phases.size() == permutation.size());
+    using T = typename V::value_type;
+
+    const std::size_t n = permutation.size();
+    // the targets and the controls, whose bits are inserted into the number of the block
+    std::vector<unsigned> fixed = mask_positions(cmask);
+    fixed.insert(fixed.end(), qs.begin(), qs.end());
+    std::sort(fixed.begin(), fixed.end());
+    std::size_t offsets[1u << MAX_QUBITS];
+    for (std::size_t k = 0; k < n; ++k)
+    {
+        offsets[k] = 0;
+        for (std::size_t i = 0; i < qs.size(); ++i)
+            offsets[k] |= ((k >> i) & 1ull) << qs[i];
+    }
+
+    const std::intptr_t nblocks = static_cast<std::intptr_t>(wfn.size() >> fixed.size());
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t b = 0; b < nblocks; b++)
+    {
+        // insert zeros at the positions of qs and the controls to get the first index of the block
+        const std::size_t x = insert_zeros(static_cast<std::size_t>(b), fixed) | cmask;
+
+        T buffer[1u << MAX_QUBITS];
+        if (phases.empty())
+            for (std::size_t k = 0; k < n; ++k)
+                buffer[permutation[k]] = wfn[x | offsets[k]];
+        else
+            for (std::size_t k = 0; k < n; ++k)
+                buffer[permutation[k]] = static_cast<T>(phases[k]) * wfn[x | offsets[k]];
+        for (std::size_t k = 0; k < n; ++k)
+            wfn[x | offsets[k]] = buffer[k];
+    }
+}
+
 template <class T, class A>
 double jointprobability(
     std::vector<T, A> const& wfn,
@@ -346,13 +663,191 @@ double jointprobability(
                 sum += std::conj(wfn[t]) * (alpha1 * wfn[t] + (parity_t ? -beta1 : beta1) * wfn[x]);
             }
         }
-        using namespace std::literals::complex_literals;
-        prob = std::real((0.5 * (sum * ComplexType(0., 1.) + 1.)));
+        prob = std::real((RealType(0.5) * (sum * ComplexType(0., 1.) + RealType(1.))));
     }
 
     return prob;
 }
 
+/// masks of the Pauli product P of the bases b on the qubits qs, such that
+/// P|x> = i^y_count (-1)^|x & yz_bits| |x ^ xy_bits>
+inline void paulimasks(
+    std::vector<Gates::Basis> const& b,
+    std::vector<unsigned> const& qs,
+    std::size_t& xy_bits,
+    std::size_t& yz_bits,
+    int& y_count)
+{
+    xy_bits = 0;
+    yz_bits = 0;
+    y_count = 0;
+    for (std::size_t i = 0; i < b.size(); ++i)
+    {
+        switch (b[i])
+        {
+        case Gates::PauliX:
+            xy_bits |= (1ull << qs[i]);
+            break;
+        case Gates::PauliY:
+            xy_bits |= (1ull << qs[i]);
+            yz_bits |= (1ull << qs[i]);
+            ++y_count;
+            break;
+        case Gates::PauliZ:
+            yz_bits |= (1ull << qs[i]);
+            break;
+        case Gates::PauliI:
+            break;
+        default:
+            assert(false);
+        }
+    }
+}
+
+/// expectation value <psi|P|psi> of the Pauli product of the bases b on the qubits qs, in one pass
+template <class T, class A>
+double pauliexpectation(
+    std::vector<std::complex<T>, A> const& wfn,
+    std::vector<Gates::Basis> const& b,
+    std::vector<unsigned> const& qs)
+{
+    std::size_t xy_bits, yz_bits;
+    int y_count;
+    paulimasks(b, qs, xy_bits, yz_bits, y_count);
+
+    double sum = 0.;
+    if (xy_bits == 0)
+    {
+#pragma omp parallel for schedule(static) reduction(+ : sum)
+        for (std::intptr_t x = 0; x < static_cast<std::intptr_t>(wfn.size()); x++)
+            sum += (poppar(x & yz_bits) ? -1. : 1.) * std::norm(wfn[x]);
+    }
+    else
+    {
+        // P is hermitian, so the terms of x and t = x ^ xy_bits are complex conjugates
+        const std::complex<double> phase = iExp(y_count);
+#pragma omp parallel for schedule(static) reduction(+ : sum)
+        for (std::intptr_t x = 0; x < static_cast<std::intptr_t>(wfn.size()); x++)
+        {
+            std::size_t t = x ^ xy_bits;
+            if (static_cast<std::size_t>(x) < t)
+            {
+                std::complex<double> a = wfn[x];
+                std::complex<double> c = wfn[t];
+                sum += 2. * std::real(std::conj(a) * (poppar(t & yz_bits) ? -phase : phase) * c);
+            }
+        }
+    }
+    return sum;
+}
+
+/// expectation values of the Pauli products of the bases bs[k] on the qubits qs, all in one pass
+///
+/// The terms are grouped by their X/Y mask, so that each pair of amplitudes x, x ^ xy_bits is combined once for all
+/// the terms of a group, which only differ in their Z masks and phases.
+template <class T, class A>
+std::vector<double> pauliexpectations(
+    std::vector<std::complex<T>, A> const& wfn,
+    std::vector<std::vector<Gates::Basis>> const& bs,
+    std::vector<unsigned> const& qs)
+{
+    struct Term
+    {
+        std::size_t index;
+        std::size_t yz_bits;
+        std::complex<double> phase;
+    };
+    std::vector<std::size_t> group_masks;
+    std::vector<std::vector<Term>> groups;
+    for (std::size_t k = 0; k < bs.size(); ++k)
+    {
+        std::size_t xy_bits, yz_bits;
+        int y_count;
+        paulimasks(bs[k], qs, xy_bits, yz_bits, y_count);
+        std::size_t g = std::find(group_masks.begin(), group_masks.end(), xy_bits) - group_masks.begin();
+        if (g == group_masks.size())
+        {
+            group_masks.push_back(xy_bits);
+            groups.emplace_back();
+        }
+        groups[g].push_back(Term{k, yz_bits, iExp(y_count)});
+    }
+
+    std::vector<double> sums(bs.size(), 0.);
+#pragma omp parallel
+    {
+        std::vector<double> mine(bs.size(), 0.);
+#pragma omp for schedule(static)
+        for (std::intptr_t x = 0; x < static_cast<std::intptr_t>(wfn.size()); x++)
+        {
+            for (std::size_t g = 0; g < groups.size(); ++g)
+            {
+                std::size_t t = x ^ group_masks[g];
+                if (t == static_cast<std::size_t>(x))
+                {
+                    const double p = std::norm(wfn[x]);
+                    for (Term const& term : groups[g])
+                        mine[term.index] += poppar(x & term.yz_bits) ? -p : p;
+                }
+                else if (static_cast<std::size_t>(x) < t)
+                {
+                    // the terms of x and t are complex conjugates, see pauliexpectation
+                    const std::complex<double> a = wfn[x];
+                    const std::complex<double> z = 2. * std::conj(a) * std::complex<double>(wfn[t]);
+                    for (Term const& term : groups[g])
+                    {
+                        const double v = std::real(term.phase * z);
+                        mine[term.index] += poppar(t & term.yz_bits) ? -v : v;
+                    }
+                }
+            }
+        }
+#pragma omp critical
+        for (std::size_t k = 0; k < bs.size(); ++k)
+            sums[k] += mine[k];
+    }
+    return sums;
+}
+
+/// projects the state onto the eigenspace of eigenvalue (-1)^val of the Pauli product of the bases b on the qubits qs,
+/// (1 + (-1)^val P) / 2, and multiplies it by scale, in one pass
+template <class T, class A>
+void pauliproject(
+    std::vector<std::complex<T>, A>& wfn,
+    std::vector<Gates::Basis> const& b,
+    std::vector<unsigned> const& qs,
+    bool val,
+    T scale)
+{
+    std::size_t xy_bits, yz_bits;
+    int y_count;
+    paulimasks(b, qs, xy_bits, yz_bits, y_count);
+
+    if (xy_bits == 0)
+    {
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t x = 0; x < static_cast<std::intptr_t>(wfn.size()); x++)
+            wfn[x] = (poppar(x & yz_bits) == val ? wfn[x] * scale : std::complex<T>(0.));
+    }
+    else
+    {
+        const T half = static_cast<T>(0.5) * scale;
+        const std::complex<T> phase = (val ? -half : half) * std::complex<T>(iExp(y_count));
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t x = 0; x < static_cast<std::intptr_t>(wfn.size()); x++)
+        {
+            std::size_t t = x ^ xy_bits;
+            if (static_cast<std::size_t>(x) < t)
+            {
+                auto a = wfn[x];
+                auto c = wfn[t];
+                wfn[x] = half * a + (poppar(t & yz_bits) ? -phase : phase) * c;
+                wfn[t] = half * c + (poppar(x & yz_bits) ? -phase : phase) * a;
+            }
+        }
+    }
+}
+
 // get the 2-norm
 template <class T, class A>
 double nrm2(std::vector<std::complex<T>, A> const& x)
@@ -364,6 +859,150 @@ double nrm2(std::vector<std::complex<T>, A> const& x)
     return std::sqrt(sum);
 }
 
+/// probabilities of the values of the qubits qs, indexed by the value with qs[0] as the lowest bit, in one pass
+///
+/// Each thread sums into its own 2^qs.size() bins, so the caller keeps qs short (see Wavefunction::multimeasure).
+template <class T, class A>
+std::vector<double> marginal(std::vector<std::complex<T>, A> const& wfn, std::vector<unsigned> const& qs)
+{
+    const std::size_t nvals = 1ull << qs.size();
+    std::vector<double> probs(nvals, 0.);
+#pragma omp parallel
+    {
+        std::vector<double> mine(nvals, 0.);
+#pragma omp for schedule(static)
+        for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(wfn.size()); ++i)
+        {
+            std::size_t val = 0;
+            for (std::size_t k = 0; k < qs.size(); ++k)
+                val |= ((i >> qs[k]) & 1ull) << k;
+            mine[val] += std::norm(wfn[i]);
+        }
+#pragma omp critical
+        for (std::size_t val = 0; val < nvals; ++val)
+            probs[val] += mine[val];
+    }
+    return probs;
+}
+
+/// draws nshots basis states with probabilities |amplitude|^2, without changing the state, and returns the bits of
+/// each at the positions qs, packed with qs[0] as the lowest bit, in random order
+///
+/// One pass sums up the probabilities of the chunks of the static schedule. The sorted uniforms are then split up
+/// among the chunks by the prefix sums of those, and each chunk is walked once for all of its shots, so any number of
+/// shots costs two passes over the state.
+template <class T, class A, class R>
+std::vector<std::uint64_t> sampleshots(
+    std::vector<std::complex<T>, A> const& wfn,
+    std::vector<unsigned> const& qs,
+    std::size_t nshots,
+    R& rng)
+{
+    assert(qs.size() <= 64);
+    const std::intptr_t n = static_cast<std::intptr_t>(wfn.size());
+    const std::intptr_t nchunks = std::max(1, omp_get_max_threads());
+    std::vector<double> prefix(nchunks + 1, 0.);
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t c = 0; c < nchunks; ++c)
+    {
+        double sum = 0.;
+        for (std::intptr_t i = n * c / nchunks; i < n * (c + 1) / nchunks; ++i)
+            sum += std::norm(wfn[i]);
+        prefix[c + 1] = sum;
+    }
+    std::partial_sum(prefix.begin(), prefix.end(), prefix.begin());
+
+    std::uniform_real_distribution<double> uniform(0., prefix.back());
+    std::vector<double> us(nshots);
+    for (double& u : us)
+        u = uniform(rng);
+    std::sort(us.begin(), us.end());
+
+    std::vector<std::uint64_t> shots(nshots);
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t c = 0; c < nchunks; ++c)
+    {
+        const std::size_t first = std::lower_bound(us.begin(), us.end(), prefix[c]) - us.begin();
+        const std::size_t last =
+            (c + 1 == nchunks ? nshots : std::lower_bound(us.begin(), us.end(), prefix[c + 1]) - us.begin());
+        const std::intptr_t end = n * (c + 1) / nchunks;
+        std::intptr_t i = n * c / nchunks;
+        std::intptr_t picked = i;
+        double cum = prefix[c];
+        for (std::size_t s = first; s < last; ++s)
+        {
+            // rounding may leave the last uniforms beyond the last amplitude, which then get the last nonzero one
+            while (i < end && cum + std::norm(wfn[i]) <= us[s])
+            {
+                if (std::norm(wfn[i]) > 0.) picked = i;
+                cum += std::norm(wfn[i++]);
+            }
+            if (i < end) picked = i;
+
+            std::uint64_t bits = 0;
+            for (std::size_t k = 0; k < qs.size(); ++k)
+                bits |= static_cast<std::uint64_t>((picked >> qs[k]) & 1) << k;
+            shots[s] = bits;
+        }
+    }
+    std::shuffle(shots.begin(), shots.end(), rng);
+    return shots;
+}
+
+/// collapses the qubits qs to the bits of val (qs[0] the lowest) and scales the remaining amplitudes, in one pass
+template <class T, class A>
+void multicollapse(std::vector<std::complex<T>, A>& wfn, std::vector<unsigned> const& qs, std::size_t val, T scale)
+{
+    const std::size_t mask = make_mask(qs);
+    std::size_t state = 0;
+    for (std::size_t k = 0; k < qs.size(); ++k)
+        state |= ((val >> k) & 1ull) << qs[k];
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(wfn.size()); ++i)
+        wfn[i] = ((i & mask) == state ? wfn[i] * scale : std::complex<T>(0.));
+}
+
+/// Applies mats[b] to the qubit at position q of state b of the batch of mats.size() states interleaved in wfn, i.e.
+/// amplitude k of state b is at index k * mats.size() + b (see Wavefunction::set_batch_size), where all bits of cmask
+/// are set. The states of the batch take the low bits of the index, so the inner loop runs over contiguous amplitudes
+/// with a matrix per lane.
+template <class T, class A, class M>
+void apply_batched(std::vector<T, A>& wfn, std::vector<M> const& mats, unsigned q, std::size_t cmask)
+{
+    const std::size_t batch = mats.size();
+    const std::size_t offset = 1ull << q;
+    assert((batch & (batch - 1)) == 0 && offset >= batch && (cmask & (batch - 1)) == 0);
+
+    std::vector<T> m00(batch), m01(batch), m10(batch), m11(batch);
+    for (std::size_t b = 0; b < batch; ++b)
+    {
+        m00[b] = static_cast<T>(mats[b](0, 0));
+        m01[b] = static_cast<T>(mats[b](0, 1));
+        m10[b] = static_cast<T>(mats[b](1, 0));
+        m11[b] = static_cast<T>(mats[b](1, 1));
+    }
+
+    const std::intptr_t ngroups = static_cast<std::intptr_t>(wfn.size() / (2 * batch));
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t g = 0; g < ngroups; g++)
+    {
+        // insert a zero at position q into the index of the first amplitude of the group
+        const std::size_t i = static_cast<std::size_t>(g) * batch;
+        const std::size_t x = ((i >> q) << (q + 1)) | (i & (offset - 1));
+        if ((x & cmask) != cmask) continue;
+
+        T* lo = &wfn[x];
+        T* hi = &wfn[x | offset];
+        for (std::size_t b = 0; b < batch; ++b)
+        {
+            const T a0 = lo[b];
+            const T a1 = hi[b];
+            lo[b] = m00[b] * a0 + m01[b] * a1;
+            hi[b] = m10[b] * a0 + m11[b] * a1;
+        }
+    }
+}
+
 template <class T, class A>
 void normalize(std::vector<T, A>& wfn)
 {
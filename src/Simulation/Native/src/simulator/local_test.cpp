@@ -7,9 +7,16 @@
 #include "util/bititerator.hpp"
 #include "util/bitops.hpp"
 
+#include <algorithm>
 #include <bitset>
 #include <chrono>
 #include <cmath>
+#include <fstream>
+#include <map>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <thread>
 
 using namespace Microsoft::Quantum::SIMULATOR;
 
@@ -182,6 +189,346 @@ TEST_CASE("Logical vs positional qubit ids", "[local_test]")
     REQUIRE(psi.num_qubits() == 0);
 }
 
+TEST_CASE("Qubits are added to the state when it is needed", "[local_test]")
+{
+    SimulatorType sim;
+    auto qs = sim.allocate(3);
+    sim.H(qs[0]);
+    sim.X(qs[2]);
+    CHECK(std::abs(sim.data()[0b100] - ComplexType(M_SQRT1_2)) < 1e-12);
+    CHECK(std::abs(sim.data()[0b101] - ComplexType(M_SQRT1_2)) < 1e-12);
+
+    // the new qubits are in state |0> and grow the state only once
+    auto rs = sim.allocate(5);
+    REQUIRE(sim.num_qubits() == 8);
+    sim.X(rs[4]);
+    CHECK(std::abs(sim.data()[0b10000100] - ComplexType(M_SQRT1_2)) < 1e-12);
+    CHECK(std::abs(sim.data()[0b10000101] - ComplexType(M_SQRT1_2)) < 1e-12);
+
+    // a qubit that is released and allocated again reuses the storage
+    sim.X(rs[4]);
+    REQUIRE(sim.release(rs[4]));
+    const ComplexType* storage = sim.data();
+    rs[4] = sim.allocate();
+    CHECK(sim.data() == storage);
+    CHECK(std::abs(sim.data()[0b00000100] - ComplexType(M_SQRT1_2)) < 1e-12);
+    CHECK(std::abs(sim.data()[0b00000101] - ComplexType(M_SQRT1_2)) < 1e-12);
+}
+
+TEST_CASE("Fusion parameters follow the qubits still to be added", "[local_test]")
+{
+    // 22 qubits are large enough to pre-fuse (see Fused::shouldFlush), although the state isn't grown before the first
+    // flush
+    Wavefunction<ComplexType> psi;
+    psi.get_fused().setAutotune(Autotune::Off);
+    std::vector<logical_qubit_id> qs;
+    for (unsigned i = 0; i < 22; i++)
+        qs.push_back(psi.allocate_qubit());
+    psi.apply(Gates::H(qs[0]));
+    CHECK(psi.get_fused().maxSpan() == 4);
+}
+
+TEST_CASE("Measuring several qubits at once", "[local_test]")
+{
+    // |GHZ> on qubits 0, 2 and 4 and |+> on qubit 3, measured more than MAX_MARGINAL_QUBITS at a time
+    std::map<std::vector<bool>, int> counts;
+    const int shots = 400;
+    for (int shot = 0; shot < shots; ++shot)
+    {
+        SimulatorType sim;
+        sim.seed(shot);
+        auto qs = sim.allocate(12);
+        sim.H(qs[0]);
+        sim.CX(qs[0], qs[2]);
+        sim.CX(qs[2], qs[4]);
+        sim.H(qs[3]);
+        sim.Ry(0.4, qs[11]);
+
+        std::vector<logical_qubit_id> measured = {qs[0], qs[2], qs[3], qs[4], qs[5], qs[6],
+                                                  qs[7], qs[8], qs[9], qs[10], qs[11]};
+        auto results = sim.MultiM(measured);
+        REQUIRE(results.size() == measured.size());
+        CHECK(results[0] == results[1]);
+        CHECK(results[0] == results[3]);
+        for (std::size_t i = 4; i < 10; ++i)
+            CHECK(!results[i]);
+
+        // the state is collapsed to the measured values and normalized
+        std::size_t index = 0;
+        for (std::size_t i = 0; i < measured.size(); ++i)
+            if (results[i]) index |= std::size_t(1) << measured[i];
+        CHECK(std::abs(std::norm(sim.data()[index]) - 1.) < 1e-12);
+        counts[{results[0], results[2], results[10]}]++;
+    }
+    // qubit 11 is 1 with probability sin(0.2)^2 ~ 0.04
+    CHECK(counts.size() >= 4);
+    int ones = 0;
+    for (auto const& c : counts)
+        if (c.first[2]) ones += c.second;
+    CHECK(ones < shots / 10);
+}
+
+TEST_CASE("Measuring a qubit collapses and renormalizes in one pass", "[local_test]")
+{
+    for (unsigned seed = 0; seed < 8; ++seed)
+    {
+        SimulatorType sim, released;
+        sim.seed(seed);
+        released.seed(seed);
+        for (SimulatorType* s : {&sim, &released})
+        {
+            auto qs = s->allocate(3);
+            s->Ry(1.1, qs[0]);
+            s->H(qs[1]);
+            s->CX(qs[1], qs[2]);
+            s->Ry(0.3, qs[2]);
+        }
+
+        // compacting on measure leaves the state of the other qubits, the same as measuring and releasing
+        const bool result = sim.M(1);
+        REQUIRE(released.MRelease(1) == result);
+        REQUIRE(sim.release(std::vector<logical_qubit_id>(1, 1)) == !result);
+        REQUIRE(released.num_qubits() == 2);
+        double norm = 0.;
+        for (std::size_t i = 0; i < 4; ++i)
+        {
+            CHECK(std::abs(released.data()[i] - sim.data()[i]) < 1e-12);
+            norm += std::norm(released.data()[i]);
+        }
+        CHECK(std::abs(norm - 1.) < 1e-12);
+    }
+}
+
+TEST_CASE("Measuring Pauli products without changing the basis", "[local_test]")
+{
+    // compared to changing the basis around a measurement of the parity in the computational basis
+    std::mt19937 rng(5);
+    for (int round = 0; round < 40; ++round)
+    {
+        SimulatorType sim, reference;
+        sim.seed(round);
+        reference.seed(round);
+        auto qs = sim.allocate(5);
+        reference.allocate(5);
+        for (SimulatorType* s : {&sim, &reference})
+        {
+            for (unsigned q = 0; q < 5; ++q)
+            {
+                s->Ry(0.4 + 0.3 * q, q);
+                s->R(Gates::PauliZ, 0.1 + 0.2 * q, q);
+            }
+            s->CX(0, 3);
+            s->CX(4, 1);
+        }
+
+        std::vector<Gates::Basis> bs;
+        for (unsigned q = 0; q < 5; ++q)
+            bs.push_back(static_cast<Gates::Basis>(rng() % 4));
+
+        const double p = sim.JointEnsembleProbability(bs, qs);
+        const bool result = sim.Measure(bs, qs);
+
+        for (unsigned q = 0; q < 5; ++q)
+            if (bs[q] == Gates::PauliX)
+                reference.H(q);
+            else if (bs[q] == Gates::PauliY)
+                reference.AdjHY(q);
+        std::vector<logical_qubit_id> measured;
+        for (unsigned q = 0; q < 5; ++q)
+            if (bs[q] != Gates::PauliI) measured.push_back(q);
+        double expected = 0.;
+        reference.flush();
+        for (std::size_t i = 0; i < 32; ++i)
+        {
+            bool parity = false;
+            for (logical_qubit_id q : measured)
+                parity ^= ((i >> q) & 1) != 0;
+            if (parity) expected += std::norm(reference.data()[i]);
+        }
+        CHECK(std::abs(p - expected) < 1e-12);
+        if (measured.empty()) continue;
+
+        REQUIRE(reference.Measure(std::vector<Gates::Basis>(measured.size(), Gates::PauliZ), measured) == result);
+        for (unsigned q = 0; q < 5; ++q)
+            if (bs[q] == Gates::PauliX)
+                reference.H(q);
+            else if (bs[q] == Gates::PauliY)
+                reference.HY(q);
+        sim.flush();
+        reference.flush();
+        for (std::size_t i = 0; i < 32; ++i)
+            CHECK(std::abs(sim.data()[i] - reference.data()[i]) < 1e-12);
+    }
+}
+
+TEST_CASE("Expectation values of many Pauli strings in one pass", "[local_test]")
+{
+    SimulatorType sim;
+    auto qs = sim.allocate(4);
+    for (unsigned q = 0; q < 4; ++q)
+    {
+        sim.Ry(0.5 + 0.4 * q, q);
+        sim.R(Gates::PauliZ, 0.3 * q, q);
+    }
+    sim.CX(0, 2);
+    sim.CX(3, 1);
+    sim.flush();
+    const std::vector<ComplexType> state(sim.data(), sim.data() + 16);
+
+    // all the Pauli strings on 4 qubits, so several of them share each X/Y mask
+    std::vector<std::vector<Gates::Basis>> terms;
+    std::vector<double> coefficients;
+    double expected = 0.;
+    for (unsigned k = 0; k < 256; ++k)
+    {
+        std::vector<Gates::Basis> term;
+        for (unsigned q = 0; q < 4; ++q)
+            term.push_back(static_cast<Gates::Basis>((k >> (2 * q)) & 3));
+        const double c = 0.01 * (k % 17) - 0.05;
+        const bool identity = std::all_of(term.begin(), term.end(), [](Gates::Basis b) { return b == Gates::PauliI; });
+        expected += c * (identity ? 1. : 1. - 2. * sim.JointEnsembleProbability(term, qs));
+        terms.push_back(term);
+        coefficients.push_back(c);
+    }
+    CHECK(std::abs(sim.Expectation(terms, coefficients, qs) - expected) < 1e-12);
+
+    // the state is left unchanged
+    for (std::size_t i = 0; i < 16; ++i)
+        CHECK(sim.data()[i] == state[i]);
+}
+
+TEST_CASE("Sampling shots from the final state", "[local_test]")
+{
+    SimulatorType sim;
+    sim.seed(3);
+    auto qs = sim.allocate(5);
+    for (unsigned q = 0; q < 5; ++q)
+        sim.Ry(0.3 + 0.35 * q, qs[q]);
+    sim.CX(qs[0], qs[3]);
+    sim.CX(qs[4], qs[1]);
+    sim.flush();
+    const std::vector<ComplexType> state(sim.data(), sim.data() + 32);
+
+    // qubits 3, 1 and 4, in that order
+    std::vector<logical_qubit_id> sampled = {qs[3], qs[1], qs[4]};
+    const std::size_t nshots = 20000;
+    auto shots = sim.SampleShots(sampled, nshots);
+    REQUIRE(shots.size() == nshots);
+
+    std::vector<double> expected(8, 0.), frequencies(8, 0.);
+    for (std::size_t i = 0; i < 32; ++i)
+        expected[((i >> 3) & 1) | (((i >> 1) & 1) << 1) | (((i >> 4) & 1) << 2)] += std::norm(state[i]);
+    REQUIRE(*std::max_element(shots.begin(), shots.end()) < 8);
+    for (auto shot : shots)
+        frequencies[shot] += 1. / nshots;
+    for (std::size_t v = 0; v < 8; ++v)
+        CHECK(std::abs(frequencies[v] - expected[v]) < 0.02);
+
+    // the shots come in random order, and the state is left unchanged
+    CHECK(!std::is_sorted(shots.begin(), shots.end()));
+    for (std::size_t i = 0; i < 32; ++i)
+        CHECK(sim.data()[i] == state[i]);
+}
+
+TEST_CASE("A simulator owned by a single thread doesn't lock", "[local_test]")
+{
+    SimulatorType sim, reference;
+    sim.set_single_owner(true);
+    REQUIRE(sim.single_owner());
+    for (SimulatorType* s : {&sim, &reference})
+    {
+        auto qs = s->allocate(3);
+        s->H(qs[0]);
+        s->CX(qs[0], qs[1]);
+        s->Ry(0.7, qs[2]);
+        s->flush();
+    }
+    for (std::size_t i = 0; i < 8; ++i)
+        CHECK(sim.data()[i] == reference.data()[i]);
+
+    // the calls of another thread are serialized again once the simulator is thread-safe
+    sim.set_single_owner(false);
+    std::thread other([&sim]() {
+        for (int i = 0; i < 1000; ++i)
+            sim.T(0);
+    });
+    for (int i = 0; i < 1000; ++i)
+        sim.T(1);
+    other.join();
+    sim.flush();
+    CHECK(std::abs(std::norm(sim.data()[0b011]) - std::norm(reference.data()[0b011])) < 1e-12);
+}
+
+TEST_CASE("Classical probe of a qubit", "[local_test]")
+{
+    const unsigned n = 14;
+    std::vector<ComplexType> wfn(std::size_t(1) << n, 0.);
+    wfn[0b101] = 1.;
+    CHECK(kernels::probeclassical(wfn, 0) == 1);
+    CHECK(kernels::probeclassical(wfn, 1) == 0);
+    CHECK(kernels::probeclassical(wfn, n - 1) == 0);
+    CHECK(kernels::probeclassical(wfn, std::vector<unsigned>{2, 1, 0, n - 1}) == std::vector<unsigned>{1, 0, 1, 0});
+
+    // the amplitudes that differ in the highest qubit are as far apart as possible
+    wfn[0b101] = M_SQRT1_2;
+    wfn[(std::size_t(1) << (n - 1)) | 0b101] = M_SQRT1_2;
+    CHECK(kernels::probeclassical(wfn, 0) == 1);
+    CHECK(kernels::probeclassical(wfn, n - 1) == 2);
+    CHECK(!kernels::isclassical(wfn, n - 1));
+    CHECK(kernels::probeclassical(wfn, std::vector<unsigned>{n - 1, 0}) == std::vector<unsigned>{2, 1});
+
+    // amplitudes below the tolerance don't count
+    wfn[(std::size_t(1) << (n - 1)) | 0b100] = 1e-10;
+    CHECK(kernels::probeclassical(wfn, 0) == 1);
+    CHECK(kernels::probeclassical(wfn, std::vector<unsigned>{0, 1}) == std::vector<unsigned>{1, 0});
+}
+
+TEST_CASE("Qubits released together are removed in one pass", "[local_test]")
+{
+    // 10 qubits, of which 6 are released in the states |0> and |1>, compared to a state of the 4 others only
+    Wavefunction<ComplexType> psi, reference;
+    std::vector<logical_qubit_id> qs, kept, released;
+    for (unsigned i = 0; i < 10; i++)
+        qs.push_back(psi.allocate_qubit());
+    for (unsigned i = 0; i < 4; i++)
+        reference.allocate_qubit();
+    for (unsigned i : {1, 2, 5, 8})
+        kept.push_back(qs[i]);
+    for (unsigned i : {0, 3, 4, 6, 7, 9})
+        released.push_back(qs[i]);
+
+    for (unsigned i = 0; i < 4; i++)
+    {
+        psi.apply(Gates::R(Gates::PauliY, 0.3 + i, kept[i]));
+        reference.apply(Gates::R(Gates::PauliY, 0.3 + i, i));
+    }
+    psi.apply_controlled(kept[0], Gates::H(kept[3]));
+    reference.apply_controlled(0, Gates::H(3));
+    for (unsigned i : {3, 4, 9})
+        psi.apply(Gates::X(qs[i]));
+    psi.flush();
+    reference.flush();
+    const std::size_t capacity = psi.data().capacity();
+
+    psi.release(released);
+    REQUIRE(psi.num_qubits() == 4);
+    REQUIRE(psi.data().size() == 16);
+    // the memory is returned
+    CHECK(psi.data().capacity() < capacity);
+    for (unsigned i = 0; i < 4; i++)
+        CHECK(psi.get_qubit_position(kept[i]) == i);
+    for (std::size_t i = 0; i < 16; i++)
+        CHECK(std::abs(psi.data()[i] - reference.data()[i]) < 1e-12);
+
+    // the highest qubit in |0> leaves the amplitudes where they are
+    logical_qubit_id q = psi.allocate_qubit();
+    psi.apply(Gates::H(q));
+    psi.apply(Gates::H(q));
+    psi.release(q);
+    for (std::size_t i = 0; i < 16; i++)
+        CHECK(std::abs(psi.data()[i] - reference.data()[i]) < 1e-12);
+}
+
 TEST_CASE("Clustering", "[local_test]")
 {
     TinyMatrix<ComplexType, 2> ignore;
@@ -320,6 +667,882 @@ TEST_CASE("Clustering", "[local_test]")
     }
 }
 
+TEST_CASE("Lookahead clustering", "[local_test]")
+{
+    TinyMatrix<ComplexType, 2> ignore;
+    const int unlimited = 99;
+
+    DeferredGate g_n_1({} /*controls*/, 1 /*target*/, ignore);
+    DeferredGate g_n_2({} /*controls*/, 2 /*target*/, ignore);
+    DeferredGate g_n_3({} /*controls*/, 3 /*target*/, ignore);
+    DeferredGate g_n_4({} /*controls*/, 4 /*target*/, ignore);
+    DeferredGate g_1_2({1} /*controls*/, 2 /*target*/, ignore);
+    DeferredGate g_1_3({1} /*controls*/, 3 /*target*/, ignore);
+    DeferredGate g_4_5({4} /*controls*/, 5 /*target*/, ignore);
+
+    // X(q1), X(q2), X(q3), CNOT(q1, q2), CNOT(q1, q3), Y(q1), Y(q2), Y(q3)
+    // Unlike the greedy clustering, the scheduler isn't blocked by CNOT(q1, q3) and adds Y(q2) to the first cluster.
+    SECTION("Many CNOT gates")
+    {
+        std::vector<DeferredGate> gates{g_n_1, g_n_2, g_n_3, g_1_2, g_1_3, g_n_1, g_n_2, g_n_3};
+        auto cls = Cluster::schedule_clusters(2 /*cluster qubit width*/, unlimited /*gates per cluster*/, gates);
+        REQUIRE(cls.size() == 2);
+
+        auto it = cls.begin();
+        CHECK(it->get_qids() == std::vector<logical_qubit_id>{1, 2});
+        CHECK(it->get_gates().size() == 4);
+
+        ++it;
+        CHECK(it->get_qids() == std::vector<logical_qubit_id>{1, 3});
+        CHECK(it->get_gates().size() == 4);
+    }
+
+    SECTION("CNOT as barrier") // {X(q1), Y(q1), CNOT(q1, q2), Z(q1)}
+    {
+        std::vector<DeferredGate> gates{g_n_1, g_n_1, g_1_2, g_n_1};
+        auto cls = Cluster::schedule_clusters(1 /*cluster qubit width*/, unlimited /*gates per cluster*/, gates);
+        REQUIRE(cls.size() == 3);
+        CHECK(cls.front().get_gates().size() == 2);
+        CHECK(cls.back().get_qids() == std::vector<logical_qubit_id>{1});
+    }
+
+    SECTION("Fusion limit on single qubit")
+    {
+        std::vector<DeferredGate> gates{g_n_1, g_n_1, g_n_1, g_n_1};
+        auto cls = Cluster::schedule_clusters(1 /*cluster qubit width*/, 2 /*gates per cluster*/, gates);
+        REQUIRE(cls.size() == 2);
+        CHECK(cls.front().get_gates().size() == 2);
+        CHECK(cls.back().get_gates().size() == 2);
+    }
+
+    // With a wide span, growing the cluster to 5 qubits for a single gate would double the cost of the sweep.
+    SECTION("Wide clusters must pay off") // {X(q1), X(q2), X(q3), X(q4), CNOT(q4, q5)}
+    {
+        std::vector<DeferredGate> gates{g_n_1, g_n_2, g_n_3, g_n_4, g_4_5};
+        auto cls = Cluster::schedule_clusters(7 /*cluster qubit width*/, unlimited /*gates per cluster*/, gates);
+        REQUIRE(cls.size() == 2);
+        CHECK(cls.front().get_qids() == std::vector<logical_qubit_id>{1, 2, 3, 4});
+        CHECK(cls.back().get_qids() == std::vector<logical_qubit_id>{4, 5});
+    }
+
+    SECTION("Diagonal gates commute") // {T(q1), H(q2), CT(q1, q2), T(q1)}
+    {
+        DeferredGate d_n_1({} /*controls*/, 1 /*target*/, Gates::T(0).matrix());
+        DeferredGate d_1_2({1} /*controls*/, 2 /*target*/, Gates::T(0).matrix());
+        DeferredGate h_n_2({} /*controls*/, 2 /*target*/, Gates::H(0).matrix());
+        std::vector<DeferredGate> gates{d_n_1, h_n_2, d_1_2, d_n_1};
+        auto cls = Cluster::schedule_clusters(1 /*cluster qubit width*/, unlimited /*gates per cluster*/, gates);
+        REQUIRE(cls.size() == 3);
+        CHECK(cls.front().get_qids() == std::vector<logical_qubit_id>{1});
+        CHECK(cls.front().get_gates().size() == 2);
+    }
+}
+
+TEST_CASE("Lookahead clustering preserves the state", "[local_test]")
+{
+    // Apply the same circuit twice, once flushing after each gate, and compare the states.
+    SimulatorType sim, reference;
+    const unsigned n = 6;
+    auto qs = sim.allocate(n);
+    auto rs = reference.allocate(n);
+
+    std::mt19937 rng(42);
+    for (int i = 0; i < 300; i++)
+    {
+        const unsigned a = rng() % n;
+        const unsigned b = (a + 1 + rng() % (n - 1)) % n;
+        const unsigned c = rng() % n;
+        const double theta = 0.1 * (rng() % 31);
+        switch (rng() % 6)
+        {
+        case 0:
+            sim.H(qs[a]);
+            reference.H(rs[a]);
+            break;
+        case 1:
+            sim.T(qs[a]);
+            reference.T(rs[a]);
+            break;
+        case 2:
+            sim.Ry(theta, qs[a]);
+            reference.Ry(theta, rs[a]);
+            break;
+        case 3:
+            sim.CX(qs[a], qs[b]);
+            reference.CX(rs[a], rs[b]);
+            break;
+        case 4:
+            sim.CZ(qs[a], qs[b]);
+            reference.CZ(rs[a], rs[b]);
+            break;
+        case 5:
+            if (c == a || c == b) continue;
+            sim.CX({qs[a], qs[b]}, qs[c]);
+            reference.CX({rs[a], rs[b]}, rs[c]);
+            break;
+        }
+        reference.flush();
+    }
+
+    sim.flush();
+    for (size_t x = 0; x < (1ull << n); ++x)
+    {
+        INFO(std::string("amplitude mismatch at ") + std::to_string(x));
+        CHECK(std::abs(sim.data()[x] - reference.data()[x]) < 1e-10);
+    }
+}
+
+TEST_CASE("Cache-blocked flush", "[local_test]")
+{
+    // Apply the same circuit with tiny blocks of 2^3 amplitudes, which forces remapping of the high qubits, and without
+    // blocking, and compare the states.
+    Wavefunction<ComplexType> blocked, reference;
+    blocked.get_fused().setBlockQubits(3);
+    reference.get_fused().setBlockQubits(0);
+    const unsigned n = 9;
+    std::vector<logical_qubit_id> qs;
+    for (unsigned i = 0; i < n; i++)
+    {
+        qs.push_back(blocked.allocate_qubit());
+        reference.allocate_qubit();
+    }
+
+    std::mt19937 rng(7);
+    for (int i = 0; i < 500; i++)
+    {
+        const unsigned a = rng() % n;
+        const unsigned b = (a + 1 + rng() % (n - 1)) % n;
+        const double theta = 0.1 * (rng() % 31);
+        switch (rng() % 5)
+        {
+        case 0:
+            blocked.apply(Gates::H(qs[a]));
+            reference.apply(Gates::H(qs[a]));
+            break;
+        case 1:
+            blocked.apply(Gates::T(qs[a]));
+            reference.apply(Gates::T(qs[a]));
+            break;
+        case 2:
+            blocked.apply(Gates::R(Gates::PauliY, theta, qs[a]));
+            reference.apply(Gates::R(Gates::PauliY, theta, qs[a]));
+            break;
+        case 3:
+            blocked.apply_controlled(qs[a], Gates::X(qs[b]));
+            reference.apply_controlled(qs[a], Gates::X(qs[b]));
+            break;
+        case 4:
+            blocked.apply_controlled(qs[a], Gates::R(Gates::PauliX, theta, qs[b]));
+            reference.apply_controlled(qs[a], Gates::R(Gates::PauliX, theta, qs[b]));
+            break;
+        }
+        if (i % 100 == 99)
+        {
+            blocked.flush();
+            reference.flush();
+        }
+    }
+
+    const auto& psi = blocked.data();
+    const auto& expected = reference.data();
+    for (size_t x = 0; x < (1ull << n); ++x)
+    {
+        // the blocked wave function might have moved the qubits to other positions
+        size_t y = 0;
+        for (unsigned i = 0; i < n; i++)
+            y |= ((x >> reference.get_qubit_position(qs[i])) & 1ull) << blocked.get_qubit_position(qs[i]);
+
+        INFO(std::string("amplitude mismatch at ") + std::to_string(x));
+        CHECK(std::abs(psi[y] - expected[x]) < 1e-10);
+    }
+}
+
+TEST_CASE("Hot qubits are moved to low positions", "[local_test]")
+{
+    Wavefunction<ComplexType> psi, reference;
+    psi.get_fused().setBlockQubits(3);
+    reference.get_fused().setBlockQubits(0);
+    const unsigned n = 8;
+    std::vector<logical_qubit_id> qs;
+    for (unsigned i = 0; i < n; i++)
+    {
+        qs.push_back(psi.allocate_qubit());
+        reference.allocate_qubit();
+    }
+    for (unsigned i = 0; i < n; i++)
+    {
+        psi.apply(Gates::H(qs[i]));
+        reference.apply(Gates::H(qs[i]));
+    }
+    psi.flush();
+    reference.flush();
+
+    // the most targeted qubits are in the highest positions
+    for (int i = 0; i < 40; i++)
+    {
+        for (unsigned q : {7, 6, 5})
+        {
+            psi.apply(Gates::R(Gates::PauliY, 0.1 * q, qs[q]));
+            reference.apply(Gates::R(Gates::PauliY, 0.1 * q, qs[q]));
+        }
+        psi.apply_controlled(qs[5], Gates::R(Gates::PauliX, 0.2, qs[7]));
+        reference.apply_controlled(qs[5], Gates::R(Gates::PauliX, 0.2, qs[7]));
+    }
+    psi.apply(Gates::T(qs[0]));
+    reference.apply(Gates::T(qs[0]));
+    psi.flush();
+    reference.flush();
+
+    CHECK(psi.get_qubit_position(qs[7]) < 3);
+    CHECK(psi.get_qubit_position(qs[6]) < 3);
+    CHECK(psi.get_qubit_position(qs[5]) < 3);
+
+    const auto& wfn = psi.data();
+    const auto& expected = reference.data();
+    for (size_t x = 0; x < (1ull << n); ++x)
+    {
+        size_t y = 0;
+        for (unsigned i = 0; i < n; i++)
+            y |= ((x >> reference.get_qubit_position(qs[i])) & 1ull) << psi.get_qubit_position(qs[i]);
+
+        INFO(std::string("amplitude mismatch at ") + std::to_string(x));
+        CHECK(std::abs(wfn[y] - expected[x]) < 1e-10);
+    }
+}
+
+TEST_CASE("Clustering of diagonal gates", "[local_test]")
+{
+    const TinyMatrix<ComplexType, 2> diag = Gates::T(0).matrix();
+    const TinyMatrix<ComplexType, 2> dense = Gates::H(0).matrix();
+    const int unlimited = 99;
+
+    DeferredGate d_n_1({} /*controls*/, 1 /*target*/, diag);
+    DeferredGate d_1_2({1} /*controls*/, 2 /*target*/, diag);
+    DeferredGate d_2_3({2} /*controls*/, 3 /*target*/, diag);
+    DeferredGate d_3_4({3} /*controls*/, 4 /*target*/, diag);
+    DeferredGate g_n_2({} /*controls*/, 2 /*target*/, dense);
+    DeferredGate g_1_2({1} /*controls*/, 2 /*target*/, dense);
+
+    REQUIRE(d_1_2.is_diagonal());
+    REQUIRE_FALSE(g_1_2.is_diagonal());
+    REQUIRE_FALSE(DeferredGate({}, 1, TinyMatrix<ComplexType, 2>()).is_diagonal());
+
+    SECTION("Diagonal clusters grow beyond the fuse span") // {CT(q1, q2), CT(q2, q3), CT(q3, q4), T(q1)}
+    {
+        std::vector<DeferredGate> gates{d_1_2, d_2_3, d_3_4, d_n_1};
+        auto cls = Cluster::make_clusters(1 /*cluster qubit width*/, unlimited /*gates per cluster*/, gates);
+        REQUIRE(cls.size() == 1);
+        CHECK(cls.front().is_diagonal());
+        CHECK(cls.front().get_qids() == std::vector<logical_qubit_id>{1, 2, 3, 4});
+        CHECK(cls.front().get_gates().size() == 4);
+    }
+
+    SECTION("Diagonal gates commute with each other") // {T(q1), H(q2), CT(q1, q2), T(q1)}
+    {
+        std::vector<DeferredGate> gates{d_n_1, g_n_2, d_1_2, d_n_1};
+        auto cls = Cluster::make_clusters(1 /*cluster qubit width*/, unlimited /*gates per cluster*/, gates);
+        REQUIRE(cls.size() == 3);
+
+        auto it = cls.begin();
+        CHECK(it->get_qids() == std::vector<logical_qubit_id>{1});
+        CHECK(it->get_gates().size() == 2);
+        CHECK(it->is_diagonal());
+
+        ++it;
+        CHECK(it->get_qids() == std::vector<logical_qubit_id>{2});
+        CHECK_FALSE(it->is_diagonal());
+
+        ++it;
+        CHECK(it->get_qids() == std::vector<logical_qubit_id>{1, 2});
+        CHECK(it->is_diagonal());
+    }
+
+    SECTION("Non-diagonal gate as barrier") // {T(q1), CH(q1, q2), T(q1)}
+    {
+        std::vector<DeferredGate> gates{d_n_1, g_1_2, d_n_1};
+        auto cls = Cluster::make_clusters(1 /*cluster qubit width*/, unlimited /*gates per cluster*/, gates);
+        REQUIRE(cls.size() == 3);
+    }
+}
+
+TEST_CASE("Fused diagonal gates", "[local_test]")
+{
+    SimulatorType sim;
+    const double theta = 0.7;
+    auto qs = sim.allocate(4);
+
+    for (auto q : qs)
+        sim.H(q);
+    sim.T(qs[0]);
+    sim.S(qs[1]);
+    sim.CZ(qs[1], qs[2]);
+    sim.Rz(theta, qs[3]);
+    sim.CZ({qs[0], qs[1], qs[2]}, qs[3]);
+    sim.AdjT(qs[2]);
+
+    const ComplexType* wfn = sim.data();
+    for (size_t x = 0; x < 16; ++x)
+    {
+        auto bit = [x](unsigned i) { return ((x >> i) & 1) == 1; };
+        ComplexType expected = 0.25;
+        if (bit(0)) expected *= std::polar(1., M_PI / 4);
+        if (bit(1)) expected *= ComplexType(0., 1.);
+        if (bit(1) && bit(2)) expected *= -1.;
+        expected *= std::polar(1., bit(3) ? theta / 2 : -theta / 2);
+        if (x == 15) expected *= -1.;
+        if (bit(2)) expected *= std::polar(1., -M_PI / 4);
+
+        INFO(std::string("amplitude mismatch at ") + std::to_string(x));
+        CHECK(std::abs(wfn[x] - expected) < 1e-12);
+    }
+
+    // diagonal gates must not be reordered with non-diagonal ones: H.T.H |0> = ((1+w)|0> + (1-w)|1>)/2
+    auto q = sim.allocate();
+    sim.H(q);
+    sim.T(q);
+    sim.H(q);
+    const ComplexType w = std::polar(1., M_PI / 4);
+    CHECK(std::abs(sim.data()[0] - 0.125 * (1. + w) * std::polar(1., -theta / 2)) < 1e-12);
+    CHECK(std::abs(sim.data()[16] - 0.125 * (1. - w) * std::polar(1., -theta / 2)) < 1e-12);
+}
+
+TEST_CASE("Clustering of permutation gates", "[local_test]")
+{
+    const TinyMatrix<ComplexType, 2> x = Gates::X(0).matrix();
+    const TinyMatrix<ComplexType, 2> y = Gates::Y(0).matrix();
+    const TinyMatrix<ComplexType, 2> dense = Gates::H(0).matrix();
+    const int unlimited = 99;
+
+    DeferredGate x_1_2({1} /*controls*/, 2 /*target*/, x);
+    DeferredGate x_2_3({2} /*controls*/, 3 /*target*/, x);
+    DeferredGate y_34_5({3, 4} /*controls*/, 5 /*target*/, y);
+    DeferredGate t_n_1({} /*controls*/, 1 /*target*/, Gates::T(0).matrix());
+    DeferredGate g_n_2({} /*controls*/, 2 /*target*/, dense);
+
+    REQUIRE(x_1_2.is_permutation());
+    REQUIRE(y_34_5.is_permutation());
+    REQUIRE(t_n_1.is_permutation());
+    REQUIRE_FALSE(x_1_2.is_diagonal());
+    REQUIRE_FALSE(g_n_2.is_permutation());
+
+    SECTION("Permutation clusters grow beyond the fuse span") // {CX(q1, q2), CX(q2, q3), CCY(q3, q4, q5), T(q1)}
+    {
+        std::vector<DeferredGate> gates{x_1_2, x_2_3, y_34_5, t_n_1};
+        auto cls = Cluster::make_clusters(1 /*cluster qubit width*/, unlimited /*gates per cluster*/, gates);
+        REQUIRE(cls.size() == 1);
+        CHECK(cls.front().is_permutation());
+        CHECK_FALSE(cls.front().is_diagonal());
+        CHECK(cls.front().get_qids() == std::vector<logical_qubit_id>{1, 2, 3, 4, 5});
+    }
+
+    SECTION("Permutation gates don't commute") // {CX(q1, q2), H(q2), CX(q2, q3)}
+    {
+        std::vector<DeferredGate> gates{x_1_2, g_n_2, x_2_3};
+        auto cls = Cluster::make_clusters(1 /*cluster qubit width*/, unlimited /*gates per cluster*/, gates);
+        REQUIRE(cls.size() == 3);
+        CHECK(cls.front().is_permutation());
+        CHECK_FALSE(std::next(cls.begin())->is_permutation());
+    }
+}
+
+TEST_CASE("Fused permutation gates", "[local_test]")
+{
+    SimulatorType sim;
+    auto qs = sim.allocate(5);
+
+    // some state with distinct amplitudes
+    for (unsigned i = 0; i < qs.size(); ++i)
+        sim.Ry(0.3 + 0.2 * i, qs[i]);
+    sim.T(qs[1]);
+    sim.CS(qs[0], qs[3]);
+
+    const std::vector<ComplexType> before(sim.data(), sim.data() + 32);
+
+    sim.X(qs[0]);
+    sim.CX(qs[0], qs[1]);
+    sim.CX({qs[1], qs[2]}, qs[4]);
+    sim.Y(qs[2]);
+    sim.CY({qs[0], qs[4]}, qs[3]);
+    sim.S(qs[1]);
+    // SWAP(q3, q1)
+    sim.CX(qs[3], qs[1]);
+    sim.CX(qs[1], qs[3]);
+    sim.CX(qs[3], qs[1]);
+
+    // reference: apply the same gates to a copy of the state, one index remap at a time
+    std::vector<ComplexType> expected = before;
+    auto apply = [&expected](std::vector<unsigned> const& ctrls, unsigned q, ComplexType m01, ComplexType m10) {
+        std::vector<ComplexType> next = expected;
+        for (size_t x = 0; x < expected.size(); ++x)
+        {
+            bool active = std::all_of(ctrls.begin(), ctrls.end(), [x](unsigned c) { return ((x >> c) & 1) == 1; });
+            if (!active) continue;
+            if (m01 == 0. && m10 == 0.) continue;
+            bool bit = ((x >> q) & 1) == 1;
+            next[x] = (bit ? m10 : m01) * expected[x ^ (1ull << q)];
+        }
+        expected = next;
+    };
+    auto phase = [&expected](unsigned q, ComplexType p) {
+        for (size_t x = 0; x < expected.size(); ++x)
+            if ((x >> q) & 1) expected[x] *= p;
+    };
+    const ComplexType i(0., 1.);
+    apply({}, 0, 1., 1.);
+    apply({0}, 1, 1., 1.);
+    apply({1, 2}, 4, 1., 1.);
+    apply({}, 2, -i, i);
+    apply({0, 4}, 3, -i, i);
+    phase(1, i);
+    apply({3}, 1, 1., 1.);
+    apply({1}, 3, 1., 1.);
+    apply({3}, 1, 1., 1.);
+
+    const ComplexType* wfn = sim.data();
+    for (size_t x = 0; x < 32; ++x)
+    {
+        INFO(std::string("amplitude mismatch at ") + std::to_string(x));
+        CHECK(std::abs(wfn[x] - expected[x]) < 1e-12);
+    }
+}
+
+TEST_CASE("Fused matrix of controlled gates", "[local_test]")
+{
+    // gates as (matrix, target, controls); the matrices don't need to be unitary
+    struct Gate
+    {
+        Fusion::Matrix m;
+        unsigned q;
+        std::vector<unsigned> cs;
+    };
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<double> dist(-1., 1.);
+    auto random_matrix = [&]() {
+        Fusion::Matrix m(2);
+        for (unsigned r = 0; r < 2; ++r)
+            for (unsigned c = 0; c < 2; ++c)
+                m[r][c] = ComplexType(dist(gen), dist(gen));
+        return m;
+    };
+    const std::vector<std::pair<unsigned, std::vector<unsigned>>> layout = {
+        {1, {}}, {4, {1}}, {6, {}}, {1, {6, 3}}, {4, {}}, {0, {3}}, {6, {0, 1}}};
+
+    for (size_t ngates = 1; ngates <= layout.size(); ++ngates)
+    {
+        std::vector<Gate> gates;
+        Fusion fusion;
+        for (size_t g = 0; g < ngates; ++g)
+        {
+            gates.push_back({random_matrix(), layout[g].first, layout[g].second});
+            fusion.insert(gates.back().m, {gates.back().q}, gates.back().cs);
+        }
+
+        std::vector<ComplexType> psi(1u << 7);
+        for (auto& amp : psi)
+            amp = ComplexType(dist(gen), dist(gen));
+
+        // reference: apply the gates one by one
+        std::vector<ComplexType> expected = psi;
+        for (auto const& gate : gates)
+        {
+            std::vector<ComplexType> next = expected;
+            for (size_t x = 0; x < expected.size(); ++x)
+            {
+                if (!std::all_of(gate.cs.begin(), gate.cs.end(), [x](unsigned c) { return ((x >> c) & 1) == 1; }))
+                    continue;
+                size_t b = (x >> gate.q) & 1;
+                next[x] = gate.m[b][0] * expected[x & ~(1ull << gate.q)] + gate.m[b][1] * expected[x | (1ull << gate.q)];
+            }
+            expected = next;
+        }
+
+        // apply the fused matrix, controlled by the remaining controls
+        Fusion::Matrix m;
+        Fusion::IndexVector qs, cs;
+        fusion.perform_fusion(m, qs, cs);
+        REQUIRE(m.size() == (1ull << qs.size()));
+        std::vector<ComplexType> actual = psi;
+        for (size_t x = 0; x < psi.size(); ++x)
+        {
+            if (!std::all_of(cs.begin(), cs.end(), [x](unsigned c) { return ((x >> c) & 1) == 1; }))
+                continue;
+            size_t row = 0, base = x;
+            for (size_t l = 0; l < qs.size(); ++l)
+            {
+                row |= ((x >> qs[l]) & 1) << l;
+                base &= ~(1ull << qs[l]);
+            }
+            ComplexType res = 0.;
+            for (size_t col = 0; col < m.size(); ++col)
+            {
+                size_t y = base;
+                for (size_t l = 0; l < qs.size(); ++l)
+                    y |= ((col >> l) & 1) << qs[l];
+                res += m[row][col] * psi[y];
+            }
+            actual[x] = res;
+        }
+
+        for (size_t x = 0; x < psi.size(); ++x)
+        {
+            INFO(std::to_string(ngates) + " gates, amplitude mismatch at " + std::to_string(x));
+            CHECK(std::abs(actual[x] - expected[x]) < 1e-12);
+        }
+    }
+}
+
+TEST_CASE("Fused cluster cache", "[local_test]")
+{
+    using Storage = WavefunctionStorage;
+    const unsigned n = 6;
+    Storage psi(1ull << n), expected(1ull << n);
+    std::mt19937 gen(3);
+    std::uniform_real_distribution<double> dist(-1., 1.);
+    for (size_t x = 0; x < psi.size(); ++x)
+        psi[x] = expected[x] = ComplexType(dist(gen), dist(gen));
+
+    Fused cached, uncached;
+    uncached.setFusionCacheSize(0);
+
+    // the same 3-qubit circuit on the qubits q, q + 1 and q + 2, controlled by c if c < n
+    auto circuit = [&](Fused& fused, Storage& wfn, unsigned q, unsigned c) {
+        std::vector<unsigned> cs;
+        if (c < n) cs.push_back(c);
+        fused.apply_controlled(wfn, Gates::H(0).matrix(), cs, q);
+        fused.apply_controlled(wfn, Gates::R(Gates::PauliY, 0.3, 0).matrix(), cs, q + 1);
+        cs.push_back(q);
+        fused.apply_controlled(wfn, Gates::X(0).matrix(), cs, q + 2);
+        cs.pop_back();
+        fused.apply_controlled(wfn, Gates::T(0).matrix(), cs, q + 1);
+        fused.apply_controlled(wfn, Gates::R(Gates::PauliX, 0.7, 0).matrix(), cs, q + 2);
+        fused.flush(wfn);
+    };
+
+    const std::vector<std::pair<unsigned, unsigned>> runs = {{0, n}, {0, n}, {3, n}, {1, 5}, {2, 0}, {0, n}, {3, 1}};
+    for (auto const& run : runs)
+    {
+        circuit(cached, psi, run.first, run.second);
+        circuit(uncached, expected, run.first, run.second);
+    }
+    CHECK(cached.fusionCacheStats().misses == 1);
+    CHECK(cached.fusionCacheStats().hits == runs.size() - 1);
+    CHECK(uncached.fusionCacheStats().hits + uncached.fusionCacheStats().misses == 0);
+
+    for (size_t x = 0; x < psi.size(); ++x)
+    {
+        INFO(std::string("amplitude mismatch at ") + std::to_string(x));
+        CHECK(std::abs(psi[x] - expected[x]) < 1e-12);
+    }
+
+    // a different circuit misses, and evicts the least recently used cluster from a cache of size 1
+    cached.setFusionCacheSize(1);
+    cached.resetFusionCacheStats();
+    cached.apply(psi, Gates::H(0).matrix(), 0);
+    cached.apply(psi, Gates::H(0).matrix(), 1);
+    cached.apply(psi, Gates::H(0).matrix(), 2);
+    cached.flush(psi);
+    circuit(cached, psi, 0, n);
+    CHECK(cached.fusionCacheStats().misses == 2);
+    CHECK(cached.fusionCacheStats().hits == 0);
+}
+
+TEST_CASE("Fused clusters applied by the thread pool", "[local_test]")
+{
+    using Storage = WavefunctionStorage;
+    const unsigned n = 9;
+    Storage psi(1ull << n), expected(1ull << n);
+    std::mt19937 gen(5);
+    std::uniform_real_distribution<double> dist(-1., 1.);
+    for (size_t x = 0; x < psi.size(); ++x)
+        psi[x] = expected[x] = ComplexType(dist(gen), dist(gen));
+
+    Fused threaded;
+    threaded.setThreads(3);
+    threaded.setThreadPool(std::make_shared<ThreadPool>(3));
+    REQUIRE(threaded.threads() == 3);
+
+    // dense, diagonal and permutation clusters on the highest and lowest qubits, with controls on any of them
+    const std::vector<std::vector<unsigned>> targets = {{8}, {0}, {7, 8}, {0, 8}, {3, 4, 5}, {0, 1, 2}, {6, 7, 8}};
+    const std::vector<std::vector<unsigned>> controls = {{}, {8}, {4}, {0, 6}, {5, 7}};
+    for (auto const& ts : targets)
+    {
+        for (auto const& cs : controls)
+        {
+            if (std::any_of(cs.begin(), cs.end(), [&ts](unsigned c) { return std::count(ts.begin(), ts.end(), c); }))
+                continue;
+            for (int kind = 0; kind < 3; ++kind)
+            {
+                Fused fuser;
+                for (unsigned t : ts)
+                {
+                    if (kind == 0) fuser.apply_controlled(psi, Gates::R(Gates::PauliY, 0.3 + t, 0).matrix(), cs, t);
+                    if (kind == 1) fuser.apply_controlled(psi, Gates::T(0).matrix(), cs, t);
+                    if (kind == 2) fuser.apply_controlled(psi, Gates::Y(0).matrix(), cs, t);
+                }
+                auto fc = fuser.take();
+                threaded.apply_parallel(psi, fc);
+                Fused::apply(expected, fc);
+            }
+        }
+    }
+
+    for (size_t x = 0; x < psi.size(); ++x)
+    {
+        INFO(std::string("amplitude mismatch at ") + std::to_string(x));
+        CHECK(std::abs(psi[x] - expected[x]) < 1e-12);
+    }
+}
+
+TEST_CASE("Wavefunctions with their own thread budgets", "[local_test]")
+{
+    // The same circuit with four threads each, once block by block, and with a single thread.
+    Wavefunction<ComplexType> pooled, blocked, reference;
+    pooled.get_fused().setThreads(4);
+    pooled.get_fused().setBlockQubits(0);
+    blocked.get_fused().setThreads(4);
+    blocked.get_fused().setBlockQubits(3);
+    reference.get_fused().setThreads(1);
+    reference.get_fused().setBlockQubits(0);
+    const unsigned n = 10;
+    std::vector<logical_qubit_id> qs;
+    for (unsigned i = 0; i < n; i++)
+    {
+        qs.push_back(pooled.allocate_qubit());
+        blocked.allocate_qubit();
+        reference.allocate_qubit();
+    }
+
+    std::mt19937 rng(11);
+    for (int i = 0; i < 300; i++)
+    {
+        const unsigned a = rng() % n;
+        const unsigned b = (a + 1 + rng() % (n - 1)) % n;
+        const double theta = 0.1 * (rng() % 31);
+        for (auto* psi : {&pooled, &blocked, &reference})
+        {
+            switch (i % 4)
+            {
+            case 0:
+                psi->apply(Gates::H(qs[a]));
+                break;
+            case 1:
+                psi->apply(Gates::T(qs[a]));
+                break;
+            case 2:
+                psi->apply_controlled(qs[a], Gates::X(qs[b]));
+                break;
+            case 3:
+                psi->apply_controlled(qs[a], Gates::R(Gates::PauliX, theta, qs[b]));
+                break;
+            }
+            if (i % 50 == 49) psi->flush();
+        }
+    }
+    for (auto* psi : {&pooled, &blocked, &reference})
+        psi->flush();
+    CHECK(pooled.get_fused().threads() == 4);
+    CHECK(reference.get_fused().threads() == 1);
+
+    for (size_t x = 0; x < (1ull << n); ++x)
+    {
+        // the blocked wave function might have moved the qubits to other positions
+        size_t y = 0;
+        for (unsigned i = 0; i < n; i++)
+            y |= ((x >> reference.get_qubit_position(qs[i])) & 1ull) << blocked.get_qubit_position(qs[i]);
+
+        INFO(std::string("amplitude mismatch at ") + std::to_string(x));
+        CHECK(std::abs(pooled.data()[x] - reference.data()[x]) < 1e-10);
+        CHECK(std::abs(blocked.data()[y] - reference.data()[x]) < 1e-10);
+    }
+}
+
+TEST_CASE("Gates with many controls", "[local_test]")
+{
+    // The dense, the permutation and the diagonal kernels only visit the amplitudes with all controls set.
+    const unsigned n = 9;
+    Wavefunction<ComplexType> psi;
+    std::vector<logical_qubit_id> qs;
+    for (unsigned i = 0; i < n; i++)
+        qs.push_back(psi.allocate_qubit());
+    std::mt19937 rng(3);
+    for (int i = 0; i < 40; i++)
+    {
+        psi.apply(Gates::H(qs[rng() % n]));
+        psi.apply(Gates::T(qs[rng() % n]));
+        psi.apply_controlled(qs[rng() % 4], Gates::X(qs[4 + rng() % 5]));
+    }
+
+    const std::vector<logical_qubit_id> cs = {qs[0], qs[2], qs[3], qs[5], qs[8]};
+    const logical_qubit_id target = qs[6];
+    for (int g = 0; g < 3; g++)
+    {
+        const TinyMatrix<ComplexType, 2> m =
+            g == 0 ? Gates::X(target).matrix() : g == 1 ? Gates::H(target).matrix() : Gates::T(target).matrix();
+        std::vector<ComplexType> expected(psi.data().begin(), psi.data().end());
+        const std::size_t cmask = kernels::make_mask(psi.get_qubit_positions(cs));
+        const std::size_t t = 1ull << psi.get_qubit_position(target);
+        for (std::size_t x = 0; x < expected.size(); ++x)
+        {
+            if ((x & cmask) != cmask || (x & t) != 0) continue;
+            const ComplexType a0 = expected[x];
+            const ComplexType a1 = expected[x | t];
+            expected[x] = m(0, 0) * a0 + m(0, 1) * a1;
+            expected[x | t] = m(1, 0) * a0 + m(1, 1) * a1;
+        }
+
+        switch (g)
+        {
+        case 0:
+            psi.apply_controlled(cs, Gates::X(target));
+            break;
+        case 1:
+            psi.apply_controlled(cs, Gates::H(target));
+            break;
+        case 2:
+            psi.apply_controlled(cs, Gates::T(target));
+            break;
+        }
+        psi.flush();
+        for (std::size_t x = 0; x < expected.size(); ++x)
+        {
+            INFO(std::string("amplitude mismatch at ") + std::to_string(x));
+            CHECK(std::abs(psi.data()[x] - expected[x]) < 1e-10);
+        }
+    }
+}
+
+TEST_CASE("Batch of states with the same gates", "[local_test]")
+{
+    // A batch of four states against four wave functions that get the same gates, except for the rotation angles.
+    const std::size_t batch = 4;
+    const unsigned n = 5;
+    Wavefunction<ComplexType> batched;
+    batched.set_batch_size(batch);
+    std::vector<Wavefunction<ComplexType>> singles(batch);
+    std::vector<logical_qubit_id> qs;
+    for (unsigned i = 0; i < n; i++)
+    {
+        qs.push_back(batched.allocate_qubit());
+        for (auto& psi : singles)
+            psi.allocate_qubit();
+    }
+    REQUIRE(batched.num_qubits() == n);
+
+    std::mt19937 rng(5);
+    for (int i = 0; i < 60; i++)
+    {
+        const unsigned a = rng() % n;
+        const unsigned b = (a + 1 + rng() % (n - 1)) % n;
+        std::vector<double> phis;
+        for (std::size_t k = 0; k < batch; k++)
+            phis.push_back(0.1 * (rng() % 31));
+        std::vector<TinyMatrix<ComplexType, 2>> mats;
+        for (double phi : phis)
+            mats.push_back(Gates::R(Gates::PauliY, phi, qs[b]).matrix());
+
+        switch (i % 4)
+        {
+        case 0:
+            batched.apply(Gates::H(qs[a]));
+            for (auto& psi : singles)
+                psi.apply(Gates::H(qs[a]));
+            break;
+        case 1:
+            batched.apply_controlled(qs[a], Gates::X(qs[b]));
+            for (auto& psi : singles)
+                psi.apply_controlled(qs[a], Gates::X(qs[b]));
+            break;
+        case 2:
+            batched.apply_batched({qs[a]}, qs[b], mats);
+            for (std::size_t k = 0; k < batch; k++)
+                singles[k].apply_controlled(qs[a], Gates::R(Gates::PauliY, phis[k], qs[b]));
+            break;
+        case 3:
+            batched.apply_batched({}, qs[b], mats);
+            for (std::size_t k = 0; k < batch; k++)
+                singles[k].apply(Gates::R(Gates::PauliY, phis[k], qs[b]));
+            break;
+        }
+    }
+    CHECK(batched.gate_count() == batch * 60);
+
+    for (std::size_t k = 0; k < batch; k++)
+    {
+        for (size_t x = 0; x < (1ull << n); ++x)
+        {
+            INFO(std::string("amplitude mismatch at ") + std::to_string(x) + " of state " + std::to_string(k));
+            CHECK(std::abs(batched.data()[x * batch + k] - singles[k].data()[x]) < 1e-10);
+        }
+    }
+    std::vector<double> ps = batched.batch_probabilities(qs[2]);
+    for (std::size_t k = 0; k < batch; k++)
+        CHECK(std::abs(ps[k] - singles[k].probability(qs[2])) < 1e-10);
+
+    // each state is collapsed on its own, and the qubits can be released once all of them are reset
+    for (logical_qubit_id q : qs)
+    {
+        std::vector<bool> results = batched.batch_measure(q, true);
+        REQUIRE(results.size() == batch);
+        CHECK(batched.classicalvalue(q) == 0);
+    }
+    for (std::size_t k = 0; k < batch; k++)
+        CHECK(std::abs(std::abs(batched.data()[k]) - 1.) < 1e-10);
+    batched.release(qs);
+    CHECK(batched.num_qubits() == 0);
+    CHECK(batched.data().size() == batch);
+}
+
+TEST_CASE("Fused parameters from the tuning cache", "[local_test]")
+{
+    const std::string path = "local_test_autotune.cache";
+    std::remove(path.c_str());
+    const std::string key = tuning_key(Fused::kernelName());
+    WavefunctionStorage small(1ull << 10), large(1ull << 11);
+
+    // configurations in the cache replace the heuristics, larger states use the largest bucket
+    TunedConfig stored;
+    stored.span = 6;
+    stored.depth = 50;
+    stored.threads = 1;
+    TuningCache cache(path);
+    REQUIRE(cache.store(key, 10, stored));
+    REQUIRE(cache.store(key, Fused::MAX_TUNED_QUBITS, stored));
+
+    // simulators read the tuned configurations by default, but don't benchmark
+    Fused fused;
+    CHECK(fused.autotune() == Autotune::Cached);
+    fused.setAutotune(Autotune::Cached, path);
+    fused.shouldFlush(small);
+    CHECK(fused.maxSpan() == 6);
+    CHECK(fused.maxDepth() == 50);
+
+    // not tuned yet
+    fused.shouldFlush(large);
+    CHECK(fused.maxSpan() == 2);
+    CHECK(fused.maxDepth() == 999);
+
+    fused.setAutotune(Autotune::Off, path);
+    fused.shouldFlush(small);
+    CHECK(fused.maxSpan() == 2);
+
+    // tunes the missing size and stores it for the next simulator
+    fused.setAutotune(Autotune::On, path);
+    fused.shouldFlush(large);
+    TunedConfig tuned;
+    REQUIRE(cache.find(key, 11, tuned));
+    CHECK(tuned.span >= 1);
+    CHECK(tuned.span <= 7);
+    CHECK(tuned.threads >= 1);
+    CHECK(fused.maxSpan() == tuned.span);
+
+    Fused next;
+    next.setAutotune(Autotune::Cached, path);
+    next.shouldFlush(large);
+    CHECK(next.maxSpan() == tuned.span);
+
+    std::remove(path.c_str());
+}
+
 TEST_CASE("isclassical", "[local_test]")
 {
     SimulatorType sim;
@@ -661,6 +1884,255 @@ TEST_CASE("Inject state on two qubits out of three", "[local_test]")
     CHECK((sim.isclassical(y) && !sim.M(y)));
 }
 
+TEST_CASE("Sweeps of cluster schedulers on the advantage circuit", "[skip]") // local micro_benchmark
+{
+    std::ifstream log("advantage_44_4.log");
+    if (!log.is_open()) log.open("../../advantage_44_4.log");
+    REQUIRE(log.is_open());
+
+    // Read the "=== Original:" section of the log, which lists one gate per line, e.g. " 16: CZ[2, 3]".
+    std::vector<DeferredGate> gates;
+    std::regex reGate("^\\s*\\d+:\\s+(\\w+)\\[(.*)\\].*[\r]?");
+    std::smatch sm;
+    std::string line;
+    std::getline(log, line);
+    while (std::getline(log, line) && std::regex_match(line, sm, reGate))
+    {
+        std::vector<logical_qubit_id> qs;
+        std::stringstream nums(sm[2]);
+        for (std::string num; std::getline(nums, num, ',');)
+            qs.push_back(static_cast<logical_qubit_id>(std::stoi(num)));
+        const logical_qubit_id target = qs.back();
+        qs.pop_back();
+        gates.emplace_back(qs, target, sm[1] == "H" ? Gates::H(0).matrix() : Gates::Z(0).matrix());
+    }
+    REQUIRE(gates.size() > 0);
+
+    auto cost = [](const std::list<Cluster>& cls) {
+        double c = 0.0;
+        for (const Cluster& cl : cls)
+            c += Cluster::sweep_cost(cl.get_qids().size(), cl.is_permutation());
+        return c;
+    };
+
+    std::cout << "Sweeps for " << gates.size() << " gates (greedy vs lookahead):" << std::endl;
+    for (unsigned span = 1; span <= 7; span++)
+    {
+        auto greedy = Cluster::make_clusters(span, 999, gates);
+        auto lookahead = Cluster::schedule_clusters(span, 999, gates);
+        std::cout << "  span " << span << ":\t" << greedy.size() << " (cost " << cost(greedy) << ")\tvs\t"
+                  << lookahead.size() << " (cost " << cost(lookahead) << ")" << std::endl;
+        CHECK(cost(lookahead) <= cost(greedy));
+    }
+}
+
+TEST_CASE("Perf of the lock of single-qubit gates", "[skip]") // local micro_benchmark
+{
+    using namespace std::chrono;
+
+    // Latency of queueing a single-qubit gate that fuses with the pending ones, with and without the lock.
+    for (bool single : {false, true})
+    {
+        SimulatorType sim;
+        sim.set_single_owner(single);
+        auto qs = sim.allocate(4);
+        const int ngates = 10000000;
+
+        auto start = high_resolution_clock::now();
+        for (int i = 0; i < ngates; ++i)
+            sim.T(qs[i & 3]);
+        sim.flush();
+        const double ns = duration_cast<nanoseconds>(high_resolution_clock::now() - start).count();
+        std::cout << (single ? "single owner: " : "thread-safe:  ") << ns / ngates << " ns/gate" << std::endl;
+    }
+}
+
+TEST_CASE("Perf of queueing gates", "[skip]") // local micro_benchmark
+{
+    using namespace std::chrono;
+
+    // Circuits dominated by single-qubit gates on small states, where the cost per gate is the bookkeeping of the
+    // gate queue rather than the kernels.
+    for (unsigned n : {4u, 8u, 12u})
+    {
+        SimulatorType sim;
+        auto qs = sim.allocate(n);
+        std::mt19937 rng(11);
+        const int ngates = 1000000;
+        sim.M(qs[0]);
+
+        auto start = high_resolution_clock::now();
+        for (int i = 0; i < ngates; ++i)
+        {
+            const unsigned a = rng() % n;
+            switch (rng() % 8)
+            {
+            case 0:
+                sim.H(qs[a]);
+                break;
+            case 1:
+                sim.T(qs[a]);
+                break;
+            case 2:
+                sim.Rz(0.1 * (rng() % 31), qs[a]);
+                break;
+            case 3:
+                sim.Ry(0.1 * (rng() % 31), qs[a]);
+                break;
+            case 4:
+                sim.S(qs[a]);
+                break;
+            case 5:
+                sim.X(qs[a]);
+                break;
+            case 6:
+                sim.CX(qs[a], qs[(a + 1) % n]);
+                break;
+            case 7:
+                sim.CRz(0.1 * (rng() % 31), std::vector<logical_qubit_id>{qs[a], qs[(a + 2) % n]}, qs[(a + 1) % n]);
+                break;
+            }
+        }
+        sim.M(qs[0]);
+        const double seconds = duration_cast<duration<double>>(high_resolution_clock::now() - start).count();
+        std::cout << n << " qubits:\t" << ngates / seconds << " gates/s" << std::endl;
+    }
+}
+
+TEST_CASE("Perf of gates with many controls", "[skip]") // local micro_benchmark
+{
+    using namespace std::chrono;
+
+    // The kernels visit only the amplitudes with all controls set, so each control should about halve the time.
+    const unsigned n = 22;
+    Wavefunction<ComplexType> psi;
+    std::vector<logical_qubit_id> qs;
+    for (unsigned i = 0; i < n; i++)
+        qs.push_back(psi.allocate_qubit());
+    for (logical_qubit_id q : qs)
+        psi.apply(Gates::H(q));
+    psi.flush();
+
+    const int reps = 20;
+    for (unsigned nc : {0u, 1u, 3u, 5u, 7u})
+    {
+        std::vector<logical_qubit_id> cs;
+        for (unsigned c = 0; c < nc; c++)
+            cs.push_back(qs[3 * c + 1]);
+        const logical_qubit_id target = qs[n - 1];
+
+        std::cout << nc << " controls:";
+        for (int g = 0; g < 3; g++)
+        {
+            auto start = high_resolution_clock::now();
+            for (int i = 0; i < reps; ++i)
+            {
+                if (g == 0)
+                    psi.apply_controlled(cs, Gates::X(target));
+                else if (g == 1)
+                    psi.apply_controlled(cs, Gates::H(target));
+                else
+                    psi.apply_controlled(cs, Gates::T(target));
+                psi.flush();
+            }
+            const double seconds = duration_cast<duration<double>>(high_resolution_clock::now() - start).count();
+            std::cout << "\t" << (g == 0 ? "X " : g == 1 ? "H " : "T ") << seconds / reps * 1e3 << " ms";
+        }
+        std::cout << std::endl;
+    }
+}
+
+TEST_CASE("Perf of shard-sized blocks", "[skip]") // local micro_benchmark
+{
+    using namespace std::chrono;
+
+    // maxlocal is accepted but unused: a state above maxlocal qubits sharded across processes on one host would still
+    // apply each cluster to blocks of 2^maxlocal amplitudes, only in other processes over a shared mapping. At best
+    // that is as fast as the in-process flush with shard-sized blocks, which QDK_SIM_BLOCKQUBITS=maxlocal already
+    // gives, so this compares that bound to the default blocks and to the unblocked flush.
+    const unsigned n = 22;
+    const int maxlocal = 18;
+    for (int block_qubits : {0, -1, maxlocal})
+    {
+        Wavefunction<ComplexType> psi;
+        if (block_qubits >= 0) psi.get_fused().setBlockQubits(block_qubits);
+        std::vector<logical_qubit_id> qs;
+        for (unsigned i = 0; i < n; i++)
+            qs.push_back(psi.allocate_qubit());
+        psi.flush();
+
+        std::mt19937 rng(7);
+        auto start = high_resolution_clock::now();
+        for (int i = 0; i < 500; i++)
+        {
+            const unsigned a = rng() % n;
+            const unsigned b = (a + 1 + rng() % (n - 1)) % n;
+            const double theta = 0.1 * (rng() % 31);
+            switch (rng() % 4)
+            {
+            case 0:
+                psi.apply(Gates::H(qs[a]));
+                break;
+            case 1:
+                psi.apply(Gates::R(Gates::PauliY, theta, qs[a]));
+                break;
+            case 2:
+                psi.apply_controlled(qs[a], Gates::X(qs[b]));
+                break;
+            case 3:
+                psi.apply_controlled(qs[a], Gates::R(Gates::PauliX, theta, qs[b]));
+                break;
+            }
+        }
+        psi.flush();
+        const double seconds = duration_cast<duration<double>>(high_resolution_clock::now() - start).count();
+        std::cout << (block_qubits == 0 ? "unblocked:\t" : block_qubits < 0 ? "default blocks:\t" : "shard-sized:\t")
+                  << seconds << " s" << std::endl;
+    }
+}
+
+TEST_CASE("Perf of fusing gates", "[skip]") // local micro_benchmark
+{
+    using namespace std::chrono;
+
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<double> dist(-1., 1.);
+    for (unsigned span = 1; span <= 7; ++span)
+    {
+        // a layer of single-qubit gates followed by a ladder of controlled gates, repeated, on span qubits
+        std::vector<std::pair<Fusion::Matrix, std::pair<unsigned, unsigned>>> gates;
+        for (unsigned rep = 0; rep < 3; ++rep)
+            for (unsigned q = 0; q < span; ++q)
+            {
+                Fusion::Matrix m(2);
+                for (unsigned r = 0; r < 2; ++r)
+                    for (unsigned c = 0; c < 2; ++c)
+                        m[r][c] = ComplexType(dist(gen), dist(gen));
+                gates.push_back({m, {q, (q + 1) % span}});
+            }
+
+        const int reps = 20000 >> span;
+        Fusion::Matrix m;
+        auto start = high_resolution_clock::now();
+        for (int i = 0; i < reps; ++i)
+        {
+            Fusion fusion;
+            for (auto const& gate : gates)
+            {
+                if (span > 1 && gate.second.first % 2)
+                    fusion.insert(gate.first, {gate.second.first}, {gate.second.second});
+                else
+                    fusion.insert(gate.first, {gate.second.first});
+            }
+            Fusion::IndexVector qs, cs;
+            fusion.perform_fusion(m, qs, cs);
+        }
+        std::cout << "span " << span << ", " << gates.size() << " gates:\t";
+        std::cout << duration_cast<nanoseconds>(high_resolution_clock::now() - start).count() / reps / 1000.;
+        std::cout << " us per fused matrix" << std::endl;
+    }
+}
+
 TEST_CASE("Perf of injecting equal superposition state", "[skip]") // local micro_benchmark
 {
     using namespace std::chrono;
@@ -182,10 +182,12 @@ extern "C"
     QirArray* __quantum__rt__qubit_allocate_array(int64_t count)
     {
         QirArray* array = __quantum__rt__array_create_1d(sizeof(intptr_t), count);
+        std::vector<unsigned> qubits(static_cast<size_t>(count));
+        if (count > 0) allocateMany(SimId(), static_cast<unsigned>(count), qubits.data());
         for (auto i = 0; i < count; i++)
         {
             *reinterpret_cast<QUBIT**>(__quantum__rt__array_get_element_ptr_1d(array, i)) =
-                __quantum__rt__qubit_allocate();
+                reinterpret_cast<QUBIT*>(qubits[i]);
         }
         return array;
     }
@@ -198,10 +200,13 @@ extern "C"
     void __quantum__rt__qubit_release_array(QirArray* array)
     {
         auto count = __quantum__rt__array_get_size_1d(array);
+        std::vector<unsigned> qubits(static_cast<size_t>(count));
         for (auto i = 0; i < count; i++)
         {
-            __quantum__rt__qubit_release(*reinterpret_cast<QUBIT**>(__quantum__rt__array_get_element_ptr_1d(array, i)));
+            qubits[i] = static_cast<unsigned>(reinterpret_cast<QubitIdType>(
+                *reinterpret_cast<QUBIT**>(__quantum__rt__array_get_element_ptr_1d(array, i))));
         }
+        if (count > 0) releaseMany(SimId(), static_cast<unsigned>(count), qubits.data());
         __quantum__rt__array_update_reference_count(array, -1);
     }
 
@@ -317,6 +322,29 @@ extern "C"
                                                                          : __quantum__rt__result_get_zero();
     }
 
+    QirArray* __quantum__qis__sampleshots__body(QirArray* qubits, int64_t nshots)
+    {
+        if (nshots < 0)
+        {
+            __quantum__rt__fail(
+                __quantum__rt__string_create("The number of shots for SampleShots() must not be negative."));
+        }
+
+        auto count = __quantum__rt__array_get_size_1d(qubits);
+        std::vector<unsigned> ids =
+            GetQubitIds(count, reinterpret_cast<QubitIdType*>(__quantum__rt__array_get_element_ptr_1d(qubits, 0)));
+        std::vector<std::uint64_t> shots(static_cast<size_t>(nshots));
+        SampleShots(SimId(), static_cast<unsigned>(count), ids.data(), shots.size(), shots.data());
+
+        QirArray* array = __quantum__rt__array_create_1d(sizeof(int64_t), nshots);
+        for (int64_t i = 0; i < nshots; i++)
+        {
+            *reinterpret_cast<int64_t*>(__quantum__rt__array_get_element_ptr_1d(array, i)) =
+                static_cast<int64_t>(shots[i]);
+        }
+        return array;
+    }
+
     void __quantum__qis__r__body(PauliId axis, double angle, QUBIT* qubit)
     {
         R(SimId(), static_cast<unsigned>(axis), angle, reinterpret_cast<QubitIdType>(qubit));
@@ -103,6 +103,10 @@ extern "C"
     QIR_EXPORT_API void __quantum__qis__z__body(QUBIT*);                         // NOLINT
     QIR_EXPORT_API void __quantum__qis__z__ctl(QirArray*, QUBIT*);               // NOLINT
 
+    // Measurement-only tails of programs: nshots outcomes of measuring all the qubits, drawn from the current state
+    // without changing it, as an array of Int with the result of qubits[k] in bit k.
+    QIR_EXPORT_API QirArray* __quantum__qis__sampleshots__body(QirArray* qubits, int64_t nshots); // NOLINT
+
     // Q# Dump:
     // Note: The param `location` must be `const void*`,
     // but it is called from .ll, where `const void*` is not supported.
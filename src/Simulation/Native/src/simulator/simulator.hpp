@@ -53,13 +53,20 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
         }
 
         recursive_lock_type l(getmutex());
-        changebasis(bs, qs, true);
-        double p = psi.jointprobability(qs);
-        changebasis(bs, qs, false);
-        return p;
+        return 0.5 * (1. - psi.pauliexpectation(bs, qs));
     }
 
-    bool InjectState(const std::vector<logical_qubit_id>& qubits, const std::vector<ComplexType>& amplitudes)
+    double Expectation(
+        std::vector<std::vector<Gates::Basis>> const& terms,
+        std::vector<double> const& coefficients,
+        std::vector<logical_qubit_id> const& qs)
+    {
+        recursive_lock_type l(getmutex());
+        std::vector<double> values = psi.pauliexpectations(terms, qs);
+        return std::inner_product(values.begin(), values.end(), coefficients.begin(), 0.);
+    }
+
+    bool InjectState(const std::vector<logical_qubit_id>& qubits, const std::vector<std::complex<double>>& amplitudes)
     {
         recursive_lock_type l(getmutex());
         return psi.inject_state(qubits, amplitudes);
@@ -107,22 +114,34 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
     bool release(logical_qubit_id q)
     {
         recursive_lock_type l(getmutex());
-        flush();
-        bool allok = isclassical(q);
-        if (allok)
-            allok = (psi.getvalue(q) == false);
-        else
-            M(q);
-        psi.release(q);
-        return allok;
+        return release(std::vector<logical_qubit_id>(1, q));
     }
 
     bool release(std::vector<logical_qubit_id> const& qs)
     {
         recursive_lock_type l(getmutex());
+        flush();
         bool allok = true;
-        for (auto q : qs)
-            allok = release(q) && allok;
+        // one probe for all of the qubits, only the ones in a superposition are measured
+        std::vector<unsigned> probed = psi.classicalvalues(qs);
+        std::vector<bool> vals;
+        for (std::size_t i = 0; i < qs.size(); ++i)
+        {
+            if (probed[i] == 2)
+            {
+                // the states of a batch may disagree, the qubit is reset in each of them instead
+                if (psi.batch_size() > 1)
+                    psi.batch_measure(qs[i], true);
+                vals.push_back(psi.batch_size() > 1 ? false : M(qs[i]));
+                allok = false;
+            }
+            else
+            {
+                vals.push_back(probed[i] == 1);
+                allok = allok && probed[i] == 0;
+            }
+        }
+        psi.release(qs, vals);
         return allok;
     }
 
@@ -242,25 +261,30 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
         return psi.measure(q);
     }
 
+    // measures a qubit that is about to be released and releases it, which halves the state in the same pass
+    bool MRelease(logical_qubit_id q)
+    {
+        recursive_lock_type l(getmutex());
+        return psi.measure(q, true);
+    }
+
     std::vector<bool> MultiM(std::vector<logical_qubit_id> const& qs)
     {
-        // ***TODO*** optimized implementation
         recursive_lock_type l(getmutex());
-        std::vector<bool> res;
-        for (auto q : qs)
-            res.push_back(psi.measure(q));
-        return res;
+        return psi.multimeasure(qs);
+    }
+
+    std::vector<std::uint64_t> SampleShots(std::vector<logical_qubit_id> const& qs, std::size_t nshots)
+    {
+        recursive_lock_type l(getmutex());
+        return psi.sampleshots(qs, nshots);
     }
 
     bool Measure(std::vector<Gates::Basis> bs, std::vector<logical_qubit_id> qs)
     {
         recursive_lock_type l(getmutex());
         removeIdentities(bs, qs);
-        // ***TODO*** optimized kernels
-        changebasis(bs, qs, true);
-        bool res = psi.jointmeasure(qs);
-        changebasis(bs, qs, false);
-        return res;
+        return psi.jointmeasure(bs, qs);
     }
 
     void seed(unsigned s)
@@ -268,6 +292,44 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
         recursive_lock_type l(getmutex());
         psi.seed(s);
     }
+    void set_threads(unsigned threads)
+    {
+        recursive_lock_type l(getmutex());
+        psi.get_fused().setThreads(threads);
+    }
+    void rebind_threads()
+    {
+        recursive_lock_type l(getmutex());
+        psi.get_fused().rebindThreadPool();
+    }
+    std::uint64_t gate_count() const
+    {
+        recursive_lock_type l(getmutex());
+        return psi.gate_count();
+    }
+    void set_batch_size(std::size_t batch)
+    {
+        recursive_lock_type l(getmutex());
+        psi.set_batch_size(batch);
+    }
+    std::size_t batch_size() const
+    {
+        recursive_lock_type l(getmutex());
+        return psi.batch_size();
+    }
+    void BatchR(Gates::Basis b, std::vector<double> const& phis, std::vector<logical_qubit_id> const& c, logical_qubit_id q)
+    {
+        recursive_lock_type l(getmutex());
+        std::vector<TinyMatrix<ComplexType, 2>> mats;
+        for (double phi : phis)
+            mats.push_back(Gates::R(b, phi, q).matrix());
+        psi.apply_batched(c, q, mats);
+    }
+    std::vector<bool> BatchM(logical_qubit_id q)
+    {
+        recursive_lock_type l(getmutex());
+        return psi.batch_measure(q);
+    }
     void reset()
     {
         recursive_lock_type l(getmutex());
@@ -335,7 +397,7 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
 
         WavefunctionStorage wfn(1ull << qs.size());
 
-        if (subsytemwavefunction(qs, wfn, 1e-10))
+        if (subsytemwavefunction(qs, wfn, dump_tolerance))
         {
             for (std::size_t i = 0; i < wfn.size(); i++)
             {
@@ -356,7 +418,7 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
         WavefunctionStorage wfn(1ull << qs.size());
         auto nq = num_qubits();
         std::string label_str(nq, '0');
-        if (subsytemwavefunction(qs, wfn, 1e-10))
+        if (subsytemwavefunction(qs, wfn, dump_tolerance))
         {
             for (std::size_t i = 0; i < wfn.size(); i++)
             {
@@ -399,26 +461,20 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
         return psi.subsytemwavefunction(qs, qubitswfn, tolerance);
     }
 
-  private:
-    void changebasis(Gates::Basis b, logical_qubit_id q, bool back)
+    bool subsytemwavefunction(
+        std::vector<logical_qubit_id> const& qs,
+        std::vector<std::complex<double>>& qubitswfn,
+        double tolerance) override
     {
-        if (b == Gates::PauliX)
-            H(q);
-        else if (b == Gates::PauliY)
-        {
-            if (back)
-                AdjHY(q);
-            else
-                HY(q);
-        }
+        WavefunctionStorage wfn(qubitswfn.size());
+        if (!subsytemwavefunction(qs, wfn, tolerance)) return false;
+        std::copy(wfn.begin(), wfn.end(), qubitswfn.begin());
+        return true;
     }
 
-    void changebasis(std::vector<Gates::Basis> const& bs, std::vector<logical_qubit_id> const& qs, bool back)
-    {
-        assert(bs.size() == qs.size());
-        for (std::size_t i = 0; i < bs.size(); ++i)
-            changebasis(bs[i], qs[i], back);
-    }
+  private:
+    // separability tolerance for dumps, rounding errors in single precision are much larger than 1e-10
+    static constexpr double dump_tolerance = std::is_same<RealType, float>::value ? 1e-5 : 1e-10;
 
     inline static void removeIdentities(std::vector<Gates::Basis>& b, std::vector<logical_qubit_id>& qs)
     {
@@ -0,0 +1,13 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#define SINGLE_PRECISION_ENGINE
+
+#include "simulator/simulator.hpp"
+
+namespace sim = Microsoft::Quantum::SimulatorGenericFloat;
+
+MICROSOFT_QUANTUM_DECL Microsoft::Quantum::Simulator::SimulatorInterface* sim::createSimulator(unsigned maxlocal)
+{
+    return new sim::SimulatorType(maxlocal);
+}
@@ -7,6 +7,11 @@
 #include "gates.hpp"
 #include "types.hpp"
 #include "util/openmp.hpp"
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 namespace Microsoft
@@ -20,8 +25,49 @@ using namespace Microsoft::Quantum::SIMULATOR;
 class SimulatorInterface
 {
   public:
+    /// The lock taken by every call, which does nothing while the simulator is owned by a single thread (see
+    /// set_single_owner). The mode is switched under the lock, and a thread that got the lock just as the simulator
+    /// became single-owned gives it back, so that lock and unlock always agree on the mode.
+    class OwnerMutex
+    {
+      public:
+        void lock()
+        {
+            if (!single_owner_.load(std::memory_order_acquire))
+            {
+                mutex_.lock();
+                if (!single_owner_.load(std::memory_order_relaxed)) return;
+                mutex_.unlock();
+            }
+            assert(std::this_thread::get_id() == owner_);
+        }
+
+        void unlock()
+        {
+            if (!single_owner_.load(std::memory_order_relaxed)) mutex_.unlock();
+        }
+
+        bool single_owner() const
+        {
+            return single_owner_.load(std::memory_order_acquire);
+        }
+
+        void set_single_owner(bool single)
+        {
+            std::lock_guard<recursive_mutex_type> lock(mutex_);
+            owner_ = std::this_thread::get_id();
+            single_owner_.store(single, std::memory_order_release);
+        }
+
+      private:
+        recursive_mutex_type mutex_;
+        std::atomic<bool> single_owner_{false};
+        std::thread::id owner_;
+    };
+    using recursive_lock_type = std::lock_guard<OwnerMutex>;
+
     SimulatorInterface()
-        : mutex_ptr(new recursive_mutex_type())
+        : mutex_ptr(new OwnerMutex())
     {
     }
 
@@ -31,14 +77,24 @@ class SimulatorInterface
 
     virtual double JointEnsembleProbability(std::vector<Gates::Basis> bs, std::vector<unsigned> qs) = 0;
 
+    // sum of coefficients[k] times the expectation value of the Pauli string terms[k] on the qubits qs, evaluated
+    // together in one pass over the state, which is left unchanged
+    virtual double Expectation(
+        std::vector<std::vector<Gates::Basis>> const& terms,
+        std::vector<double> const& coefficients,
+        std::vector<unsigned> const& qs) = 0;
+
+    // the amplitudes are always passed in double precision, single-precision engines round them when injecting
     virtual bool InjectState(
         const std::vector<logical_qubit_id>& qubits,
-        const std::vector<ComplexType>& amplitudes) = 0;
+        const std::vector<std::complex<double>>& amplitudes) = 0;
 
     // allocate and release
     virtual unsigned allocate() = 0;
+    virtual std::vector<unsigned> allocate(unsigned n) = 0;
     virtual void allocateQubit(unsigned q) = 0;
     virtual bool release(unsigned q) = 0;
+    virtual bool release(std::vector<unsigned> const& qs) = 0;
     virtual unsigned num_qubits() const = 0;
 
     // single-qubit gates
@@ -81,12 +137,37 @@ class SimulatorInterface
 
     virtual bool M(unsigned q) = 0;
     virtual bool Measure(std::vector<Gates::Basis> bs, std::vector<unsigned> qs) = 0;
+    // results of measuring each of the qubits (at most 64) in nshots runs that end in the current state, packed with
+    // the result of qs[0] as the lowest bit; the state is left unchanged
+    virtual std::vector<std::uint64_t> SampleShots(std::vector<unsigned> const& qs, std::size_t nshots) = 0;
+    // measures a qubit and releases it
+    virtual bool MRelease(unsigned q) = 0;
+    // measures each of the qubits in the computational basis
+    virtual std::vector<bool> MultiM(std::vector<unsigned> const& qs) = 0;
 
     virtual void seed(unsigned s) = 0;
     virtual void reset() = 0;
-    virtual ComplexType const* data() const = 0;
-
-    virtual bool subsytemwavefunction(std::vector<unsigned> const& qs, WavefunctionStorage& qubitswfn, double tolerance)
+    // number of threads the simulator applies its gates with, 0 picks it by the size of the state again
+    virtual void set_threads(unsigned threads) = 0;
+    // starts the threads the simulator applies its gates with again from the calling thread, on the cores it may run on
+    virtual void rebind_threads() = 0;
+    // number of gates applied since the simulator was created
+    virtual std::uint64_t gate_count() const = 0;
+
+    // batches of independent states that get the same gates, kept interleaved in one state vector (see
+    // Wavefunction::set_batch_size); the size is a power of 2 and can only be changed while no qubits are allocated
+    virtual void set_batch_size(std::size_t batch) = 0;
+    virtual std::size_t batch_size() const = 0;
+    // rotates q by phis[k] in state k of the batch, if all of the controls c are set
+    virtual void BatchR(Gates::Basis b, std::vector<double> const& phis, std::vector<unsigned> const& c, unsigned q) = 0;
+    // measures q in each state of the batch
+    virtual std::vector<bool> BatchM(unsigned q) = 0;
+
+    // in double precision whatever the precision of the engine, like InjectState
+    virtual bool subsytemwavefunction(
+        std::vector<unsigned> const& qs,
+        std::vector<std::complex<double>>& qubitswfn,
+        double tolerance)
     {
         assert(false);
         return false;
@@ -125,13 +206,25 @@ class SimulatorInterface
         throw std::runtime_error("this simulator does not support permutation oracle emulation");
     };
 
-    recursive_mutex_type& getmutex() const
+    OwnerMutex& getmutex() const
     {
         return *mutex_ptr;
     }
 
+    /// Binds the simulator to the calling thread, after which its calls don't lock, or makes it thread-safe again.
+    /// Until then only the calling thread may use the simulator, and no other thread may use it while switching.
+    void set_single_owner(bool single)
+    {
+        mutex_ptr->set_single_owner(single);
+    }
+
+    bool single_owner() const
+    {
+        return mutex_ptr->single_owner();
+    }
+
   private:
-    std::shared_ptr<recursive_mutex_type> mutex_ptr;
+    std::shared_ptr<OwnerMutex> mutex_ptr;
 };
 
 } // namespace Simulator
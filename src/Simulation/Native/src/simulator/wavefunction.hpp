@@ -10,13 +10,17 @@
 #include <iterator>
 #include <limits>
 #include <list>
+#include <map>
+#include <numeric>
 #include <random>
+#include <set>
 #include <string.h>
 #include <vector>
 #include <chrono>
 
 #include "gates.hpp"
 #include "types.hpp"
+#include "util/smallvector.hpp"
 
 #include "external/fused.hpp"
 
@@ -64,28 +68,52 @@ inline size_t set_register(
 }
 } // namespace detail
 
+/// Control qubits of a gate. Most gates have at most a few controls, which are stored inline, so that queueing a gate
+/// doesn't allocate.
+using ControlList = SmallVector<logical_qubit_id, 4>;
+
 ///
 /// When a gate is invoked, we might not apply it immediately but save all its pertinent information into an immutable
 /// cache so we can apply the gate later, possibly fused with other gates to improve performance.
 ///
 class DeferredGate
 {
-    std::vector<logical_qubit_id> controls_;
+    ControlList controls_;
     logical_qubit_id target_;
     TinyMatrix<ComplexType, 2> mat_;
+    bool diagonal_;
+    bool permutation_;
 
   public:
     DeferredGate(
-        const std::vector<logical_qubit_id>& controls,
+        const ControlList& controls,
         logical_qubit_id target,
         const TinyMatrix<ComplexType, 2>& mat)
         : controls_(controls)
         , target_(target)
         , mat_(mat)
+        , diagonal_(is_diagonal(mat))
+        , permutation_(is_permutation(mat))
+    {
+    }
+
+    /// A (multi-)controlled gate is diagonal if its target matrix is a diagonal unitary. The diagonal elements are
+    /// required to be non-zero, so a default-constructed (all zeros) matrix isn't classified as diagonal.
+    static bool is_diagonal(const TinyMatrix<ComplexType, 2>& mat)
+    {
+        const ComplexType zero = 0.;
+        return mat(0, 1) == zero && mat(1, 0) == zero && mat(0, 0) != zero && mat(1, 1) != zero;
+    }
+
+    /// A gate is a permutation (with phases) of the standard computational basis if its target matrix has exactly one
+    /// non-zero element in each row and column, e.g. X, Y, CNOT, Toffoli, or any diagonal gate.
+    static bool is_permutation(const TinyMatrix<ComplexType, 2>& mat)
     {
+        const ComplexType zero = 0.;
+        return is_diagonal(mat) || (mat(0, 0) == zero && mat(1, 1) == zero && mat(0, 1) != zero && mat(1, 0) != zero);
     }
 
-    const std::vector<logical_qubit_id>& get_controls() const
+    const ControlList& get_controls() const
     {
         return controls_;
     }
@@ -97,6 +125,14 @@ class DeferredGate
     {
         return mat_;
     }
+    bool is_diagonal() const
+    {
+        return diagonal_;
+    }
+    bool is_permutation() const
+    {
+        return permutation_;
+    }
 };
 
 ///
@@ -135,20 +171,40 @@ class Cluster
     /// be sorted in assending order.
     std::vector<logical_qubit_id> qids_;
 
-    /// Gates in this cluster. When flushing the cluster, the gates will be applied in order from left to rigth.
-    std::vector<DeferredGate> gates_;
+    /// Gates in this cluster. When flushing the cluster, the gates will be applied in order from left to rigth. The
+    /// gates are owned by the list of gates the cluster was made from, which must outlive the cluster.
+    std::vector<const DeferredGate*> gates_;
+
+    /// All gates in this cluster are diagonal. Diagonal clusters commute with each other and are applied by an
+    /// elementwise multiplication, which costs the same regardless of the cluster's width.
+    bool diagonal_ = true;
+
+    /// All gates in this cluster permute the basis states (with phases). Such clusters are applied as an index remap
+    /// of the amplitudes, which also costs the same regardless of the cluster's width.
+    bool permutation_ = true;
 
   public:
+    /// Diagonal and permutation clusters are allowed to grow up to the widest kernel available, independently of the
+    /// fuse span.
+    static constexpr unsigned MAX_DIAGONAL_CLUSTER_WIDTH = 7;
+
     Cluster() = default;
-    Cluster(const std::vector<logical_qubit_id>& qids, const std::vector<DeferredGate>& gates)
-        : qids_(qids)
-        , gates_(gates)
+    Cluster(std::vector<logical_qubit_id> qids, std::vector<const DeferredGate*> gates)
+        : qids_(std::move(qids))
+        , gates_(std::move(gates))
     {
-        assert(is_sorted_assending(qids));
+        assert(is_sorted_assending(qids_));
+        for (const DeferredGate* gate : gates_)
+        {
+            diagonal_ = diagonal_ && gate->is_diagonal();
+            permutation_ = permutation_ && gate->is_permutation();
+        }
     }
     Cluster(Cluster&& other)
         : qids_(std::move(other.qids_))
         , gates_(std::move(other.gates_))
+        , diagonal_(other.diagonal_)
+        , permutation_(other.permutation_)
     {
     }
 
@@ -160,20 +216,32 @@ class Cluster
     {
         qids_.swap(other.qids_);
         gates_.swap(other.gates_);
+        std::swap(diagonal_, other.diagonal_);
+        std::swap(permutation_, other.permutation_);
     }
 
     const std::vector<logical_qubit_id>& get_qids() const
     {
         return qids_;
     }
-    const std::vector<DeferredGate>& get_gates() const
+    const std::vector<const DeferredGate*>& get_gates() const
     {
         return gates_;
     }
+    bool is_diagonal() const
+    {
+        return diagonal_;
+    }
+    bool is_permutation() const
+    {
+        return permutation_;
+    }
 
     Cluster& append(const Cluster& other)
     {
         gates_.insert(gates_.end(), other.gates_.begin(), other.gates_.end());
+        diagonal_ = diagonal_ && other.diagonal_;
+        permutation_ = permutation_ && other.permutation_;
 
         std::vector<logical_qubit_id> merged;
         std::set_union(other.qids_.begin(), other.qids_.end(), qids_.begin(), qids_.end(), std::back_inserter(merged));
@@ -196,27 +264,38 @@ class Cluster
     /// method is assumed to be in temporal order, where this cluster is implicitly the earliest. Our goal is to find a
     /// cluster that can be commuted to the front of the list and merged with this cluster without increasing its width
     /// beyond `max_cluster_width`. The algorithm picks first such cluster from the start of the list (with the least
-    /// distance to commute).
+    /// distance to commute). Clusters of diagonal gates also commute when their qubits intersect, so a diagonal
+    /// cluster can be pulled through other diagonal clusters. Two permutation clusters (diagonal ones included) can be
+    /// merged up to MAX_DIAGONAL_CLUSTER_WIDTH qubits.
     std::list<Cluster>::const_iterator find_compatible_cluster(
         const std::list<Cluster>& nextClusters,
         unsigned max_cluster_width)
     {
         // Union of all qubits in clusters that we are skipping as we are searching for the compatible one.
         std::set<logical_qubit_id> skipped_qids;
+        // Union of qubits in the skipped clusters that aren't diagonal.
+        std::set<logical_qubit_id> skipped_nondiagonal_qids;
 
         for (auto candidate = nextClusters.begin(); candidate != nextClusters.end(); ++candidate)
         {
             const std::vector<logical_qubit_id>& candidate_qids = candidate->get_qids();
+            const bool both_diagonal = diagonal_ && candidate->is_diagonal();
+            const bool both_permutation = permutation_ && candidate->is_permutation();
+            const unsigned width_limit =
+                both_permutation ? std::max(max_cluster_width, MAX_DIAGONAL_CLUSTER_WIDTH) : max_cluster_width;
 
             // New qubits the candidate cluster would add into this cluster.
             std::vector<logical_qubit_id> qids_new;
             std::set_difference(
                 candidate_qids.begin(), candidate_qids.end(), qids_.begin(), qids_.end(), std::back_inserter(qids_new));
 
-            // If the new qubits from the candidate cluster don't touch any of the clusters we've skipped, the candidate
-            // cluster is compatible with this one. But we also need to check that the new qubits wouldn't increase the
-            // width of the cluster too much.
-            if (is_intersection_empty(qids_new, skipped_qids) && (qids_.size() + qids_new.size() <= max_cluster_width))
+            // If the candidate cluster commutes with all the clusters we've skipped (it doesn't touch them, or both are
+            // diagonal), the candidate cluster is compatible with this one. But we also need to check that the new
+            // qubits wouldn't increase the width of the cluster too much.
+            const bool commutes_with_skipped = candidate->is_diagonal()
+                                                   ? is_intersection_empty(candidate_qids, skipped_nondiagonal_qids)
+                                                   : is_intersection_empty(candidate_qids, skipped_qids);
+            if (commutes_with_skipped && (qids_.size() + qids_new.size() <= width_limit))
             {
                 return candidate;
             }
@@ -224,10 +303,14 @@ class Cluster
             // If the candidate cluster isn't compatible with this one but shares qubits, we treat it as a barrier no
             // other cluster can be pulled through (<irinayat> example #5 below shows that this might lead to more
             // final clusters than necessary -- why this condition and not checking for intersection of candidate_qids
-            // with qids_skipped?).
-            if (!is_intersection_empty(candidate_qids, qids_)) break;
+            // with qids_skipped?). Diagonal clusters commute, so a diagonal candidate doesn't block a diagonal cluster.
+            if (!both_diagonal && !is_intersection_empty(candidate_qids, qids_)) break;
 
             skipped_qids.insert(candidate_qids.begin(), candidate_qids.end());
+            if (!candidate->is_diagonal())
+            {
+                skipped_nondiagonal_qids.insert(candidate_qids.begin(), candidate_qids.end());
+            }
         }
 
         // Found no compatible cluster.
@@ -282,10 +365,10 @@ class Cluster
         std::list<Cluster> curClusters;
         for (const DeferredGate& gate : gates)
         {
-            std::vector<logical_qubit_id> qids = gate.get_controls();
+            std::vector<logical_qubit_id> qids(gate.get_controls().begin(), gate.get_controls().end());
             qids.push_back(gate.get_target());
             std::sort(qids.begin(), qids.end());
-            curClusters.emplace_back(qids, std::vector<DeferredGate>{gate});
+            curClusters.emplace_back(std::move(qids), std::vector<const DeferredGate*>{&gate});
         }
 
         // Run incremental left-to-right passes over the clusters, increasing the number of allowed qubits on each pass.
@@ -326,6 +409,208 @@ class Cluster
 
         return curClusters;
     }
+
+    /// Estimated cost of applying a cluster of the given width, in units of a memory-bound sweep over the state
+    /// vector. Dense kernels up to MEMORY_BOUND_CLUSTER_WIDTH qubits are limited by the memory bandwidth, after that
+    /// the number of flops per amplitude doubles with each qubit. Diagonal and permutation clusters always cost a
+    /// single sweep.
+    static constexpr unsigned MEMORY_BOUND_CLUSTER_WIDTH = 4;
+    static double sweep_cost(size_t width, bool permutation)
+    {
+        if (permutation || width <= MEMORY_BOUND_CLUSTER_WIDTH) return 1.0;
+        return static_cast<double>(1ull << (width - MEMORY_BOUND_CLUSTER_WIDTH));
+    }
+
+    ///
+    /// Same as `make_clusters` but instead of merging clusters greedily from left to right, it builds the dependency
+    /// graph of the gates once (a gate depends on the preceding gates that share a qubit with it, unless both gates are
+    /// diagonal) and schedules the clusters one at a time from the gates that are ready to be applied. A cluster is
+    /// seeded with the earliest ready gate and grown by the ready gate that adds the fewest new qubits to it (gates on
+    /// the qubits already in the cluster come for free), which makes the successors of the absorbed gates ready in
+    /// turn. Growing stops when no ready gate fits into `fuseSpan` qubits (or the widest kernel for permutation
+    /// clusters) or the cluster reaches `maxFusedDepth` gates. Of all intermediate states of the cluster the one with
+    /// the lowest `sweep_cost` per gate is kept, the rest of the gates are left for the next clusters.
+    ///
+    /// Because the scheduler looks at all ready gates rather than the neighbours in the list, it isn't blocked by
+    /// clusters that happen to be in the way. E.g. for example #4 above with fuseSpan = 2 it finds
+    /// {X(q1), X(q2), CNOT(q1, q2), Y(q2)}, {X(q3), CNOT(q1, q3), Y(q1), Y(q3)}.
+    ///
+    static std::list<Cluster> schedule_clusters(
+        unsigned fuseSpan,
+        int maxFusedDepth,
+        const std::vector<DeferredGate>& gates)
+    {
+        std::list<Cluster> clusters;
+        const size_t n = gates.size();
+        if (n == 0) return clusters;
+
+        // Build the dependency graph. Diagonal gates depend only on the last non-diagonal gate on each of their qubits,
+        // non-diagonal gates also depend on all diagonal gates since then. The qubits of gate `i` are
+        // `qids[qid_offsets[i]], ..., qids[qid_offsets[i + 1] - 1]`, and its successors are stored the same way, so
+        // that the graph takes a few flat arrays rather than a couple of vectors per gate.
+        std::vector<logical_qubit_id> qids;
+        std::vector<size_t> qid_offsets;
+        std::vector<size_t> successors;
+        std::vector<size_t> successor_offsets;
+        std::vector<int> pending_predecessors;
+        qid_offsets.resize(n + 1, 0);
+        successor_offsets.resize(n + 1, 0);
+        pending_predecessors.resize(n, 0);
+        {
+            constexpr size_t none = std::numeric_limits<size_t>::max();
+            std::map<logical_qubit_id, size_t> last_nondiagonal;
+            std::map<logical_qubit_id, std::vector<size_t>> diagonals_since;
+            std::vector<size_t> predecessors;
+            std::vector<std::pair<size_t, size_t>> edges; // (predecessor, successor) in the order of the successors
+            for (size_t i = 0; i < n; i++)
+            {
+                const size_t first = qids.size();
+                qids.insert(qids.end(), gates[i].get_controls().begin(), gates[i].get_controls().end());
+                qids.push_back(gates[i].get_target());
+                std::sort(qids.begin() + first, qids.end());
+                qid_offsets[i + 1] = qids.size();
+
+                predecessors.clear();
+                for (size_t k = first; k < qids.size(); k++)
+                {
+                    const logical_qubit_id q = qids[k];
+                    auto last = last_nondiagonal.find(q);
+                    if (last != last_nondiagonal.end() && last->second != none) predecessors.push_back(last->second);
+                    if (gates[i].is_diagonal())
+                    {
+                        diagonals_since[q].push_back(i);
+                    }
+                    else
+                    {
+                        std::vector<size_t>& diagonals = diagonals_since[q];
+                        predecessors.insert(predecessors.end(), diagonals.begin(), diagonals.end());
+                        diagonals.clear();
+                        last_nondiagonal[q] = i;
+                    }
+                }
+                std::sort(predecessors.begin(), predecessors.end());
+                predecessors.erase(std::unique(predecessors.begin(), predecessors.end()), predecessors.end());
+                for (size_t p : predecessors)
+                {
+                    edges.emplace_back(p, i);
+                    successor_offsets[p + 1]++;
+                }
+                pending_predecessors[i] = static_cast<int>(predecessors.size());
+            }
+
+            std::partial_sum(successor_offsets.begin(), successor_offsets.end(), successor_offsets.begin());
+            successors.resize(edges.size());
+            std::vector<size_t> next(successor_offsets.begin(), successor_offsets.end() - 1);
+            for (const auto& edge : edges)
+            {
+                successors[next[edge.first]++] = edge.second;
+            }
+        }
+        auto qids_begin = [&](size_t g) { return qids.begin() + qid_offsets[g]; };
+        auto qids_end = [&](size_t g) { return qids.begin() + qid_offsets[g + 1]; };
+
+        // Gates whose predecessors have all been scheduled, ordered by their position in `gates`. There are rarely more
+        // ready gates than qubits, so a sorted vector beats a tree.
+        std::vector<size_t> ready;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (pending_predecessors[i] == 0) ready.push_back(i);
+        }
+        auto make_ready = [&](size_t g) { ready.insert(std::lower_bound(ready.begin(), ready.end(), g), g); };
+        auto unmake_ready = [&](size_t g) { ready.erase(std::lower_bound(ready.begin(), ready.end(), g)); };
+        auto take = [&](size_t g) {
+            unmake_ready(g);
+            for (size_t k = successor_offsets[g]; k < successor_offsets[g + 1]; k++)
+            {
+                if (--pending_predecessors[successors[k]] == 0) make_ready(successors[k]);
+            }
+        };
+        auto untake = [&](size_t g) {
+            for (size_t k = successor_offsets[g]; k < successor_offsets[g + 1]; k++)
+            {
+                if (pending_predecessors[successors[k]]++ == 0) unmake_ready(successors[k]);
+            }
+            make_ready(g);
+        };
+
+        const unsigned permutation_width = std::max(fuseSpan, MAX_DIAGONAL_CLUSTER_WIDTH);
+        std::vector<size_t> taken;
+        std::vector<logical_qubit_id> cluster_qids;
+        std::vector<logical_qubit_id> merged;
+        while (!ready.empty())
+        {
+            // The earliest ready gate always forms a cluster, even if it's wider than the span.
+            const size_t seed = ready.front();
+            taken.assign(1, seed);
+            cluster_qids.assign(qids_begin(seed), qids_end(seed));
+            bool permutation = gates[seed].is_permutation();
+            take(seed);
+
+            size_t best_size = 1;
+            double best_cost = sweep_cost(cluster_qids.size(), permutation);
+
+            while (static_cast<int>(taken.size()) < maxFusedDepth)
+            {
+                size_t candidate = n;
+                size_t candidate_new = std::numeric_limits<size_t>::max();
+                for (size_t g : ready)
+                {
+                    const bool keeps_permutation = permutation && gates[g].is_permutation();
+                    const size_t width_limit = keeps_permutation ? permutation_width : fuseSpan;
+                    size_t new_qids = 0;
+                    for (auto q = qids_begin(g); q != qids_end(g); ++q)
+                    {
+                        if (!std::binary_search(cluster_qids.begin(), cluster_qids.end(), *q)) new_qids++;
+                    }
+                    if (cluster_qids.size() + new_qids > width_limit || new_qids >= candidate_new) continue;
+
+                    candidate = g;
+                    candidate_new = new_qids;
+                    if (new_qids == 0) break;
+                }
+                if (candidate == n) break;
+
+                merged.clear();
+                std::set_union(
+                    cluster_qids.begin(), cluster_qids.end(), qids_begin(candidate), qids_end(candidate),
+                    std::back_inserter(merged));
+                cluster_qids.swap(merged);
+                permutation = permutation && gates[candidate].is_permutation();
+                taken.push_back(candidate);
+                take(candidate);
+
+                const double cost = sweep_cost(cluster_qids.size(), permutation) / taken.size();
+                if (cost <= best_cost)
+                {
+                    best_cost = cost;
+                    best_size = taken.size();
+                }
+            }
+
+            // Return the gates beyond the cheapest prefix back to the pool, in reverse order of taking them.
+            while (taken.size() > best_size)
+            {
+                untake(taken.back());
+                taken.pop_back();
+            }
+
+            std::vector<const DeferredGate*> cluster_gates;
+            cluster_gates.reserve(taken.size());
+            cluster_qids.clear();
+            for (size_t g : taken)
+            {
+                cluster_gates.push_back(&gates[g]);
+                merged.clear();
+                std::set_union(
+                    cluster_qids.begin(), cluster_qids.end(), qids_begin(g), qids_end(g), std::back_inserter(merged));
+                cluster_qids.swap(merged);
+            }
+            clusters.emplace_back(cluster_qids, std::move(cluster_gates));
+        }
+
+        assert(std::all_of(pending_predecessors.begin(), pending_predecessors.end(), [](int p) { return p == 0; }));
+        return clusters;
+    }
 };
 
 ///
@@ -353,6 +638,15 @@ class Wavefunction
     /// basic vector of this wave function). Might not reflect the current state if there are pending fused gates.
     mutable WavefunctionStorage wfn_;
 
+    /// The qubits allocated since the last flush, in the highest positions, aren't part of `wfn_` yet: they are in
+    /// state |0>, so the missing upper part of the state is known to be zero. `wfn_` is grown for all of them at once
+    /// when the state is needed again (see `grow`), which costs a single reallocation instead of one per qubit.
+    mutable unsigned lazy_qubits_ = 0;
+
+    /// A batch of 2^batch_qubits_ independent states is kept in `wfn_`, in the lowest positions, which no qubit is
+    /// assigned to (see `set_batch_size`). `num_qubits_` counts them as well.
+    unsigned batch_qubits_ = 0;
+
     /// Each qubit has a client-facing id, which we call "logical qubit id" or just "logical qubit". However, the order
     /// of qubits in the internal representation of the state, that is, the positions of the qubits in the standard
     /// computational basis of the wave function, might not match their logical ids or even the order of the logical
@@ -360,10 +654,16 @@ class Wavefunction
     /// logical id of the qubit (which means this map might grow rather large if logical qubit ids aren't reused).
     mutable std::vector<positional_qubit_id> qubitmap_;
 
+    /// Positions of the controls of the gate being fused, kept around to avoid allocating them for every gate.
+    mutable std::vector<positional_qubit_id> control_positions_;
+
     /// Cache of the pending gates that haven't been applied (i.e. flushed) to the wave function storage yet.
     static constexpr int MAX_PENDING_GATES = 999;
     mutable std::vector<DeferredGate> pending_gates_;
 
+    /// Number of gates applied since the wave function was created (see gate_count).
+    std::uint64_t gate_count_ = 0;
+
     /// TODO: add comment
     Fused fused_;
 
@@ -390,9 +690,9 @@ class Wavefunction
     {
         fused_.reset();
         rng_.seed((unsigned)std::chrono::system_clock::now().time_since_epoch().count());
-        num_qubits_ = 0;
-        wfn_.resize(1);
-        wfn_[0] = 1.;
+        num_qubits_ = batch_qubits_;
+        lazy_qubits_ = 0;
+        wfn_.assign(batch_size(), 1.);
         qubitmap_.resize(0);
 
         // what about pending_gates_?
@@ -444,35 +744,328 @@ class Wavefunction
 
     void flush() const
     {
-        std::list<Cluster> clusters = Cluster::make_clusters(fused_.maxSpan(), fused_.maxDepth(), pending_gates_);
+        grow();
+#ifdef _OPENMP
+        // the sweeps that the thread pool doesn't run keep to this simulator's budget too
+        if (omp_get_max_threads() != static_cast<int>(fused_.threads())) omp_set_num_threads(fused_.threads());
+#endif
+
+        std::list<Cluster> clusters =
+            fused_.scheduler() == Fused::Scheduler::lookahead
+                ? Cluster::schedule_clusters(fused_.maxSpan(), fused_.maxDepth(), pending_gates_)
+                : Cluster::make_clusters(fused_.maxSpan(), fused_.maxDepth(), pending_gates_);
 
         if (clusters.empty())
         {
             fused_.flush(wfn_);
         }
+        else if (batch_qubits_ == 0 && use_blocks())
+        {
+            if (pending_gates_.size() >= MIN_REORDER_GATES) reorder_hot_qubits();
+            flush_blocked(clusters);
+        }
         else
         {
             // logic to flush gates in each cluster
             for (const Cluster& cl : clusters)
             {
-                for (const DeferredGate& gate : cl.get_gates())
+                fuse(cl);
+                fused_.flush(wfn_);
+            }
+        }
+        pending_gates_.clear();
+    }
+
+  private:
+    /// the positions of the states of the batch followed by the position of q
+    std::vector<positional_qubit_id> batch_positions(logical_qubit_id q) const
+    {
+        std::vector<positional_qubit_id> ps;
+        for (positional_qubit_id p = 0; p < batch_qubits_; p++)
+            ps.push_back(p);
+        ps.push_back(get_qubit_position(q));
+        return ps;
+    }
+
+    /// Add the amplitudes of the lazily allocated qubits to the state. The storage keeps its capacity when qubits are
+    /// released, so allocating them again doesn't reallocate either.
+    void grow() const
+    {
+        if (lazy_qubits_ == 0) return;
+        wfn_.resize(wfn_.size() << lazy_qubits_);
+        lazy_qubits_ = 0;
+    }
+
+    /// removes the qubits in the classical states vals from the state, and scales the remaining amplitudes
+    void remove_qubits(std::vector<logical_qubit_id> const& qs, std::vector<bool> const& vals, RealType scale)
+    {
+        flush();
+        std::vector<positional_qubit_id> ps = get_qubit_positions(qs);
+        kernels::compact(wfn_, ps, vals, scale);
+        if (wfn_.size() <= wfn_.capacity() / 4) wfn_.shrink_to_fit();
+
+        std::sort(ps.begin(), ps.end());
+        for (size_t i = 0; i < qubitmap_.size(); ++i)
+            if (qubitmap_[i] != invalid_qubit_position())
+                qubitmap_[i] -= static_cast<positional_qubit_id>(
+                    std::lower_bound(ps.begin(), ps.end(), qubitmap_[i]) - ps.begin());
+        for (logical_qubit_id q : qs)
+            qubitmap_[q] = invalid_qubit_position();
+        num_qubits_ -= static_cast<unsigned>(qs.size());
+    }
+
+    /// Number of qubits measured together by `multimeasure`, each thread sums up 2^MAX_MARGINAL_QUBITS probabilities.
+    static constexpr std::size_t MAX_MARGINAL_QUBITS = 10;
+
+    /// Blocked execution of the clusters kicks in for states with at least 2^MIN_BLOCKS_QUBITS blocks.
+    static constexpr unsigned MIN_BLOCKS_QUBITS = 4;
+
+    /// Hot qubits are moved into the low positions only when flushing at least MIN_REORDER_GATES gates, and if the
+    /// qubits moved in are targeted at least MIN_REORDER_GAIN times per moved qubit more often than the qubits moved
+    /// out.
+    static constexpr size_t MIN_REORDER_GATES = 64;
+    static constexpr size_t MIN_REORDER_GAIN = 16;
+
+    bool use_blocks() const
+    {
+        return fused_.blockQubits() > 0 && num_qubits_ >= fused_.blockQubits() + MIN_BLOCKS_QUBITS;
+    }
+
+    /// The qubits in the low block_qubits() positions are the ones the clusters can be applied to block by block.
+    unsigned block_qubits() const
+    {
+        return static_cast<unsigned>(fused_.blockQubits());
+    }
+
+    /// Positions are assigned to the qubits in the order of allocation, but the qubits targeted by the pending gates
+    /// are best kept in the low positions: the kernels then access memory with small strides and the clusters can be
+    /// applied block by block without remapping (see `flush_blocked`). We count how often each qubit is targeted by
+    /// the pending gates and, if it pays off, move the most targeted ("hot") qubits into the lowest `blockQubits`
+    /// positions, in exchange for the least targeted qubits there, with a single pass over the state.
+    void reorder_hot_qubits() const
+    {
+        const unsigned block_qubits = this->block_qubits();
+
+        std::vector<size_t> touches(qubitmap_.size(), 0);
+        for (const DeferredGate& gate : pending_gates_)
+            touches[gate.get_target()]++;
+
+        std::vector<logical_qubit_id> qs = get_qubit_ids();
+        std::stable_sort(qs.begin(), qs.end(), [&touches](logical_qubit_id a, logical_qubit_id b) {
+            return touches[a] > touches[b];
+        });
+        size_t num_hot = 0;
+        while (num_hot < std::min<size_t>(block_qubits, qs.size()) && touches[qs[num_hot]] > 0)
+            num_hot++;
+
+        std::vector<logical_qubit_id> moved_in;
+        for (size_t i = 0; i < num_hot; i++)
+        {
+            if (qubitmap_[qs[i]] >= block_qubits) moved_in.push_back(qs[i]);
+        }
+        std::vector<logical_qubit_id> moved_out;
+        for (size_t i = qs.size(); i-- > num_hot && moved_out.size() < moved_in.size();)
+        {
+            if (qubitmap_[qs[i]] < block_qubits) moved_out.push_back(qs[i]);
+        }
+        assert(moved_out.size() == moved_in.size());
+
+        size_t gain = 0;
+        for (logical_qubit_id q : moved_in)
+            gain += touches[q];
+        for (logical_qubit_id q : moved_out)
+            gain -= std::min(gain, touches[q]);
+        if (moved_in.empty() || gain < MIN_REORDER_GAIN * moved_in.size()) return;
+
+        std::vector<std::pair<unsigned, unsigned>> pairs;
+        for (size_t i = 0; i < moved_in.size(); i++)
+            pairs.emplace_back(qubitmap_[moved_out[i]], qubitmap_[moved_in[i]]);
+        swap_positions(pairs);
+    }
+
+    /// Swap the positions of the qubits in `pairs` in the state and in `qubitmap_`.
+    void swap_positions(const std::vector<std::pair<unsigned, unsigned>>& pairs) const
+    {
+        kernels::swap(wfn_, pairs);
+        for (positional_qubit_id& p : qubitmap_)
+        {
+            if (p != invalid_qubit_position()) p = swapped_position(pairs, p);
+        }
+    }
+
+    static positional_qubit_id swapped_position(
+        const std::vector<std::pair<unsigned, unsigned>>& pairs,
+        positional_qubit_id p)
+    {
+        for (const auto& pair : pairs)
+        {
+            if (p == pair.first) return pair.second;
+            if (p == pair.second) return pair.first;
+        }
+        return p;
+    }
+
+    /// Queue a gate. The queue keeps its storage across flushes, so this doesn't allocate unless the gate has more
+    /// controls than fit into a ControlList.
+    template <class Gate>
+    void enqueue(const ControlList& cs, Gate const& g)
+    {
+        pending_gates_.emplace_back(cs, g.qubit(), g.matrix());
+        gate_count_ += batch_size();
+        if (pending_gates_.size() > MAX_PENDING_GATES)
+        {
+            flush();
+        }
+
+        // pick the parameters for the state the gates will be applied to, grown by the lazily allocated qubits
+        fused_.shouldFlush(std::max(wfn_.capacity(), wfn_.size() << lazy_qubits_));
+    }
+
+    /// Hand the gates of the cluster over to the fuser.
+    void fuse(const Cluster& cl) const
+    {
+        for (const DeferredGate* gate : cl.get_gates())
+        {
+            const ControlList& cs = gate->get_controls();
+            if (cs.size() == 0)
+            {
+                fused_.apply(wfn_, gate->get_mat(), get_qubit_position(gate->get_target()));
+            }
+            else
+            {
+                control_positions_.clear();
+                for (logical_qubit_id c : cs)
                 {
-                    const std::vector<logical_qubit_id>& cs = gate.get_controls();
-                    if (cs.size() == 0)
-                    {
-                        fused_.apply(wfn_, gate.get_mat(), get_qubit_position(gate.get_target()));
-                    }
-                    else
-                    {
-                        fused_.apply_controlled(
-                            wfn_, gate.get_mat(), get_qubit_positions(cs), get_qubit_position(gate.get_target()));
-                    }
+                    control_positions_.push_back(get_qubit_position(c));
                 }
+                fused_.apply_controlled(
+                    wfn_, gate->get_mat(), control_positions_, get_qubit_position(gate->get_target()));
+            }
+        }
+    }
 
-                fused_.flush(wfn_);
+    /// For large states each cluster applied on its own streams the whole state vector through memory. Instead, we
+    /// split the clusters into segments of consecutive clusters whose target qubits fit into a block of
+    /// 2^blockQubits amplitudes and apply all clusters of a segment to one block before moving on to the next one, so
+    /// that the segment costs a single sweep over the memory. Controls don't count: a control on a high qubit only
+    /// decides which blocks the cluster is applied to. If some of the targets of a segment are high qubits, they are
+    /// first swapped with unused low qubits. That costs another sweep per kernels::MAX_SWAPS_PER_PASS swaps, and the
+    /// swaps don't help at all when the kernels are compute bound, so we only remap if it saves at least two sweeps.
+    void flush_blocked(const std::list<Cluster>& clusters) const
+    {
+        const unsigned block_qubits = this->block_qubits();
+
+        std::vector<Fused::FusedCluster> fcs;
+        fcs.reserve(clusters.size());
+        for (const Cluster& cl : clusters)
+        {
+            fuse(cl);
+            fcs.push_back(fused_.take());
+        }
+
+        size_t i = 0;
+        while (i < fcs.size())
+        {
+            // Grow the segment while its target qubits fit into a block.
+            std::set<positional_qubit_id> targets;
+            size_t j = i;
+            for (; j < fcs.size(); j++)
+            {
+                std::set<positional_qubit_id> merged(targets);
+                merged.insert(fcs[j].qs.begin(), fcs[j].qs.end());
+                if (merged.size() > block_qubits) break;
+                targets.swap(merged);
+            }
+
+            std::vector<positional_qubit_id> high;
+            std::copy_if(targets.begin(), targets.end(), std::back_inserter(high), [block_qubits](unsigned p) {
+                return p >= block_qubits;
+            });
+            const size_t swap_passes = (high.size() + kernels::MAX_SWAPS_PER_PASS - 1) / kernels::MAX_SWAPS_PER_PASS;
+            if (j - i < (high.empty() ? 2 : 3 + swap_passes))
+            {
+                fused_.apply_parallel(wfn_, fcs[i]);
+                i++;
+                continue;
+            }
+
+            if (!high.empty())
+            {
+                // Pair up the high targets with the highest unused low positions.
+                std::vector<std::pair<unsigned, unsigned>> pairs;
+                for (unsigned p = block_qubits; p-- > 0 && pairs.size() < high.size();)
+                {
+                    if (targets.count(p) == 0) pairs.emplace_back(p, high[pairs.size()]);
+                }
+                swap_positions(pairs, fcs, i);
             }
+
+            apply_blocks(fcs, i, j, block_qubits);
+            i = j;
         }
-        pending_gates_.clear();
+    }
+
+    /// Swap the positions of the qubits in `pairs` in the state and update the positions used by the clusters that
+    /// haven't been applied yet, starting with `fcs[first]`.
+    void swap_positions(
+        const std::vector<std::pair<unsigned, unsigned>>& pairs,
+        std::vector<Fused::FusedCluster>& fcs,
+        size_t first) const
+    {
+        swap_positions(pairs);
+        for (size_t k = first; k < fcs.size(); k++)
+        {
+            for (unsigned& q : fcs[k].qs)
+                q = swapped_position(pairs, q);
+            std::size_t cmask = 0;
+            for (positional_qubit_id p = 0; p < num_qubits_; p++)
+            {
+                if ((fcs[k].cmask >> p) & 1ull) cmask |= 1ull << swapped_position(pairs, p);
+            }
+            fcs[k].cmask = cmask;
+        }
+    }
+
+    /// Apply clusters `fcs[first]`, ..., `fcs[last - 1]`, which only target the low `block_qubits` qubits, to one block
+    /// of the state at a time.
+    void apply_blocks(std::vector<Fused::FusedCluster>& fcs, size_t first, size_t last, unsigned block_qubits) const
+    {
+        const std::size_t block_size = 1ull << block_qubits;
+        std::vector<std::size_t> high_cmasks;
+        for (size_t k = first; k < last; k++)
+        {
+            high_cmasks.push_back(fcs[k].cmask & ~(block_size - 1));
+            fcs[k].cmask &= block_size - 1;
+        }
+
+        auto apply_block = [&](std::size_t b) {
+            const std::size_t base = b << block_qubits;
+            kernels::StateBlock<typename WavefunctionStorage::value_type> block(&wfn_[base], block_size);
+            for (size_t k = first; k < last; k++)
+            {
+                const std::size_t high_cmask = high_cmasks[k - first];
+                if ((base & high_cmask) == high_cmask) Fused::apply(block, fcs[k]);
+            }
+        };
+
+        const std::intptr_t nblocks = static_cast<std::intptr_t>(wfn_.size() >> block_qubits);
+        fused_.threadPool().run(nblocks, [&apply_block](std::size_t first_block, std::size_t last_block) {
+            for (std::size_t b = first_block; b < last_block; b++)
+                apply_block(b);
+        }, fused_.threads());
+    }
+
+  public:
+    /// Tuning options of the gate fusion (span, scheduler, blocking).
+    Fused& get_fused()
+    {
+        return fused_;
+    }
+
+    /// Number of gates applied so far, to each state of a batch, counting the ones still waiting to be fused as well.
+    std::uint64_t gate_count() const
+    {
+        return gate_count_;
     }
 
     /// Allocate a qubit with implicitly assigned logical qubit id.
@@ -483,8 +1076,7 @@ class Wavefunction
         usage_ = QubitAllocationPattern::implicitLogicalId;
 #endif
 
-        flush();
-        wfn_.resize(2 * wfn_.size());
+        lazy_qubits_++;
 
         // Reuse a logical qubit id, if any is available.
         auto it = std::find(qubitmap_.begin(), qubitmap_.end(), invalid_qubit_position());
@@ -510,8 +1102,7 @@ class Wavefunction
         usage_ = QubitAllocationPattern::explicitLogicalId;
 #endif
 
-        flush();
-        wfn_.resize(2 * wfn_.size());
+        lazy_qubits_++;
 
         if (id < qubitmap_.size())
         {
@@ -523,31 +1114,131 @@ class Wavefunction
             assert(id == qubitmap_.size()); // we want qubitmap_ to be as small as possible
             qubitmap_.push_back(num_qubits_++);
         }
-        assert((wfn_.size() >> num_qubits_) == 1);
+        assert(((wfn_.size() << lazy_qubits_) >> num_qubits_) == 1);
     }
 
     /// release the specified qubit
     /// \pre the qubit has to be in a classical state in the computational basis
     void release(logical_qubit_id q)
     {
-        positional_qubit_id p = get_qubit_position(q);
-        flush();
-        kernels::collapse(wfn_, p, getvalue(q), true);
-        for (size_t i = 0; i < qubitmap_.size(); ++i)
-            if (qubitmap_[i] > p && qubitmap_[i] != invalid_qubit_position()) qubitmap_[i]--;
-        qubitmap_[q] = invalid_qubit_position();
-        --num_qubits_;
+        release(std::vector<logical_qubit_id>(1, q));
+    }
+
+    /// release the specified qubits, removing them from the state in one pass
+    /// \pre the qubits have to be in a classical state in the computational basis
+    ///
+    /// The memory is returned once the state uses at most a quarter of it, so that releasing and allocating a few
+    /// qubits in turn doesn't reallocate.
+    void release(std::vector<logical_qubit_id> const& qs)
+    {
+        std::vector<unsigned> probed = classicalvalues(qs);
+        std::vector<bool> vals;
+        // a qubit in a superposition breaks the precondition the same way as in getvalue
+        for (std::size_t i = 0; i < qs.size(); ++i)
+            vals.push_back(probed[i] == 2 ? getvalue(qs[i]) : probed[i] == 1);
+        release(qs, vals);
+    }
+
+    /// release the specified qubits, which are known to be in the classical states vals
+    void release(std::vector<logical_qubit_id> const& qs, std::vector<bool> const& vals)
+    {
+        remove_qubits(qs, vals, 1.);
     }
 
     /// the number of used qubits
     unsigned num_qubits() const
     {
-        return num_qubits_;
+        return num_qubits_ - batch_qubits_;
+    }
+
+    /// number of independent states the gates are applied to
+    std::size_t batch_size() const
+    {
+        return 1ull << batch_qubits_;
+    }
+
+    /// Keep a batch of `batch` (a power of 2) independent states of the qubits, all of which get the same gates.
+    /// Amplitude k of state b is stored at index k * batch + b, that is, the states take the lowest log2(batch)
+    /// positions, where no qubit ever goes, and the kernels for a single state apply a gate to the whole batch in one
+    /// sweep, with the inner loops over the contiguous amplitudes of all the states. `apply_batched` applies a
+    /// different gate to each state, e.g. the rotations of a parameter sweep, and the batch_ readouts look at each
+    /// state on its own; the other readouts would treat the batch as one state and must not be used. Qubits can be
+    /// released once they are in the same classical state in all of the states (see `batch_measure`). Batches aren't
+    /// split into blocks.
+    /// \pre no qubits are allocated
+    void set_batch_size(std::size_t batch)
+    {
+        assert(num_qubits() == 0 && batch > 0 && (batch & (batch - 1)) == 0);
+        flush();
+        batch_qubits_ = 0;
+        while ((1ull << batch_qubits_) < batch)
+            batch_qubits_++;
+        num_qubits_ = batch_qubits_;
+        wfn_.assign(batch, 1.);
+    }
+
+    /// apply mats[b] to the qubit q of state b of the batch, if all of the controls cs are set
+    ///
+    /// The pending gates are flushed first, as the fuser only combines gates that are the same for all the states.
+    void apply_batched(
+        std::vector<logical_qubit_id> const& cs,
+        logical_qubit_id q,
+        std::vector<TinyMatrix<ComplexType, 2>> const& mats)
+    {
+        assert(mats.size() == batch_size());
+        flush();
+        kernels::apply_batched(wfn_, mats, get_qubit_position(q), kernels::make_mask(get_qubit_positions(cs)));
+        gate_count_ += batch_size();
+    }
+
+    /// probability of measuring a 1 in each state of the batch
+    std::vector<double> batch_probabilities(logical_qubit_id q) const
+    {
+        flush();
+        const std::size_t batch = batch_size();
+        std::vector<double> probs = kernels::marginal(wfn_, batch_positions(q));
+        std::vector<double> ps(batch);
+        for (std::size_t b = 0; b < batch; ++b)
+            ps[b] = probs[batch + b] / (probs[b] + probs[batch + b]);
+        return ps;
+    }
+
+    /// measure the qubit q in each state of the batch
+    ///
+    /// One pass sums up the probabilities of all the states and one more collapses and renormalizes each of them.
+    /// With `reset` the qubit is also flipped back to |0> in the states where it was measured as 1, in that same pass,
+    /// so that it can be released afterwards.
+    std::vector<bool> batch_measure(logical_qubit_id q, bool reset = false)
+    {
+        flush();
+        const std::size_t batch = batch_size();
+        std::vector<double> probs = kernels::marginal(wfn_, batch_positions(q));
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        std::vector<bool> results(batch);
+        std::vector<TinyMatrix<ComplexType, 2>> mats(batch);
+        for (std::size_t b = 0; b < batch; ++b)
+        {
+            const double p0 = probs[b];
+            const double p1 = probs[batch + b];
+            results[b] = uniform(rng_) * (p0 + p1) < p1;
+            const ComplexType scale(1. / std::sqrt(results[b] ? p1 : p0));
+            ComplexType m[2][2] = {{0., 0.}, {0., 0.}};
+            if (!results[b])
+                m[0][0] = scale;
+            else if (reset)
+                m[0][1] = scale;
+            else
+                m[1][1] = scale;
+            mats[b] = TinyMatrix<ComplexType, 2>(m);
+        }
+        kernels::apply_batched(wfn_, mats, get_qubit_position(q), 0);
+        return results;
     }
 
     /// probability of measuring a 1
     double probability(logical_qubit_id q) const
     {
+        assert(batch_qubits_ == 0);
         flush();
         return kernels::probability(wfn_, get_qubit_position(q));
     }
@@ -555,6 +1246,7 @@ class Wavefunction
     /// probability of jointly measuring a 1
     double jointprobability(std::vector<logical_qubit_id> const& qs) const
     {
+        assert(batch_qubits_ == 0);
         flush();
         return kernels::jointprobability(wfn_, get_qubit_positions(qs));
     }
@@ -562,6 +1254,7 @@ class Wavefunction
     /// probability of jointly measuring a 1
     double jointprobability(std::vector<Gates::Basis> const& bs, std::vector<logical_qubit_id> const& qs) const
     {
+        assert(batch_qubits_ == 0);
         flush();
         return kernels::jointprobability(wfn_, bs, get_qubit_positions(qs));
     }
@@ -571,7 +1264,8 @@ class Wavefunction
     /// Place qubits, listed in `q` into superposition of basis vectors with provided `amplitudes`, where the order of
     /// qubits in array `q` defines the standard computational basis in little endian order. Returns `true` if the state
     /// is successfuly injected.
-    bool inject_state(const std::vector<logical_qubit_id>& qubits, const std::vector<ComplexType>& amplitudes)
+    template <class C>
+    bool inject_state(const std::vector<logical_qubit_id>& qubits, const std::vector<C>& amplitudes)
     {
         assert((static_cast<size_t>(1) << qubits.size()) == amplitudes.size());
 
@@ -581,7 +1275,7 @@ class Wavefunction
         {
             // Check prerequisites. In the case of total state injection the wave function must consist of a single
             // term |0...0> (so we can avoid checking each qubit individually).
-            double eps = 100. * std::numeric_limits<double>::epsilon();
+            double eps = 100. * std::numeric_limits<RealType>::epsilon();
             if (std::norm(wfn_[0]) < 1.0 - eps)
             {
                 return false;
@@ -601,7 +1295,7 @@ class Wavefunction
             std::vector<positional_qubit_id> positions = get_qubit_positions(qubits);
             for (positional_qubit_id p : positions)
             {
-                if (!kernels::isclassical(wfn_, p) || kernels::getvalue(wfn_, p) != 0)
+                if (kernels::probeclassical(wfn_, p) != 0)
                 {
                     return false;
                 }
@@ -626,7 +1320,7 @@ class Wavefunction
             {
                 const size_t injected_index = detail::get_register(positions, basis_index);
                 const size_t original_term = detail::set_register(positions, mask, 0, basis_index);
-                wfn_new[basis_index] = wfn_[original_term] * amplitudes[injected_index];
+                wfn_new[basis_index] = wfn_[original_term] * static_cast<T>(amplitudes[injected_index]);
             }
             std::swap(wfn_, wfn_new);
         }
@@ -635,18 +1329,59 @@ class Wavefunction
     }
 
     /// measure a qubit
-    bool measure(logical_qubit_id q)
+    ///
+    /// The norm of the collapsed state is known from the probability, so the state is collapsed and renormalized in
+    /// one pass. With `compact` the qubit is released as well, which halves the state in that same pass.
+    bool measure(logical_qubit_id q, bool compact = false)
     {
+        assert(batch_qubits_ == 0);
         flush();
         std::uniform_real_distribution<double> uniform(0., 1.);
-        bool result = (uniform(rng_) < probability(q));
-        kernels::collapse(wfn_, get_qubit_position(q), result);
-        kernels::normalize(wfn_);
+        const double p = probability(q);
+        bool result = (uniform(rng_) < p);
+        const RealType scale = static_cast<RealType>(1. / std::sqrt(result ? p : 1. - p));
+        if (compact)
+            remove_qubits(std::vector<logical_qubit_id>(1, q), std::vector<bool>(1, result), scale);
+        else
+            kernels::multicollapse(wfn_, std::vector<unsigned>(1, get_qubit_position(q)), result, scale);
         return result;
     }
 
+    /// measure several qubits, each in the computational basis
+    ///
+    /// Up to MAX_MARGINAL_QUBITS qubits are measured together: one pass sums up the probabilities of their values,
+    /// and once a value is sampled one more pass collapses and renormalizes the state.
+    std::vector<bool> multimeasure(std::vector<logical_qubit_id> const& qs)
+    {
+        assert(batch_qubits_ == 0);
+        flush();
+        std::vector<bool> results;
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        for (std::size_t first = 0; first < qs.size(); first += MAX_MARGINAL_QUBITS)
+        {
+            const std::size_t last = std::min(qs.size(), first + MAX_MARGINAL_QUBITS);
+            std::vector<positional_qubit_id> ps =
+                get_qubit_positions(std::vector<logical_qubit_id>(qs.begin() + first, qs.begin() + last));
+            std::vector<double> probs = kernels::marginal(wfn_, ps);
+
+            // the probabilities add up to 1 up to rounding, a value of probability 0 is never picked
+            double r = uniform(rng_) * std::accumulate(probs.begin(), probs.end(), 0.);
+            std::size_t val = 0;
+            while (val + 1 < probs.size() && (r >= probs[val] || probs[val] == 0.))
+                r -= probs[val++];
+            while (probs[val] == 0.)
+                --val;
+
+            kernels::multicollapse(wfn_, ps, val, static_cast<RealType>(1. / std::sqrt(probs[val])));
+            for (std::size_t k = 0; k < ps.size(); ++k)
+                results.push_back((val >> k) & 1);
+        }
+        return results;
+    }
+
     bool jointmeasure(std::vector<logical_qubit_id> const& qs)
     {
+        assert(batch_qubits_ == 0);
         flush();
         std::vector<positional_qubit_id> ps = get_qubit_positions(qs);
         std::uniform_real_distribution<double> uniform(0., 1.);
@@ -656,6 +1391,47 @@ class Wavefunction
         return result;
     }
 
+    /// outcomes of measuring the qubits qs in nshots runs that end in the current state, which is left unchanged,
+    /// packed with the result of qs[0] as the lowest bit
+    std::vector<std::uint64_t> sampleshots(std::vector<logical_qubit_id> const& qs, std::size_t nshots)
+    {
+        assert(batch_qubits_ == 0);
+        flush();
+        return kernels::sampleshots(wfn_, get_qubit_positions(qs), nshots, rng_);
+    }
+
+    /// measure the Pauli product of the bases bs on the qubits qs, without changing the basis of the qubits: one pass
+    /// for the probability of the result and one to project onto its eigenspace and renormalize
+    bool jointmeasure(std::vector<Gates::Basis> const& bs, std::vector<logical_qubit_id> const& qs)
+    {
+        assert(batch_qubits_ == 0);
+        flush();
+        std::vector<positional_qubit_id> ps = get_qubit_positions(qs);
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        const double p = 0.5 * (1. - kernels::pauliexpectation(wfn_, bs, ps));
+        bool result = (uniform(rng_) < p);
+        kernels::pauliproject(wfn_, bs, ps, result, static_cast<RealType>(1. / std::sqrt(result ? p : 1. - p)));
+        return result;
+    }
+
+    /// expectation values of the Pauli products of the bases bs[k] on the qubits qs, in one pass over the state
+    std::vector<double> pauliexpectations(
+        std::vector<std::vector<Gates::Basis>> const& bs,
+        std::vector<logical_qubit_id> const& qs) const
+    {
+        assert(batch_qubits_ == 0);
+        flush();
+        return kernels::pauliexpectations(wfn_, bs, get_qubit_positions(qs));
+    }
+
+    /// expectation value of the Pauli product of the bases bs on the qubits qs
+    double pauliexpectation(std::vector<Gates::Basis> const& bs, std::vector<logical_qubit_id> const& qs) const
+    {
+        assert(batch_qubits_ == 0);
+        flush();
+        return kernels::pauliexpectation(wfn_, bs, get_qubit_positions(qs));
+    }
+
     void apply_controlled_exp(
         std::vector<Gates::Basis> const& bs,
         double phi,
@@ -664,22 +1440,34 @@ class Wavefunction
     {
         flush();
         kernels::apply_controlled_exp(wfn_, bs, phi, get_qubit_positions(cs), get_qubit_positions(qs));
+        gate_count_ += batch_size();
     }
 
     /// checks if the qubit is in classical state
     bool isclassical(logical_qubit_id q) const
+    {
+        return classicalvalue(q) < 2;
+    }
+
+    /// the value of the qubit if it is in a classical state, 2 otherwise, in a single probe of the state
+    unsigned classicalvalue(logical_qubit_id q) const
+    {
+        flush();
+        return kernels::probeclassical(wfn_, get_qubit_position(q));
+    }
+
+    /// the values of the qubits if they are in a classical state, 2 for the others, in a single probe of the state
+    std::vector<unsigned> classicalvalues(std::vector<logical_qubit_id> const& qs) const
     {
         flush();
-        return kernels::isclassical(wfn_, get_qubit_position(q));
+        return kernels::probeclassical(wfn_, get_qubit_positions(qs));
     }
 
     /// returns the classical value of a qubit (if classical)
     /// \pre the qubit has to be in a classical state in the computational basis
     bool getvalue(logical_qubit_id q) const
     {
-        flush();
-        assert(isclassical(q));
-        int res = kernels::getvalue(wfn_, get_qubit_position(q));
+        unsigned res = classicalvalue(q);
         if (res == 2) std::cout << *this;
 
         assert(res < 2);
@@ -703,41 +1491,28 @@ class Wavefunction
     template <class Gate>
     void apply(Gate const& g)
     {
-        std::vector<logical_qubit_id> cs;
-        pending_gates_.emplace_back(cs, g.qubit(), g.matrix());
-        if (pending_gates_.size() > MAX_PENDING_GATES)
-        {
-            flush();
-        }
-
-        fused_.shouldFlush(wfn_, cs, g.qubit());
+        enqueue(ControlList(), g);
     }
 
     /// generic application of a multiply controlled gate
     template <class Gate>
-    void apply_controlled(std::vector<logical_qubit_id> cs, Gate const& g)
+    void apply_controlled(std::vector<logical_qubit_id> const& cs, Gate const& g)
     {
-        pending_gates_.emplace_back(cs, g.qubit(), g.matrix());
-        if (pending_gates_.size() > MAX_PENDING_GATES)
-        {
-            flush();
-        }
-
-        fused_.shouldFlush(wfn_, cs, g.qubit());
+        enqueue(ControlList(cs), g);
     }
 
     /// generic application of a controlled gate
     template <class Gate>
     void apply_controlled(logical_qubit_id c, Gate const& g)
     {
-        apply_controlled(std::vector<logical_qubit_id>{c}, g);
+        enqueue(ControlList{c}, g);
     }
 
     /// unoptimized application of a doubly controlled gate
     template <class Gate>
     void apply_controlled(logical_qubit_id c1, logical_qubit_id c2, Gate const& g)
     {
-        apply_controlled(std::vector<logical_qubit_id>{c1, c2}, g);
+        enqueue(ControlList{c1, c2}, g);
     }
 
     template <class A>
@@ -3,6 +3,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <cstddef>
 #include <memory>
 #include <new>
@@ -11,6 +12,7 @@
 #include <malloc.h>
 #else
 #include <cstdlib>
+#include <sys/mman.h>
 #endif
 
 #include "SafeInt.hpp"
@@ -22,7 +24,41 @@ namespace Quantum
 namespace SIMULATOR
 {
 
+/// Page policy for allocations of at least LARGE_ALLOCATION_BYTES, i.e. for large states
+///
+/// Transparent asks the kernel to back the mapping with transparent huge pages (madvise), Explicit maps it from the
+/// reserved huge page pool (MAP_HUGETLB) and falls back to Transparent when the pool is too small. With either policy
+/// the pages are first touched by the OpenMP threads in equal consecutive ranges, the split each sweep of the gate
+/// ThreadPool starts from, so that on a NUMA machine a page tends to be placed near the thread that works on it. That
+/// is only a hint: the OpenMP threads and the pool's workers are different threads, on the same cores only if both
+/// are pinned, and stolen chunks move around. Only supported on Linux.
+enum class HugePages
+{
+    Off,
+    Transparent,
+    Explicit
+};
+
+/// process-wide, applies to the allocations made after it is set
+inline std::atomic<HugePages>& huge_pages_policy()
+{
+    static std::atomic<HugePages> policy(HugePages::Off);
+    return policy;
+}
+
+inline void set_huge_pages(HugePages policy)
+{
+    huge_pages_policy().store(policy);
+}
+
+inline HugePages huge_pages()
+{
+    return huge_pages_policy().load();
+}
+
 /// a C++11 allocator for aligned memory
+///
+/// Large allocations are mapped directly, in whole huge pages, according to the HugePages policy.
 
 template <typename T, unsigned Align = 64>
 class AlignedAlloc
@@ -51,11 +87,44 @@ class AlignedAlloc
     {
     }
 
+    static constexpr size_type LARGE_ALLOCATION_BYTES = size_type(1) << 25;
+    static constexpr size_type HUGE_PAGE_BYTES = size_type(1) << 21;
+
     pointer allocate(size_type n)
     {
         pointer ptr;
         SafeInt<size_type> sz(n);
         sz *= sizeof(T);
+#ifndef _WIN32
+        const size_type bytes = sz;
+        if (bytes >= LARGE_ALLOCATION_BYTES)
+        {
+            const size_type len = mapped_bytes(bytes);
+            const HugePages policy = huge_pages();
+            // page aligned, which is at least Align
+            void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+            if (policy == HugePages::Explicit)
+            {
+                int hugetlb = MAP_HUGETLB;
+#ifdef MAP_HUGE_2MB
+                hugetlb |= MAP_HUGE_2MB; // the length is rounded to these
+#endif
+                p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | hugetlb, -1, 0);
+            }
+#endif
+            if (p == MAP_FAILED)
+            {
+                p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (p == MAP_FAILED) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+                if (policy != HugePages::Off) madvise(p, len, MADV_HUGEPAGE);
+#endif
+            }
+            if (policy != HugePages::Off) first_touch(p, len);
+            return reinterpret_cast<pointer>(p);
+        }
+#endif
 #ifdef _WIN32
         ptr = reinterpret_cast<pointer>(_aligned_malloc(sz, Align));
         if (ptr == 0) throw std::bad_alloc();
@@ -65,8 +134,15 @@ class AlignedAlloc
         return ptr;
     }
 
-    void deallocate(pointer ptr, size_type) noexcept
+    void deallocate(pointer ptr, size_type n) noexcept
     {
+#ifndef _WIN32
+        if (n * sizeof(T) >= LARGE_ALLOCATION_BYTES)
+        {
+            munmap(ptr, mapped_bytes(n * sizeof(T)));
+            return;
+        }
+#endif
 #ifdef _WIN32
         _aligned_free(ptr);
 #else
@@ -110,6 +186,23 @@ class AlignedAlloc
     {
         return true;
     }
+
+  private:
+    // large mappings are rounded up to whole huge pages whatever the policy, so deallocate knows the length
+    static size_type mapped_bytes(size_type bytes) noexcept
+    {
+        return (bytes + HUGE_PAGE_BYTES - 1) & ~(HUGE_PAGE_BYTES - 1);
+    }
+
+    // writes one byte of each 4k page, in equal consecutive ranges per OpenMP thread
+    static void first_touch(void* p, size_type len) noexcept
+    {
+        char* bytes = static_cast<char*>(p);
+        const std::ptrdiff_t npages = static_cast<std::ptrdiff_t>(len >> 12);
+#pragma omp parallel for schedule(static)
+        for (std::ptrdiff_t i = 0; i < npages; ++i)
+            bytes[i << 12] = 0;
+    }
 };
 
 } // namespace SIMULATOR
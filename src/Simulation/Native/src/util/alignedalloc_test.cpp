@@ -0,0 +1,52 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "config.hpp"
+#include "alignedalloc.hpp"
+#include <cassert>
+#include <complex>
+#include <cstdint>
+#include <vector>
+
+using namespace Microsoft::Quantum::SIMULATOR;
+
+using Vector = std::vector<std::complex<double>, AlignedAlloc<std::complex<double>, 64>>;
+
+const std::size_t large = AlignedAlloc<std::complex<double>, 64>::LARGE_ALLOCATION_BYTES / 16;
+
+bool aligned(void const* p)
+{
+    return reinterpret_cast<std::uintptr_t>(p) % 64 == 0;
+}
+
+void testpolicy(HugePages policy)
+{
+    set_huge_pages(policy);
+    assert(huge_pages() == policy);
+
+    // grows from a small allocation to a large mapping (not a multiple of a huge page) and back
+    Vector v(3, 1.);
+    v.resize(large + 3, 2.);
+    assert(aligned(v.data()));
+    assert(v[0] == 1. && v[2] == 1. && v[3] == 2. && v[large + 2] == 2.);
+    for (std::size_t i = 0; i < v.size(); i += 4096)
+        v[i] = static_cast<double>(i);
+
+    Vector copy(v);
+    assert(aligned(copy.data()) && copy[4096] == 4096. && copy[large + 2] == 2.);
+
+    v.resize(5);
+    v.shrink_to_fit();
+    assert(aligned(v.data()) && v[2] == 1. && v[4] == 2.);
+}
+
+int main()
+{
+    assert(huge_pages() == HugePages::Off);
+    testpolicy(HugePages::Off);
+    testpolicy(HugePages::Transparent);
+    // falls back to transparent huge pages without a reserved pool
+    testpolicy(HugePages::Explicit);
+    set_huge_pages(HugePages::Off);
+    return 0;
+}
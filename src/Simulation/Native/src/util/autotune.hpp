@@ -0,0 +1,182 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include "cpuid.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace Microsoft
+{
+namespace Quantum
+{
+namespace SIMULATOR
+{
+
+// Fusion and threading parameters measured to be the fastest for one size of the state (see Fused::autotune)
+struct TunedConfig
+{
+    int span = 0;
+    int depth = 0;
+    int threads = 0;
+};
+
+// Where Fused takes its parameters from: the built-in heuristics only, earlier tuning runs stored in the cache file
+// (the default), or benchmarks of the state sizes that aren't in the cache yet
+enum class Autotune { Off, Cached, On };
+
+// Identifies the hosts and the kernels a tuned configuration is valid for: the processor model, the instruction sets it
+// supports, the number of logical cores and the name of the kernels (which includes the precision). Blanks are
+// replaced so that the key is a single word of the cache file.
+inline std::string tuning_key(std::string const& kernels)
+{
+    std::string key = cpuModel();
+    if (key.empty()) key = "unknown";
+    key += "|";
+    key += haveAVX() ? "avx" : "noavx";
+    if (haveFMA()) key += "+fma";
+    if (haveAVX2()) key += "+avx2";
+    if (haveAVX512()) key += "+avx512";
+    key += "|" + std::to_string(std::thread::hardware_concurrency()) + "|" + kernels;
+    std::replace_if(key.begin(), key.end(), [](char c) { return c == ' ' || c == '\t' || c == '\n'; }, '_');
+    return key;
+}
+
+// Configurations tuned on this host, kept in a text file with one line `key qubits span depth threads` per size of
+// the state. Each file is parsed once per process, at the first lookup, and looked up in memory after that. It is
+// re-read before an entry is added and then replaced as a whole, so that simulators (or processes) tuning at the
+// same time never leave it half written; the last one wins.
+class TuningCache
+{
+  public:
+    explicit TuningCache(std::string path) : path_(std::move(path)) {}
+
+    // $QDK_SIM_AUTOTUNE_CACHE, or .qdk_sim_autotune in the home directory, empty if neither is set
+    static std::string default_path()
+    {
+        std::string path = getenv_string("QDK_SIM_AUTOTUNE_CACHE");
+        if (!path.empty()) return path;
+#ifdef _WIN32
+        std::string home = getenv_string("USERPROFILE");
+#else
+        std::string home = getenv_string("HOME");
+#endif
+        return home.empty() ? home : home + "/.qdk_sim_autotune";
+    }
+
+    std::string const& path() const
+    {
+        return path_;
+    }
+
+    bool find(std::string const& key, unsigned qubits, TunedConfig& config) const
+    {
+        std::lock_guard<std::mutex> lock(files_mutex());
+        auto file = files().find(path_);
+        if (file == files().end()) file = files().emplace(path_, load()).first;
+        auto it = file->second.find({key, qubits});
+        if (it == file->second.end()) return false;
+        config = it->second;
+        return true;
+    }
+
+    // false if the file can't be written, the entry is found by this process all the same
+    bool store(std::string const& key, unsigned qubits, TunedConfig const& config) const
+    {
+        if (path_.empty()) return false;
+        std::lock_guard<std::mutex> lock(files_mutex());
+        Entries& entries = files()[path_];
+        entries = load();
+        entries[{key, qubits}] = config;
+
+        std::string tmp = path_ + "." + std::to_string(std::random_device()()) + ".tmp";
+        {
+            std::ofstream out(tmp);
+            for (auto const& e : entries)
+                out << e.first.first << " " << e.first.second << " " << e.second.span << " " << e.second.depth << " "
+                    << e.second.threads << "\n";
+            if (!out)
+            {
+                std::remove(tmp.c_str());
+                return false;
+            }
+        }
+        if (std::rename(tmp.c_str(), path_.c_str()) != 0)
+        {
+            // rename doesn't replace an existing file on Windows
+            std::remove(path_.c_str());
+            if (std::rename(tmp.c_str(), path_.c_str()) != 0)
+            {
+                std::remove(tmp.c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+
+  private:
+    using Entries = std::map<std::pair<std::string, unsigned>, TunedConfig>;
+
+    // the entries of the files parsed by this process, by path
+    static std::map<std::string, Entries>& files()
+    {
+        static std::map<std::string, Entries> files;
+        return files;
+    }
+
+    static std::mutex& files_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    // skips malformed lines
+    Entries load() const
+    {
+        Entries entries;
+        std::ifstream in(path_);
+        std::string line;
+        while (std::getline(in, line))
+        {
+            std::istringstream fields(line);
+            std::string key;
+            unsigned qubits;
+            TunedConfig config;
+            if (fields >> key >> qubits >> config.span >> config.depth >> config.threads && config.span > 0 &&
+                config.depth > 0 && config.threads > 0)
+                entries[{key, qubits}] = config;
+        }
+        return entries;
+    }
+
+    static std::string getenv_string(char const* name)
+    {
+#ifdef _MSC_VER
+        char* value = NULL;
+        size_t len;
+        if (_dupenv_s(&value, &len, name) != 0 || value == NULL) return "";
+        std::string s(value);
+        free(value);
+        return s;
+#else
+        char const* value = getenv(name);
+        return value == NULL ? "" : value;
+#endif
+    }
+
+    std::string path_;
+};
+
+} // namespace SIMULATOR
+} // namespace Quantum
+} // namespace Microsoft
@@ -0,0 +1,68 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "config.hpp"
+#include "autotune.hpp"
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+using namespace Microsoft::Quantum::SIMULATOR;
+
+void testkey()
+{
+    std::string key = tuning_key("avx2-64");
+    assert(key.find(' ') == std::string::npos);
+    assert(key.size() > 7 && key.compare(key.size() - 7, 7, "avx2-64") == 0);
+    assert(key == tuning_key("avx2-64"));
+    assert(key != tuning_key("avx2-32"));
+}
+
+void testcache()
+{
+    const std::string path = "autotune_test.cache";
+    std::remove(path.c_str());
+
+    TuningCache cache(path);
+    TunedConfig config;
+    assert(!cache.find("host", 20, config));
+
+    TunedConfig a;
+    a.span = 4;
+    a.depth = 999;
+    a.threads = 8;
+    TunedConfig b;
+    b.span = 2;
+    b.depth = 40;
+    b.threads = 1;
+    assert(cache.store("host", 20, a));
+    assert(cache.store("host", 12, b));
+    assert(cache.store("other", 20, b));
+
+    // a new cache reads the entries back from the file
+    TuningCache reloaded(path);
+    assert(reloaded.find("host", 20, config) && config.span == 4 && config.depth == 999 && config.threads == 8);
+    assert(reloaded.find("host", 12, config) && config.span == 2 && config.depth == 40 && config.threads == 1);
+    assert(reloaded.find("other", 20, config) && config.span == 2);
+    assert(!reloaded.find("host", 16, config));
+
+    // replaces the entry, and skips lines it doesn't understand
+    assert(cache.store("host", 20, b));
+    {
+        std::ofstream out(path, std::ios::app);
+        out << "garbage\nhost 16 0 999 4\n";
+    }
+    assert(reloaded.find("host", 20, config) && config.span == 2 && config.threads == 1);
+    assert(!reloaded.find("host", 16, config));
+
+    assert(!TuningCache("").store("host", 20, a));
+    std::remove(path.c_str());
+}
+
+int main()
+{
+    testkey();
+    testcache();
+    return 0;
+}
@@ -1,10 +1,15 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
 
+#pragma once
+
 #include "config.hpp"
 #include <iostream>
+#include <string>
 #ifdef _MSC_VER
 #include <intrin.h>
+#else
+#include <cpuid.h>
 #endif
 
 namespace Microsoft
@@ -94,5 +99,26 @@ inline bool haveFMA()
         return false;
     }
 }
+// The brand string of the processor, e.g. "Intel(R) Xeon(R) Gold 6148 CPU @ 2.40GHz", empty if it isn't reported
+inline std::string cpuModel()
+{
+    unsigned regs[12] = {0};
+#ifndef _MSC_VER
+    if (__get_cpuid_max(0x80000000u, nullptr) < 0x80000004u) return "";
+    for (unsigned i = 0; i < 3; ++i)
+        __get_cpuid(0x80000002u + i, &regs[4 * i], &regs[4 * i + 1], &regs[4 * i + 2], &regs[4 * i + 3]);
+#else
+    int cpuInfo[4];
+    __cpuid(cpuInfo, 0x80000000);
+    if (static_cast<unsigned>(cpuInfo[0]) < 0x80000004u) return "";
+    for (unsigned i = 0; i < 3; ++i)
+        __cpuid(reinterpret_cast<int*>(&regs[4 * i]), 0x80000002 + i);
+#endif
+    regs[11] &= 0x00ffffffu; // make sure the 48 bytes are NUL terminated
+    std::string model(reinterpret_cast<char const*>(regs));
+    auto first = model.find_first_not_of(' ');
+    if (first == std::string::npos) return "";
+    return model.substr(first, model.find_last_not_of(' ') - first + 1);
+}
 } // namespace Quantum
 } // namespace Microsoft
@@ -6,6 +6,7 @@
 
 int main()
 {
+    std::cout << "CPU: " << Microsoft::Quantum::cpuModel() << "\n";
     if (Microsoft::Quantum::haveAVX512()) std::cout << "Have AVX-512\n";
     if (Microsoft::Quantum::haveAVX2()) std::cout << "Have AVX2\n";
     if (Microsoft::Quantum::haveFMA()) std::cout << "Have FMA\n";
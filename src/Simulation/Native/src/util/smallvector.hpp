@@ -0,0 +1,171 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <initializer_list>
+#include <type_traits>
+#include <vector>
+
+namespace Microsoft
+{
+namespace Quantum
+{
+namespace SIMULATOR
+{
+
+/// A vector of trivially copyable elements that stores up to N elements inline and only allocates on the heap when it
+/// grows beyond that, e.g. the few control qubits of a gate
+
+template <class T, unsigned N>
+class SmallVector
+{
+    static_assert(std::is_trivially_copyable<T>::value, "SmallVector only supports trivially copyable elements");
+
+  public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using iterator = T*;
+    using const_iterator = T const*;
+
+    SmallVector() {}
+
+    SmallVector(std::initializer_list<T> ini)
+    {
+        assign(ini.begin(), ini.end());
+    }
+
+    template <class A>
+    SmallVector(std::vector<T, A> const& v)
+    {
+        assign(v.data(), v.data() + v.size());
+    }
+
+    template <class It>
+    SmallVector(It first, It last)
+    {
+        assign(first, last);
+    }
+
+    template <class It>
+    void assign(It first, It last)
+    {
+        clear();
+        for (; first != last; ++first)
+            push_back(*first);
+    }
+
+    size_type size() const
+    {
+        return size_;
+    }
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+    /// true as long as the elements are stored inline
+    bool is_small() const
+    {
+        return size_ <= N;
+    }
+
+    T* data()
+    {
+        return is_small() ? small_ : large_.data();
+    }
+    T const* data() const
+    {
+        return is_small() ? small_ : large_.data();
+    }
+
+    iterator begin()
+    {
+        return data();
+    }
+    iterator end()
+    {
+        return data() + size_;
+    }
+    const_iterator begin() const
+    {
+        return data();
+    }
+    const_iterator end() const
+    {
+        return data() + size_;
+    }
+
+    T& operator[](size_type i)
+    {
+        assert(i < size_);
+        return data()[i];
+    }
+    T const& operator[](size_type i) const
+    {
+        assert(i < size_);
+        return data()[i];
+    }
+    T& back()
+    {
+        return (*this)[size_ - 1];
+    }
+    T const& back() const
+    {
+        return (*this)[size_ - 1];
+    }
+
+    void push_back(T const& x)
+    {
+        if (size_ < N)
+            small_[size_] = x;
+        else
+        {
+            if (size_ == N) large_.assign(small_, small_ + N);
+            large_.push_back(x);
+        }
+        ++size_;
+    }
+
+    void pop_back()
+    {
+        assert(size_ > 0);
+        if (size_ > N)
+        {
+            large_.pop_back();
+            if (size_ == N + 1) std::copy(large_.begin(), large_.end(), small_);
+        }
+        --size_;
+    }
+
+    /// keeps the heap storage (if any) for reuse
+    void clear()
+    {
+        large_.clear();
+        size_ = 0;
+    }
+
+    std::vector<T> to_vector() const
+    {
+        return std::vector<T>(begin(), end());
+    }
+
+    bool operator==(SmallVector const& rhs) const
+    {
+        return size_ == rhs.size_ && std::equal(begin(), end(), rhs.begin());
+    }
+    bool operator!=(SmallVector const& rhs) const
+    {
+        return !(*this == rhs);
+    }
+
+  private:
+    size_type size_ = 0;
+    T small_[N] = {};
+    std::vector<T> large_; // all elements once there are more than N
+};
+
+} // namespace SIMULATOR
+} // namespace Quantum
+} // namespace Microsoft
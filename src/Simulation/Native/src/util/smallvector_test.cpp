@@ -0,0 +1,66 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "smallvector.hpp"
+#include <cassert>
+#include <vector>
+
+template <unsigned N>
+void testgrow()
+{
+    Microsoft::Quantum::SIMULATOR::SmallVector<unsigned, N> v;
+    assert(v.empty());
+
+    // grow past the inline storage and back
+    for (unsigned i = 0; i < 2 * N + 1; ++i)
+    {
+        v.push_back(i);
+        assert(v.size() == i + 1);
+        assert(v.is_small() == (v.size() <= N));
+        for (unsigned j = 0; j <= i; ++j)
+            assert(v[j] == j);
+        assert(v.back() == i);
+    }
+    for (unsigned i = 2 * N + 1; i-- > 0;)
+    {
+        assert(v.back() == i);
+        v.pop_back();
+        assert(v.size() == i);
+        for (unsigned j = 0; j < i; ++j)
+            assert(v[j] == j);
+    }
+
+    // test copy and comparison
+    const std::vector<unsigned> digits = {3, 1, 4, 1, 5};
+    v.assign(digits.begin(), digits.end());
+    Microsoft::Quantum::SIMULATOR::SmallVector<unsigned, N> w = v;
+    assert(w == v);
+    assert(w.to_vector() == digits);
+    w.back() = 9;
+    assert(w != v);
+
+    v.clear();
+    assert(v.empty() && v.is_small());
+}
+
+void testinit()
+{
+    Microsoft::Quantum::SIMULATOR::SmallVector<unsigned, 2> a = {7, 8};
+    assert(a.size() == 2 && a[0] == 7 && a[1] == 8);
+
+    std::vector<unsigned> v = {1, 2, 3};
+    Microsoft::Quantum::SIMULATOR::SmallVector<unsigned, 2> b = v;
+    assert(!b.is_small());
+    assert(b.to_vector() == v);
+    assert(std::equal(b.begin(), b.end(), v.begin()));
+}
+
+int main()
+{
+    testgrow<1>();
+    testgrow<2>();
+    testgrow<4>();
+    testinit();
+
+    return 0;
+}
@@ -0,0 +1,336 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include "util/openmp.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace Microsoft
+{
+namespace Quantum
+{
+namespace SIMULATOR
+{
+
+/// Persistent worker threads for the sweeps over a state.
+///
+/// Each call to `run` splits the sweep into chunks and deals them out in equal consecutive ranges, one per thread
+/// taking part. A thread that is done with its own range steals chunks from the end of the others', so that a
+/// preempted or slower core doesn't hold up the whole sweep. The calling thread takes part as well. Between sweeps the
+/// workers spin for a little while and then sleep, so starting a sweep costs much less than opening an OpenMP region,
+/// which matters for mid-size states where the kernels themselves are quick. A sweep may use fewer threads than the
+/// pool has, which is how simulators sharing a pool keep to their own budget; sweeps from different threads take
+/// turns.
+class ThreadPool
+{
+  public:
+    /// 0 threads picks the number of OpenMP threads. Workers are pinned to a core each if `pinned`, or if the
+    /// QDK_SIM_PINTHREADS environment variable is set to 1. The cores are taken in turn from the ones the thread that
+    /// starts the workers may run on (when the pool is created or its threads are changed), so pools created in
+    /// different partitions of the machine stay in their own.
+    explicit ThreadPool(unsigned threads = 0, bool pinned = false)
+    {
+#ifndef _WIN32
+        const char* env = std::getenv("QDK_SIM_PINTHREADS");
+        if (env != nullptr && env[0] == '1') pinned = true;
+#endif
+        pinned_ = pinned;
+        start(threads);
+    }
+
+    ~ThreadPool()
+    {
+        stop();
+    }
+
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    /// Number of threads including the calling one
+    unsigned threads() const
+    {
+        return threads_;
+    }
+
+    void set_threads(unsigned threads)
+    {
+        std::lock_guard<std::mutex> lock(run_mutex_);
+        stop();
+        start(threads);
+    }
+
+    bool pinned() const
+    {
+        return pinned_;
+    }
+
+    void set_pinned(bool pinned)
+    {
+        std::lock_guard<std::mutex> lock(run_mutex_);
+        stop();
+        pinned_ = pinned;
+        start(threads_);
+    }
+
+    /// Calls f(first, last) on chunks of at least `grain` iterations that cover [0, n), with at most `threads` threads
+    /// (all of the pool if 0), and waits for all of them. Sweeps started from within a sweep run serially. Rethrows
+    /// the first exception thrown by f.
+    template <class F>
+    void run(std::size_t n, F const& f, unsigned threads = 0, std::size_t grain = 1)
+    {
+        if (n == 0) return;
+        grain = std::max<std::size_t>(grain, 1);
+        const std::size_t participants = std::min<std::size_t>(
+            threads == 0 ? threads_ : std::min(threads, threads_), (n + grain - 1) / grain);
+        if (participants <= 1 || in_sweep())
+        {
+            f(0, n);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(run_mutex_);
+        const std::size_t nchunks = std::min((n + grain - 1) / grain, participants * CHUNKS_PER_THREAD);
+        for (std::size_t p = 0; p < participants; p++)
+            ranges_[p].chunks.store(pack(nchunks * p / participants, nchunks * (p + 1) / participants));
+        job_.invoke = &invoke<F>;
+        job_.f = &f;
+        job_.n = n;
+        job_.nchunks = nchunks;
+        error_ = nullptr;
+        pending_.store(participants - 1, std::memory_order_relaxed);
+        {
+            // the workers that aren't taking part only look at the number of participants, not at the job
+            std::lock_guard<std::mutex> wake(wake_mutex_);
+            sweep_.store(((sweep_.load() >> 8) + 1) << 8 | participants, std::memory_order_release);
+        }
+        wake_.notify_all();
+
+        // the kernels open OpenMP regions of their own, which have to stay serial in all the threads of the sweep
+#ifdef _OPENMP
+        const int ompThreads = omp_get_max_threads();
+        omp_set_num_threads(1);
+#endif
+        work(0, participants);
+#ifdef _OPENMP
+        omp_set_num_threads(ompThreads);
+#endif
+        while (pending_.load(std::memory_order_acquire) != 0)
+            std::this_thread::yield();
+
+        if (error_) std::rethrow_exception(error_);
+    }
+
+    /// The pool of the simulators that don't have one of their own
+    static std::shared_ptr<ThreadPool> const& shared()
+    {
+        static std::shared_ptr<ThreadPool> pool = std::make_shared<ThreadPool>();
+        return pool;
+    }
+
+  private:
+    static constexpr std::size_t CHUNKS_PER_THREAD = 8;
+    static constexpr int SPIN_ITERATIONS = 1 << 12;
+
+    struct Job
+    {
+        void (*invoke)(void const*, std::size_t, std::size_t) = nullptr;
+        void const* f = nullptr;
+        std::size_t n = 0;
+        std::size_t nchunks = 0;
+    };
+
+    /// The chunks [first, end) left of a thread's range, first in the low and end in the high half, so that the owner
+    /// taking chunks from the front and thieves taking them from the back agree with a single compare-and-swap.
+    struct alignas(64) Range
+    {
+        std::atomic<std::uint64_t> chunks{0};
+    };
+
+    template <class F>
+    static void invoke(void const* f, std::size_t first, std::size_t last)
+    {
+        (*static_cast<F const*>(f))(first, last);
+    }
+
+    static std::uint64_t pack(std::size_t first, std::size_t end)
+    {
+        return static_cast<std::uint64_t>(first) | static_cast<std::uint64_t>(end) << 32;
+    }
+
+    static bool& in_sweep()
+    {
+        thread_local bool flag = false;
+        return flag;
+    }
+
+    static bool take_front(Range& range, std::size_t& chunk)
+    {
+        std::uint64_t r = range.chunks.load(std::memory_order_relaxed);
+        while ((r & 0xffffffffu) < (r >> 32))
+        {
+            if (range.chunks.compare_exchange_weak(r, r + 1, std::memory_order_acquire))
+            {
+                chunk = static_cast<std::size_t>(r & 0xffffffffu);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool take_back(Range& range, std::size_t& chunk)
+    {
+        std::uint64_t r = range.chunks.load(std::memory_order_relaxed);
+        while ((r & 0xffffffffu) < (r >> 32))
+        {
+            if (range.chunks.compare_exchange_weak(r, r - (std::uint64_t(1) << 32), std::memory_order_acquire))
+            {
+                chunk = static_cast<std::size_t>(r >> 32) - 1;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void execute(std::size_t chunk)
+    {
+        const std::size_t first = job_.n * chunk / job_.nchunks;
+        const std::size_t last = job_.n * (chunk + 1) / job_.nchunks;
+        try
+        {
+            job_.invoke(job_.f, first, last);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(error_mutex_);
+            if (!error_) error_ = std::current_exception();
+        }
+    }
+
+    void work(std::size_t self, std::size_t participants)
+    {
+        in_sweep() = true;
+        std::size_t chunk;
+        while (take_front(ranges_[self], chunk))
+            execute(chunk);
+        // no new chunks turn up, so one round over the others is enough
+        for (std::size_t k = 1; k < participants; k++)
+        {
+            Range& victim = ranges_[(self + k) % participants];
+            while (take_back(victim, chunk))
+                execute(chunk);
+        }
+        in_sweep() = false;
+    }
+
+    // `seen` is the last sweep before the worker was started, it may only get to run after the next one has started
+    void worker(std::size_t self, std::uint64_t seen)
+    {
+#ifdef _OPENMP
+        omp_set_num_threads(1);
+#endif
+#ifdef __linux__
+        if (!cpus_.empty())
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(cpus_[self % cpus_.size()], &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        }
+#endif
+        for (;;)
+        {
+            std::uint64_t sweep = sweep_.load(std::memory_order_acquire);
+            for (int spin = 0; (sweep >> 8) == seen && !stopping_.load(std::memory_order_relaxed); spin++)
+            {
+                if (spin < SPIN_ITERATIONS)
+                {
+                    std::this_thread::yield();
+                }
+                else
+                {
+                    std::unique_lock<std::mutex> lock(wake_mutex_);
+                    wake_.wait(lock, [&] { return (sweep_.load() >> 8) != seen || stopping_.load(); });
+                }
+                sweep = sweep_.load(std::memory_order_acquire);
+            }
+            if (stopping_.load()) return;
+            seen = sweep >> 8;
+            const std::size_t participants = static_cast<std::size_t>(sweep & 0xff);
+            if (self < participants)
+            {
+                work(self, participants);
+                pending_.fetch_sub(1, std::memory_order_release);
+            }
+        }
+    }
+
+    // at most 255 threads, the number of participants is kept in the low byte of sweep_
+    void start(unsigned threads)
+    {
+        if (threads == 0) threads = static_cast<unsigned>(std::max(1, omp_get_max_threads()));
+        threads_ = std::min(threads, 255u);
+        ranges_ = std::vector<Range>(threads_);
+        stopping_.store(false);
+#ifdef __linux__
+        cpus_.clear();
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (pinned_ && pthread_getaffinity_np(pthread_self(), sizeof(allowed), &allowed) == 0)
+        {
+            for (int c = 0; c < CPU_SETSIZE; c++)
+                if (CPU_ISSET(c, &allowed)) cpus_.push_back(c);
+        }
+#endif
+        for (std::size_t w = 1; w < threads_; w++)
+            workers_.emplace_back(&ThreadPool::worker, this, w, sweep_.load() >> 8);
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> wake(wake_mutex_);
+            stopping_.store(true);
+        }
+        wake_.notify_all();
+        for (auto& w : workers_)
+            w.join();
+        workers_.clear();
+    }
+
+    unsigned threads_ = 1;
+    bool pinned_ = false;
+    std::vector<int> cpus_; // the cores the workers are pinned to in turn, none if they aren't pinned
+    std::vector<std::thread> workers_;
+    std::vector<Range> ranges_;
+
+    Job job_;
+    std::exception_ptr error_;
+    std::mutex error_mutex_;
+    std::atomic<std::size_t> pending_{0};
+
+    std::mutex run_mutex_;
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    std::atomic<std::uint64_t> sweep_{0}; // number of the sweep << 8 | number of participants
+    std::atomic<bool> stopping_{false};
+};
+
+} // namespace SIMULATOR
+} // namespace Quantum
+} // namespace Microsoft
@@ -0,0 +1,134 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "config.hpp"
+#include "threadpool.hpp"
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace Microsoft::Quantum::SIMULATOR;
+
+// every index is visited exactly once, by at most `budget` threads
+void testcover(ThreadPool& pool, std::size_t n, unsigned budget, std::size_t grain)
+{
+    std::vector<std::atomic<int>> visits(n);
+    std::mutex mutex;
+    std::set<std::thread::id> ids;
+    pool.run(n, [&](std::size_t first, std::size_t last) {
+        assert(first < last && last <= n);
+        for (std::size_t i = first; i < last; i++)
+            visits[i]++;
+        std::lock_guard<std::mutex> lock(mutex);
+        ids.insert(std::this_thread::get_id());
+    }, budget, grain);
+    for (auto const& v : visits)
+        assert(v == 1);
+    assert(ids.size() <= (budget == 0 ? pool.threads() : budget));
+}
+
+#ifdef __linux__
+// pinned workers stay on the cores the creating thread may run on
+void testpinned()
+{
+    cpu_set_t saved;
+    CPU_ZERO(&saved);
+    const int got = pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved);
+    assert(got == 0);
+    if (got != 0) return;
+    int last = CPU_SETSIZE - 1;
+    while (!CPU_ISSET(last, &saved))
+        last--;
+    cpu_set_t restricted;
+    CPU_ZERO(&restricted);
+    CPU_SET(last, &restricted);
+    const int set = pthread_setaffinity_np(pthread_self(), sizeof(restricted), &restricted);
+    assert(set == 0);
+    if (set != 0) return;
+
+    const std::thread::id creator = std::this_thread::get_id();
+    ThreadPool pool(4, true);
+    std::atomic<bool> outside(false);
+    pool.run(4, [&](std::size_t, std::size_t) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (std::this_thread::get_id() == creator) return;
+        cpu_set_t mine;
+        CPU_ZERO(&mine);
+        pthread_getaffinity_np(pthread_self(), sizeof(mine), &mine);
+        if (CPU_COUNT(&mine) != 1 || !CPU_ISSET(last, &mine)) outside = true;
+    });
+    assert(!outside);
+
+    pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+}
+#endif
+
+int main()
+{
+    ThreadPool pool(4);
+    assert(pool.threads() == 4);
+    for (std::size_t n : {1, 3, 4, 31, 1000, 100000})
+    {
+        for (unsigned budget : {0, 1, 2, 4, 8})
+            testcover(pool, n, budget, 1);
+        testcover(pool, n, 0, 16);
+    }
+    for (int i = 0; i < 1000; i++)
+        testcover(pool, 64, 0, 1);
+
+    // sweeps started from a sweep run serially
+    std::atomic<std::size_t> sum(0);
+    pool.run(8, [&](std::size_t first, std::size_t last) {
+        for (std::size_t i = first; i < last; i++)
+            pool.run(10, [&](std::size_t f, std::size_t l) {
+                assert(f == 0 && l == 10);
+                sum += l - f;
+            });
+    });
+    assert(sum == 80);
+
+    // the first exception is passed on, and the pool still works afterwards
+    bool thrown = false;
+    try
+    {
+        pool.run(100, [](std::size_t first, std::size_t) {
+            if (first == 0) throw std::runtime_error("first chunk");
+        });
+    }
+    catch (std::runtime_error const&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    testcover(pool, 1000, 0, 1);
+
+    // sweeps from several threads take turns
+    std::vector<std::thread> callers;
+    for (int t = 0; t < 3; t++)
+        callers.emplace_back([&pool] {
+            for (int i = 0; i < 100; i++)
+                testcover(pool, 500, 2, 1);
+        });
+    for (auto& c : callers)
+        c.join();
+
+    pool.set_threads(2);
+    assert(pool.threads() == 2);
+    testcover(pool, 1000, 0, 1);
+    pool.set_pinned(true);
+    assert(pool.pinned());
+    testcover(pool, 1000, 0, 1);
+
+    assert(ThreadPool::shared() == ThreadPool::shared() && ThreadPool::shared()->threads() >= 1);
+    testcover(*ThreadPool::shared(), 1000, 0, 1);
+
+#ifdef __linux__
+    testpinned();
+#endif
+    return 0;
+}